@@ -0,0 +1,569 @@
+//guyes134@gmail.com
+
+#ifndef BTREE_HPP
+#define BTREE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+
+/**
+ * @brief An ordered k-ary search tree (a B-tree) that stores a set of values.
+ *
+ * Tree<T, k> keeps the nodes where the caller puts them, so searching it is O(n). BTree<T, k> decides the
+ * place of each value itself: every node holds up to k - 1 sorted values and up to k children, all leaves are
+ * at the same depth, and each value separates the values of the child on its left from those of the child on
+ * its right. insert, erase, find and lower_bound visit one node per level, O(log_k n) nodes, and within a
+ * node use a binary search. The InOrderIterator yields the values in sorted order for any k.
+ *
+ * Values are compared only with <. Two values where neither is smaller than the other are the same key,
+ * so a second insert of an equivalent value is ignored (Complex values of the same magnitude are equivalent).
+ * Iterators are invalidated by insert and erase.
+ *
+ * @tparam T The type of the values.
+ * @tparam k The maximum number of children of a node (the fanout); at least 3.
+ */
+template<typename T, int k = 3>
+class BTree {
+    static_assert(k >= 3, "A B-tree node needs room for at least two values to split");
+
+private:
+    /**
+     * @brief A node of the B-tree.
+     */
+    struct BNode {
+        std::vector<T> keys;  ///< The sorted values; between min_keys and k - 1 (the root may have fewer).
+        std::vector<std::unique_ptr<BNode>> children;  ///< Empty for a leaf, otherwise keys.size() + 1 children.
+
+        BNode() { keys.reserve(k); }
+
+        bool leaf() const { return children.empty(); }
+    };
+
+    static constexpr size_t max_keys = k - 1;  ///< A node with more values is split.
+    static constexpr size_t min_keys = (k + 1) / 2 - 1;  ///< A node (other than the root) with fewer values is refilled.
+
+    std::unique_ptr<BNode> root;  ///< The root node, or nullptr for an empty tree.
+    size_t count = 0;  ///< The number of values.
+    size_t levels = 0;  ///< The height of the tree.
+    std::vector<std::pair<BNode*, size_t>> path;  ///< Scratch for insert and erase: the ancestors and the child index taken in each.
+
+public:
+    /**
+     * @brief Constructs an empty tree.
+     */
+    BTree() = default;
+
+    BTree(const BTree&) = delete;
+    BTree& operator=(const BTree&) = delete;
+    BTree(BTree&&) noexcept = default;
+    BTree& operator=(BTree&&) noexcept = default;
+
+    /**
+     * @brief Gets the k-ary value (maximum number of children per node).
+     */
+    int getK_Ary() const {
+        return k;
+    }
+
+    /**
+     * @brief Gets the number of values in the tree.
+     */
+    size_t size() const {
+        return count;
+    }
+
+    /**
+     * @brief Checks whether the tree has no values.
+     */
+    bool empty() const {
+        return count == 0;
+    }
+
+    /**
+     * @brief Gets the number of levels of the tree (0 for an empty tree).
+     */
+    size_t height() const {
+        return levels;
+    }
+
+    /**
+     * @brief Adds a value to the tree.
+     *
+     * The value goes into a leaf. A leaf that overflows is split around its middle value, which moves up into
+     * the parent, and so on up to the root, so the tree only grows in height at the root.
+     *
+     * @param key The value to add.
+     * @return True if the value was added, false if an equivalent value was already in the tree.
+     */
+    bool insert(const T& key) {
+        if (!root) {
+            root = std::make_unique<BNode>();
+            root->keys.push_back(key);
+            count = 1;
+            levels = 1;
+            return true;
+        }
+
+        path.clear();
+        BNode* node = root.get();
+        while (true) {
+            size_t i = position(*node, key);
+            if (i < node->keys.size() && !(key < node->keys[i])) return false;
+            if (node->leaf()) {
+                node->keys.insert(node->keys.begin() + i, key);
+                break;
+            }
+            path.emplace_back(node, i);
+            node = node->children[i].get();
+        }
+        ++count;
+
+        while (node->keys.size() > max_keys) {
+            size_t middle = max_keys / 2;
+            auto right = std::make_unique<BNode>();
+            right->keys.assign(std::make_move_iterator(node->keys.begin() + middle + 1),
+                               std::make_move_iterator(node->keys.end()));
+            T separator = std::move(node->keys[middle]);
+            node->keys.erase(node->keys.begin() + middle, node->keys.end());
+            if (!node->leaf()) {
+                right->children.assign(std::make_move_iterator(node->children.begin() + middle + 1),
+                                       std::make_move_iterator(node->children.end()));
+                node->children.erase(node->children.begin() + middle + 1, node->children.end());
+            }
+
+            if (path.empty()) {
+                auto new_root = std::make_unique<BNode>();
+                new_root->keys.push_back(std::move(separator));
+                new_root->children.push_back(std::move(root));
+                new_root->children.push_back(std::move(right));
+                root = std::move(new_root);
+                ++levels;
+                break;
+            }
+            auto [parent, index] = path.back();
+            path.pop_back();
+            parent->keys.insert(parent->keys.begin() + index, std::move(separator));
+            parent->children.insert(parent->children.begin() + index + 1, std::move(right));
+            node = parent;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Removes a value from the tree.
+     *
+     * A value in an inner node is replaced by its predecessor, so a value is always removed from a leaf. A node
+     * left with too few values borrows one through the parent from a sibling that has values to spare, or else
+     * is merged with a sibling, which takes a value from the parent and may leave the parent short in turn.
+     *
+     * @param key The value to remove.
+     * @return True if the value was removed, false if no equivalent value was in the tree.
+     */
+    bool erase(const T& key) {
+        path.clear();
+        BNode* node = root.get();
+        size_t i = 0;
+        while (node) {
+            i = position(*node, key);
+            if (i < node->keys.size() && !(key < node->keys[i])) break;
+            if (node->leaf()) return false;
+            path.emplace_back(node, i);
+            node = node->children[i].get();
+        }
+        if (!node) return false;
+
+        if (node->leaf()) {
+            node->keys.erase(node->keys.begin() + i);
+        } else {
+            // Replace the value with the largest value of its left subtree
+            BNode* found = node;
+            path.emplace_back(node, i);
+            node = node->children[i].get();
+            while (!node->leaf()) {
+                path.emplace_back(node, node->children.size() - 1);
+                node = node->children.back().get();
+            }
+            found->keys[i] = std::move(node->keys.back());
+            node->keys.pop_back();
+        }
+        --count;
+
+        while (!path.empty() && node->keys.size() < min_keys) {
+            auto [parent, index] = path.back();
+            path.pop_back();
+            rebalance(*parent, index);
+            node = parent;
+        }
+
+        if (root->keys.empty()) {
+            root = root->leaf() ? nullptr : std::move(root->children[0]);
+            --levels;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Checks whether the tree has a value equivalent to the key.
+     */
+    bool contains(const T& key) const {
+        const BNode* node = root.get();
+        while (node) {
+            size_t i = position(*node, key);
+            if (i < node->keys.size() && !(key < node->keys[i])) return true;
+            node = node->leaf() ? nullptr : node->children[i].get();
+        }
+        return false;
+    }
+
+    /**
+     * @brief Removes all the values.
+     */
+    void clear() {
+        root.reset();
+        count = 0;
+        levels = 0;
+    }
+
+
+/**---------------------------------------In Order Iterator-------------------------------------------**/
+
+/**
+ * @brief An iterator over the values of the tree in sorted order.
+ *
+ * The iterator keeps the path from the root to the current value: for each node on it, the index of the next
+ * value of that node to visit. Advancing either descends to the leftmost value of the next child or returns to
+ * the first ancestor with a value left, so a full traversal visits each node once.
+ */
+    class InOrderIterator {
+    private:
+        std::vector<std::pair<const BNode*, size_t>> stack;  ///< The path to the current value; empty at the end.
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        /**
+         * @brief Constructs an end iterator.
+         */
+        InOrderIterator() = default;
+
+        /**
+         * @brief Constructs an iterator at the smallest value of a subtree, or the end iterator for nullptr.
+         *
+         * @param root The root of the tree.
+         */
+        explicit InOrderIterator(const BNode* root) {
+            descend_left(root);
+        }
+
+        /**
+         * @brief Constructs an iterator from a path built by the tree (used by find and lower_bound).
+         */
+        explicit InOrderIterator(std::vector<std::pair<const BNode*, size_t>> path) : stack(std::move(path)) {
+            skip_finished();
+        }
+
+        /**
+         * @brief Dereferences the iterator to access the current value.
+         *
+         * @return A const reference to the value; changing it in place could break the order of the tree.
+         */
+        const T& operator*() const {
+            return stack.back().first->keys[stack.back().second];
+        }
+
+        /**
+         * @brief Provides a pointer-like interface to the current value.
+         */
+        const T* operator->() const {
+            return &**this;
+        }
+
+        /**
+         * @brief Advances the iterator to the next value in sorted order.
+         *
+         * @return A reference to the updated iterator.
+         */
+        InOrderIterator& operator++() {
+            auto& [node, index] = stack.back();
+            ++index;
+            if (!node->leaf()) {
+                descend_left(node->children[index].get());
+            } else {
+                skip_finished();
+            }
+            return *this;
+        }
+
+        /**
+         * @brief Checks if two iterators are not equal.
+         *
+         * @param other The other iterator to compare with.
+         * @return True if the iterators are not equal, false otherwise.
+         */
+        bool operator!=(const InOrderIterator& other) const {
+            return !(*this == other);
+        }
+
+        /**
+         * @brief Checks if two iterators are at the same value (or both at the end).
+         *
+         * @param other The other iterator to compare with.
+         * @return True if the iterators are equal, false otherwise.
+         */
+        bool operator==(const InOrderIterator& other) const {
+            if (stack.empty() || other.stack.empty()) return stack.empty() == other.stack.empty();
+            return stack.back() == other.stack.back();
+        }
+
+    private:
+        /**
+         * @brief Pushes the path from a node down to its smallest value.
+         */
+        void descend_left(const BNode* node) {
+            for (; node; node = node->leaf() ? nullptr : node->children[0].get()) {
+                stack.emplace_back(node, 0);
+            }
+        }
+
+        /**
+         * @brief Pops the nodes that have no value left to visit.
+         */
+        void skip_finished() {
+            while (!stack.empty() && stack.back().second == stack.back().first->keys.size()) stack.pop_back();
+        }
+    };
+
+/**
+ * @brief Returns an iterator at the smallest value.
+ */
+    InOrderIterator begin_in_order() const {
+        return InOrderIterator(root.get());
+    }
+
+/**
+ * @brief Returns the end iterator of the sorted traversal.
+ */
+    InOrderIterator end_in_order() const {
+        return InOrderIterator(nullptr);
+    }
+
+/**
+ * @brief Same as begin_in_order, so the tree can be used in a range-based for loop.
+ */
+    InOrderIterator begin() const {
+        return begin_in_order();
+    }
+
+/**
+ * @brief Same as end_in_order.
+ */
+    InOrderIterator end() const {
+        return end_in_order();
+    }
+
+    /**
+     * @brief Finds the value equivalent to a key.
+     *
+     * @param key The value to search for.
+     * @return An iterator at the value, or end_in_order() if there is none.
+     */
+    InOrderIterator find(const T& key) const {
+        auto it = lower_bound(key);
+        if (it != end_in_order() && !(key < *it)) return it;
+        return end_in_order();
+    }
+
+    /**
+     * @brief Finds the smallest value that is not less than a key.
+     *
+     * Iterating from the result visits the values in [key, largest] in sorted order.
+     *
+     * @param key The value to search for.
+     * @return An iterator at the value, or end_in_order() if every value is less than the key.
+     */
+    InOrderIterator lower_bound(const T& key) const {
+        std::vector<std::pair<const BNode*, size_t>> path;
+        path.reserve(levels);
+        for (const BNode* node = root.get(); node;) {
+            size_t i = position(*node, key);
+            path.emplace_back(node, i);
+            if (node->leaf() || (i < node->keys.size() && !(key < node->keys[i]))) break;
+            node = node->children[i].get();
+        }
+        return InOrderIterator(std::move(path));
+    }
+
+
+
+/**---------------------------------------Range Iterator-------------------------------------------**/
+
+/**
+ * @brief An iterator over the values in a closed interval [lo, hi], in sorted order.
+ *
+ * It starts at lower_bound(lo) and stops at the first value greater than hi, so a query visits the O(log_k n)
+ * nodes on the path to lo plus the nodes that hold the values it yields, not the whole tree.
+ */
+    class RangeIterator {
+    private:
+        InOrderIterator current;  ///< The current value, or the end iterator.
+        std::optional<T> high;  ///< The upper bound (empty for the end iterator).
+
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        /**
+         * @brief Constructs an end iterator.
+         */
+        RangeIterator() = default;
+
+        /**
+         * @brief Constructs an iterator at a value, which is an end iterator if the value is past the bound.
+         *
+         * @param start The first candidate value.
+         * @param high The upper bound.
+         */
+        RangeIterator(InOrderIterator start, const T& high) : current(std::move(start)), high(high) {
+            stop_after_bound();
+        }
+
+        /**
+         * @brief Dereferences the iterator to access the current value.
+         */
+        const T& operator*() const {
+            return *current;
+        }
+
+        /**
+         * @brief Provides a pointer-like interface to the current value.
+         */
+        const T* operator->() const {
+            return &*current;
+        }
+
+        /**
+         * @brief Advances the iterator to the next value in the interval.
+         *
+         * @return A reference to the updated iterator.
+         */
+        RangeIterator& operator++() {
+            ++current;
+            stop_after_bound();
+            return *this;
+        }
+
+        /**
+         * @brief Checks if two iterators are not equal.
+         */
+        bool operator!=(const RangeIterator& other) const {
+            return !(*this == other);
+        }
+
+        /**
+         * @brief Checks if two iterators are at the same value (or both at the end).
+         */
+        bool operator==(const RangeIterator& other) const {
+            return current == other.current;
+        }
+
+    private:
+        /**
+         * @brief Turns the iterator into the end iterator once it passes the upper bound.
+         */
+        void stop_after_bound() {
+            if (current != InOrderIterator() && *high < *current) current = InOrderIterator();
+        }
+    };
+
+    /**
+     * @brief Returns an iterator over the values in [lo, hi] in sorted order.
+     *
+     * The bounds use the same order as the tree, so for Complex the interval is by magnitude.
+     *
+     * @param lo The smallest value to include.
+     * @param hi The largest value to include.
+     * @return A RangeIterator at the first value in the interval; compare it with end_range().
+     */
+    RangeIterator range(const T& lo, const T& hi) const {
+        if (hi < lo) return end_range();
+        return RangeIterator(lower_bound(lo), hi);
+    }
+
+    /**
+     * @brief Returns the end iterator of range.
+     */
+    RangeIterator end_range() const {
+        return RangeIterator();
+    }
+
+private:
+    /**
+     * @brief Gets the index of the first value of a node that is not less than the key.
+     */
+    static size_t position(const BNode& node, const T& key) {
+        return std::lower_bound(node.keys.begin(), node.keys.end(), key) - node.keys.begin();
+    }
+
+    /**
+     * @brief Refills the child at an index of a node, which has one value less than min_keys.
+     */
+    static void rebalance(BNode& parent, size_t index) {
+        BNode& child = *parent.children[index];
+        BNode* left = index > 0 ? parent.children[index - 1].get() : nullptr;
+        BNode* right = index + 1 < parent.children.size() ? parent.children[index + 1].get() : nullptr;
+
+        if (left && left->keys.size() > min_keys) {
+            // Rotate right: the separator moves down into the child and the largest value of the left sibling up
+            child.keys.insert(child.keys.begin(), std::move(parent.keys[index - 1]));
+            parent.keys[index - 1] = std::move(left->keys.back());
+            left->keys.pop_back();
+            if (!left->leaf()) {
+                child.children.insert(child.children.begin(), std::move(left->children.back()));
+                left->children.pop_back();
+            }
+        } else if (right && right->keys.size() > min_keys) {
+            // Rotate left: the separator moves down into the child and the smallest value of the right sibling up
+            child.keys.push_back(std::move(parent.keys[index]));
+            parent.keys[index] = std::move(right->keys.front());
+            right->keys.erase(right->keys.begin());
+            if (!right->leaf()) {
+                child.children.push_back(std::move(right->children.front()));
+                right->children.erase(right->children.begin());
+            }
+        } else if (left) {
+            merge(parent, index - 1);
+        } else {
+            merge(parent, index);
+        }
+    }
+
+    /**
+     * @brief Merges the children at index and index + 1 of a node, with the value that separates them.
+     */
+    static void merge(BNode& parent, size_t index) {
+        BNode& left = *parent.children[index];
+        std::unique_ptr<BNode> right = std::move(parent.children[index + 1]);
+        left.keys.push_back(std::move(parent.keys[index]));
+        left.keys.insert(left.keys.end(), std::make_move_iterator(right->keys.begin()),
+                         std::make_move_iterator(right->keys.end()));
+        left.children.insert(left.children.end(), std::make_move_iterator(right->children.begin()),
+                             std::make_move_iterator(right->children.end()));
+        parent.keys.erase(parent.keys.begin() + index);
+        parent.children.erase(parent.children.begin() + index + 1);
+    }
+};
+
+#endif // BTREE_HPP
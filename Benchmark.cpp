@@ -0,0 +1,686 @@
+//guyes134@gmail.com
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "Tree.hpp"
+#include "Complex.hpp"
+#include "PerfCounters.hpp"
+#include "BTree.hpp"
+#include "TreeLog.hpp"
+#include "TreeCodec.hpp"
+#include "SuccinctTree.hpp"
+#include "TreeWriter.hpp"
+#include "TreeReader.hpp"
+
+
+// * Benchmarks for every tree operation, at sizes from --min-size to --max-size (powers of 10).
+// * The results are printed to stdout as one JSON document: ns/op and allocated bytes/node for each
+// * operation, value type and size. Usage: ./run_bench [--min-size N] [--max-size N] [--type int|double|Complex]
+// *                                                     [--filter OPERATION] [--perf]
+// * --perf also reads the hardware counters (cycles, instructions, LLC, branch and dTLB misses) around each
+// * measured run with perf_event_open and reports them per node; unavailable counters are reported as null.
+// * Build with BENCH_FLAGS="-O2 -DNDEBUG -DTREE_STATS" to add the TreeStats counters per operation to the JSON,
+// * and for the searches the prune rate (the fraction of the nodes that a search did not visit).
+
+
+/**-----------------------------------Allocation Counting-------------------------------------------**/
+
+// The global operator new is replaced so the benchmark can report how many bytes each operation allocates.
+// GCC cannot see that the replaced new and delete match once they are inlined, so that warning is disabled.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+static size_t allocated_bytes = 0;
+
+void* operator new(size_t size) {
+    allocated_bytes += size;
+    if (void* pointer = std::malloc(size == 0 ? 1 : size)) return pointer;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept {
+    std::free(pointer);
+}
+
+
+/**-----------------------------------Helpers-------------------------------------------**/
+
+/**
+ * @brief A stream buffer that drops everything, so operator<< is measured without any I/O.
+ */
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize count) override { return count; }
+};
+
+template<typename T> const char* type_name();
+template<> const char* type_name<int>() { return "int"; }
+template<> const char* type_name<double>() { return "double"; }
+template<> const char* type_name<Complex>() { return "Complex"; }
+
+/**
+ * @brief Makes the i-th value of a benchmark tree. Values decrease so heapify has work to do.
+ */
+template<typename T> T make_value(size_t i, size_t n);
+template<> int make_value<int>(size_t i, size_t n) { return static_cast<int>(n - i); }
+template<> double make_value<double>(size_t i, size_t n) { return static_cast<double>(n - i) * 0.5; }
+template<> Complex make_value<Complex>(size_t i, size_t n) { return Complex(static_cast<double>(n - i), 1.0); }
+
+/**
+ * @brief A value that is not in any benchmark tree, so find has to visit every node.
+ */
+template<typename T> T absent_value() { return T(-1); }
+
+/**
+ * @brief Builds a complete binary tree with n nodes, adding them in BFS order by parent handle.
+ *
+ * @param prepare Called with the empty tree before the nodes are added (to register observers).
+ * @param stride The i-th node gets value (i * stride) % n; a stride coprime with n scrambles the values.
+ */
+template<typename T, typename Prepare>
+Tree<T, 2> build_tree_with(size_t n, Prepare prepare, size_t stride = 1) {
+    Tree<T, 2> tree;
+    prepare(tree);
+    if (n == 0) return tree;
+    tree.add_root(make_value<T>(0, n));
+    std::vector<std::shared_ptr<Node<T>>> nodes{tree.getRoot()};
+    nodes.reserve(n);
+    for (size_t i = 1; i < n; ++i) {
+        nodes.push_back(tree.add_sub_node(nodes[(i - 1) / 2], make_value<T>(i * stride % n, n)));
+    }
+    return tree;
+}
+
+/**
+ * @brief Builds a complete binary tree with n nodes (see build_tree_with).
+ *
+ * @param pruned Whether to enable_pruned_find before adding the nodes.
+ */
+template<typename T>
+Tree<T, 2> build_tree(size_t n, bool pruned = false) {
+    return build_tree_with<T>(n, [pruned](Tree<T, 2>& tree) { if (pruned) tree.enable_pruned_find(); });
+}
+
+/**
+ * @brief Adds two sets of instrumentation counters.
+ */
+TreeStats add(const TreeStats& a, const TreeStats& b) {
+    return {a.node_allocations + b.node_allocations, a.bytes_allocated + b.bytes_allocated,
+            a.refcount_operations + b.refcount_operations, a.find_comparisons + b.find_comparisons,
+            a.find_pruned_subtrees + b.find_pruned_subtrees, a.pool_reuses + b.pool_reuses,
+            a.container_growths + b.container_growths};
+}
+
+/**
+ * @brief Formats the instrumentation counters per operation as JSON fields (empty without TREE_STATS).
+ *
+ * Operations that search also get find_prune_rate: the fraction of the n nodes that each search did not visit.
+ */
+std::string stats_json([[maybe_unused]] const TreeStats& stats, [[maybe_unused]] size_t ops, [[maybe_unused]] size_t n) {
+#ifdef TREE_STATS
+    auto per_op = [ops](size_t count) { return std::to_string(static_cast<double>(count) / static_cast<double>(ops)); };
+    std::string json = ", \"node_allocations_per_op\": " + per_op(stats.node_allocations) +
+                       ", \"tree_bytes_per_op\": " + per_op(stats.bytes_allocated) +
+                       ", \"refcount_operations_per_op\": " + per_op(stats.refcount_operations) +
+                       ", \"find_comparisons_per_op\": " + per_op(stats.find_comparisons) +
+                       ", \"find_pruned_subtrees_per_op\": " + per_op(stats.find_pruned_subtrees) +
+                       ", \"pool_reuses_per_op\": " + per_op(stats.pool_reuses) +
+                       ", \"container_growths_per_op\": " + per_op(stats.container_growths);
+    if (stats.find_comparisons + stats.find_pruned_subtrees > 0) {
+        double visited = static_cast<double>(stats.find_comparisons) / static_cast<double>(ops * n);
+        json += ", \"find_prune_rate\": " + std::to_string(1.0 - visited);
+    }
+    return json;
+#else
+    return "";
+#endif
+}
+
+volatile size_t sink = 0;  ///< Keeps the compiler from removing the traversals.
+
+
+/**-----------------------------------Benchmark Runner-------------------------------------------**/
+
+/**
+ * @brief Runs the measurements and collects the results.
+ */
+class Benchmark {
+private:
+    size_t min_size = 1000;
+    size_t max_size = 10000000;
+    std::string type_filter;
+    std::string operation_filter;
+    std::unique_ptr<PerfCounters> perf;  ///< The hardware counters, when --perf is given.
+    std::vector<std::string> results;  ///< One JSON object per measurement.
+
+public:
+    /**
+     * @brief Reads the command line options.
+     */
+    Benchmark(int argc, char** argv) {
+        for (int i = 1; i < argc; ++i) {
+            if (std::strcmp(argv[i], "--perf") == 0) {
+                perf = std::make_unique<PerfCounters>();
+                if (!perf->available()) std::cerr << "perf_event_open is not available; counters will be null" << std::endl;
+                continue;
+            }
+            if (i + 1 == argc) throw std::invalid_argument(std::string("Missing value for ") + argv[i]);
+            if (std::strcmp(argv[i], "--min-size") == 0) min_size = std::stoull(argv[i + 1]);
+            else if (std::strcmp(argv[i], "--max-size") == 0) max_size = std::stoull(argv[i + 1]);
+            else if (std::strcmp(argv[i], "--type") == 0) type_filter = argv[i + 1];
+            else if (std::strcmp(argv[i], "--filter") == 0) operation_filter = argv[i + 1];
+            else throw std::invalid_argument(std::string("Unknown option ") + argv[i]);
+            ++i;
+        }
+    }
+
+    /**
+     * @brief Benchmarks every operation for one value type.
+     */
+    template<typename T>
+    void run_type() {
+        if (!type_filter.empty() && type_filter != type_name<T>()) return;
+        for (size_t n = min_size; n <= max_size; n *= 10) {
+            run_size<T>(n);
+        }
+    }
+
+    /**
+     * @brief Prints all the results as a JSON document.
+     */
+    void print(std::ostream& os) const {
+        os << "{\n  \"benchmark\": \"tree\",\n  \"results\": [\n";
+        for (size_t i = 0; i < results.size(); ++i) {
+            os << "    " << results[i] << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        os << "  ]\n}\n";
+    }
+
+private:
+    /**
+     * @brief Measures one operation.
+     *
+     * @param operation The name of the operation.
+     * @param n The number of nodes in the tree.
+     * @param ops The number of operations in one run.
+     * @param runs The number of runs; setup is called before each one and is not measured.
+     * @param setup Prepares a run.
+     * @param run The measured code.
+     */
+    template<typename T>
+    void measure(const std::string& operation, size_t n, size_t ops, size_t runs,
+                 const std::function<void()>& setup, const std::function<void()>& run) {
+        if (!operation_filter.empty() && operation_filter != operation) return;
+
+        std::chrono::nanoseconds elapsed{0};
+        size_t bytes = 0;
+        TreeStats stats;
+        std::vector<uint64_t> hardware(perf ? perf->get_counters().size() : 0);
+        for (size_t r = 0; r < runs; ++r) {
+            setup();
+            Tree<T, 2>::reset_stats();
+            size_t bytes_before = allocated_bytes;
+            if (perf) perf->start();
+            auto start = std::chrono::steady_clock::now();
+            run();
+            elapsed += std::chrono::steady_clock::now() - start;
+            if (perf) perf->stop();
+            bytes += allocated_bytes - bytes_before;
+            stats = add(stats, Tree<T, 2>::stats());
+            for (size_t c = 0; c < hardware.size(); ++c) hardware[c] += perf->get_counters()[c].value;
+        }
+
+        double ns_per_op = static_cast<double>(elapsed.count()) / static_cast<double>(ops * runs);
+        double bytes_per_node = static_cast<double>(bytes) / static_cast<double>(n * runs);
+        results.push_back("{\"operation\": \"" + operation + "\", \"type\": \"" + type_name<T>() +
+                          "\", \"size\": " + std::to_string(n) + ", \"ops\": " + std::to_string(ops * runs) +
+                          ", \"ns_per_op\": " + std::to_string(ns_per_op) +
+                          ", \"bytes_per_node\": " + std::to_string(bytes_per_node) + stats_json(stats, ops * runs, n) +
+                          perf_json(hardware, n * runs) + "}");
+        std::cerr << operation << " " << type_name<T>() << " " << n << ": " << ns_per_op << " ns/op" << std::endl;
+    }
+
+    /**
+     * @brief Records the size of an encoded tree next to the size of its operator<< text.
+     */
+    template<typename T>
+    void report_size(const std::string& operation, size_t n, size_t bytes, size_t text_bytes) {
+        double per_node = static_cast<double>(bytes) / static_cast<double>(n);
+        double ratio = static_cast<double>(text_bytes) / static_cast<double>(bytes);
+        results.push_back("{\"operation\": \"" + operation + "\", \"type\": \"" + type_name<T>() +
+                          "\", \"size\": " + std::to_string(n) + ", \"encoded_bytes_per_node\": " + std::to_string(per_node) +
+                          ", \"text_bytes_per_node\": " + std::to_string(static_cast<double>(text_bytes) / static_cast<double>(n)) +
+                          ", \"compression_ratio\": " + std::to_string(ratio) + "}");
+        std::cerr << operation << " " << type_name<T>() << " " << n << ": " << per_node << " bytes/node, " << ratio
+                  << "x smaller than the text" << std::endl;
+    }
+
+    /**
+     * @brief Records the memory of a compact copy of a tree and the bits of it that store the shape.
+     */
+    template<typename T>
+    void report_memory(const std::string& operation, size_t n, size_t bytes, size_t topology_bits) {
+        if (!operation_filter.empty() && operation_filter != operation) return;
+        double per_node = static_cast<double>(bytes) / static_cast<double>(n);
+        double bits_per_node = static_cast<double>(topology_bits) / static_cast<double>(n);
+        results.push_back("{\"operation\": \"" + operation + "\", \"type\": \"" + type_name<T>() +
+                          "\", \"size\": " + std::to_string(n) + ", \"memory_bytes_per_node\": " + std::to_string(per_node) +
+                          ", \"topology_bits_per_node\": " + std::to_string(bits_per_node) + "}");
+        std::cerr << operation << " " << type_name<T>() << " " << n << ": " << per_node << " bytes/node, "
+                  << bits_per_node << " bits/node of shape" << std::endl;
+    }
+
+    /**
+     * @brief Formats the hardware counters per node as JSON fields (empty without --perf).
+     */
+    std::string perf_json(const std::vector<uint64_t>& hardware, size_t nodes) const {
+        std::string json;
+        for (size_t c = 0; c < hardware.size(); ++c) {
+            const auto& counter = perf->get_counters()[c];
+            json += ", \"" + counter.name + "_per_node\": ";
+            json += counter.fd < 0 ? "null" : std::to_string(static_cast<double>(hardware[c]) / static_cast<double>(nodes));
+        }
+        return json;
+    }
+
+    /**
+     * @brief Measures a full traversal with one of the iterators (one op per visited node).
+     */
+    template<typename T, typename Begin, typename End>
+    void measure_traversal(const std::string& operation, size_t n, size_t runs, Begin begin, End end) {
+        measure<T>(operation, n, n, runs, [] {}, [&] {
+            size_t count = 0;
+            for (auto it = begin(); it != end(); ++it) {
+                count += sizeof(*it);
+            }
+            sink = sink + count;
+        });
+    }
+
+    /**
+     * @brief Benchmarks every operation on trees with n nodes.
+     */
+    template<typename T>
+    void run_size(size_t n) {
+        size_t runs = std::max<size_t>(1, 1000000 / n);  // repeat the small sizes to get stable numbers
+        size_t searches = std::max<size_t>(1, 1000000 / n);  // find and add_sub_node by key are O(n) each
+        Tree<T, 2> tree;
+
+        measure<T>("add_sub_node", n, n, runs, [&] { tree = Tree<T, 2>(); }, [&] { tree = build_tree<T>(n); });
+
+        // Every insertion into a 64-ary tree looks for the first free slot of a parent with up to 64 children.
+        // Each node has 1 KiB of slots, so the larger sizes are skipped.
+        if (n <= 1000000) {
+            Tree<T, 64> wide;
+            measure<T>("add_sub_node_k64", n, n, runs, [&] { wide = Tree<T, 64>(); }, [&] {
+                wide.add_root(make_value<T>(0, n));
+                std::vector<std::shared_ptr<Node<T>>> nodes{wide.getRoot()};
+                nodes.reserve(n);
+                for (size_t i = 1; i < n; ++i) nodes.push_back(wide.add_sub_node(nodes[(i - 1) / 64], make_value<T>(i, n)));
+            });
+        }
+
+        tree = build_tree<T>(n);
+        T absent = absent_value<T>();
+        measure<T>("find", n, searches, 1, [] {}, [&] {
+            for (size_t i = 0; i < searches; ++i) sink = sink + (tree.find_node(absent) == nullptr);
+        });
+
+        // The last node in BFS order is on the right of the tree, so the unpruned search visits most nodes first.
+        // Its value is the smallest, so with the subtree bounds every subtree that does not contain it is skipped.
+        T last = make_value<T>(n - 1, n);
+        measure<T>("find_last", n, searches, 1, [] {}, [&] {
+            for (size_t i = 0; i < searches; ++i) sink = sink + (tree.find_node(last) != nullptr);
+        });
+
+        measure<T>("add_sub_node_pruned", n, n, runs, [&] { tree = Tree<T, 2>(); }, [&] { tree = build_tree<T>(n, true); });
+        tree = build_tree<T>(n, true);
+        measure<T>("find_pruned", n, searches, 1, [] {}, [&] {
+            for (size_t i = 0; i < searches; ++i) sink = sink + (tree.find_node(absent) == nullptr);
+        });
+        measure<T>("find_last_pruned", n, searches, 1, [] {}, [&] {
+            for (size_t i = 0; i < searches; ++i) sink = sink + (tree.find_node(last) != nullptr);
+        });
+
+        // With scrambled values almost every subtree spans the whole range, so the bounds only skip leaves and
+        // the pruned search pays one hash lookup per visited node for little: the worst case of the bounds.
+        constexpr size_t stride = 7919;  // a prime, so coprime with the sizes (powers of 10)
+        T scrambled_last = make_value<T>((n - 1) * stride % n, n);
+        tree = build_tree_with<T>(n, [](Tree<T, 2>&) {}, stride);
+        measure<T>("find_scrambled", n, searches, 1, [] {}, [&] {
+            for (size_t i = 0; i < searches; ++i) sink = sink + (tree.find_node(scrambled_last) != nullptr);
+        });
+        tree = build_tree_with<T>(n, [](Tree<T, 2>& empty) { empty.enable_pruned_find(); }, stride);
+        measure<T>("find_scrambled_pruned", n, searches, 1, [] {}, [&] {
+            for (size_t i = 0; i < searches; ++i) sink = sink + (tree.find_node(scrambled_last) != nullptr);
+        });
+
+        // The aggregates live in a hash map keyed by node: an insertion updates its ancestors (k + 1 lookups each),
+        // heapify updates the path above every swap, and of() is one lookup.
+        std::shared_ptr<SubtreeAggregate<T, SubtreeSize<T>>> sizes;
+        auto with_sizes = [&sizes](Tree<T, 2>& empty) { sizes = empty.add_aggregate(SubtreeSize<T>()); };
+        measure<T>("add_sub_node_aggregate", n, n, runs, [&] { tree = Tree<T, 2>(); },
+                   [&] { tree = build_tree_with<T>(n, with_sizes); });
+        tree = build_tree_with<T>(n, with_sizes);
+        std::vector<const Node<T>*> order{tree.getRoot().get()};  // BFS order; also used as the queue
+        for (size_t i = 0; i < order.size(); ++i) {
+            for (const auto& child : order[i]->get_children()) if (child) order.push_back(child.get());
+        }
+        measure<T>("aggregate_of", n, n, runs, [] {}, [&] {
+            size_t total = 0;
+            for (const Node<T>* node : order) total += sizes->of(*node);
+            sink = sink + total;
+        });
+        measure<T>("heapify_aggregate", n, n, runs, [&] { tree = build_tree_with<T>(n, with_sizes); },
+                   [&] { tree.heapify(tree.getRoot()); });
+        order.clear();
+
+        // add_sub_node by key searches for the parent; the last leaves in BFS order are the worst case for the search
+        size_t inserts = std::min(searches, (n + 1) / 2);
+        measure<T>("add_sub_node_by_key", n, inserts, 1, [&] { tree = build_tree<T>(n); }, [&] {
+            for (size_t i = 0; i < inserts; ++i) tree.add_sub_node(make_value<T>(n - 1 - i, n), make_value<T>(n + i, n));
+        });
+
+        tree = build_tree<T>(n);
+        measure_traversal<T>("begin_pre_order", n, runs,
+                             [&] { return tree.begin_pre_order(); }, [&] { return tree.end_pre_order(); });
+        measure_traversal<T>("begin_post_order", n, runs,
+                             [&] { return tree.begin_post_order(); }, [&] { return tree.end_post_order(); });
+        measure_traversal<T>("begin_in_order", n, runs,
+                             [&] { return tree.begin_in_order(); }, [&] { return tree.end_in_order(); });
+        measure_traversal<T>("begin_bfs_scan", n, runs,
+                             [&] { return tree.begin_bfs_scan(); }, [&] { return tree.end_bfs_scan(); });
+        measure_traversal<T>("begin_dfs_scan", n, runs,
+                             [&] { return tree.begin_dfs_scan(); }, [&] { return tree.end_dfs_scan(); });
+
+        measure<T>("heapify", n, n, runs, [&] { tree = build_tree<T>(n); }, [&] { tree.heapify(tree.getRoot()); });
+        measure<T>("myHeap", n, n, runs, [&] { tree = build_tree<T>(n); }, [&] {
+            size_t count = 0;
+            for (auto it = tree.myHeap(); it != tree.end_heap(); ++it) count += sizeof(*it);
+            sink = sink + count;
+        });
+
+        NullBuffer null_buffer;
+        std::ostream null_stream(&null_buffer);
+        tree = build_tree<T>(n);
+        measure<T>("operator<<", n, n, runs, [] {}, [&] { null_stream << tree; });
+
+        // The write_ operations format the same tree through TreeWriter's buffer, one per layout; the _file
+        // variants write to /dev/null through an ofstream, where operator<< pays for every small write
+        measure<T>("write_adjacency", n, n, runs, [] {}, [&] { TreeWriter<T, 2>::write(null_stream, tree); });
+        measure<T>("write_indented", n, n, runs, [] {}, [&] {
+            TreeWriter<T, 2>::write(null_stream, tree, TreeLayout::Indented);
+        });
+        measure<T>("write_parent_array", n, n, runs, [] {}, [&] {
+            TreeWriter<T, 2>::write(null_stream, tree, TreeLayout::ParentArray);
+        });
+        {
+            std::ofstream dev_null("/dev/null");
+            measure<T>("operator<<_file", n, n, runs, [] {}, [&] { dev_null << tree << std::flush; });
+            measure<T>("write_adjacency_file", n, n, runs, [] {}, [&] {
+                TreeWriter<T, 2>::write(dev_null, tree);
+                dev_null.flush();
+            });
+        }
+
+        // The read_ operations parse the text back: from a string stream for each layout, and from a file
+        // through the memory map
+        {
+            Tree<T, 2> parsed;
+            for (auto [operation, layout] : {std::pair{"read_adjacency", TreeLayout::Adjacency},
+                                             std::pair{"read_parent_array", TreeLayout::ParentArray}}) {
+                std::ostringstream text;
+                TreeWriter<T, 2>::write(text, tree, layout);
+                std::istringstream input;
+                measure<T>(operation, n, n, runs, [&] {
+                    input.str(text.str());
+                    input.clear();
+                    parsed = Tree<T, 2>();
+                }, [&] { parsed = TreeReader<T, 2>::read(input, layout); });
+            }
+            if (operation_filter.empty() || operation_filter == "read_file") {
+                auto path = (std::filesystem::temp_directory_path() / "tree_bench.txt").string();
+                {
+                    std::ofstream file(path);
+                    TreeWriter<T, 2>::write(file, tree);
+                }
+                measure<T>("read_file", n, n, runs, [&] { parsed = Tree<T, 2>(); },
+                           [&] { parsed = TreeReader<T, 2>::read_file(path); });
+                std::filesystem::remove(path);
+            }
+            parsed = Tree<T, 2>();
+        }
+
+        // write_compact encodes the tree (LOUDS shape and packed values) and read_compact builds it back;
+        // compact_size compares the encoded bytes with the operator<< text
+        if constexpr (std::is_trivially_copyable_v<T>) {
+            measure<T>("write_compact", n, n, runs, [] {}, [&] { TreeCodec<T, 2>::write(null_stream, tree); });
+            std::ostringstream encoded;
+            TreeCodec<T, 2>::write(encoded, tree);
+            std::istringstream input;
+            Tree<T, 2> decoded;
+            measure<T>("read_compact", n, n, runs, [&] {
+                input.str(encoded.str());
+                input.clear();
+                decoded = Tree<T, 2>();
+            }, [&] { decoded = TreeCodec<T, 2>::read(input); });
+            decoded = Tree<T, 2>();
+            if (operation_filter.empty() || operation_filter == "compact_size") {
+                std::ostringstream text;
+                text << tree;
+                report_size<T>("compact_size", n, encoded.str().size(), text.str().size());
+            }
+        }
+
+        // succinct_build copies the tree into LOUDS bits and a value array; the scans then navigate the bits
+        // (BFS is the order of the ids, DFS takes a few rank and select operations per node)
+        {
+            std::unique_ptr<SuccinctTree<T>> succinct;
+            measure<T>("succinct_build", n, n, runs, [&] { succinct.reset(); }, [&] {
+                succinct = std::make_unique<SuccinctTree<T>>(tree);
+            });
+            if (!succinct) succinct = std::make_unique<SuccinctTree<T>>(tree);
+            measure<T>("succinct_bfs", n, n, runs, [] {}, [&] {  // sums the ids, so the loop is not optimized away
+                size_t sum = 0;
+                for (auto it = succinct->begin_bfs_scan(); it != succinct->end_bfs_scan(); ++it) sum += it.id();
+                sink = sink + sum;
+            });
+            measure<T>("succinct_dfs", n, n, runs, [] {}, [&] {
+                size_t sum = 0;
+                for (auto it = succinct->begin_dfs_scan(); it != succinct->end_dfs_scan(); ++it) sum += it.id();
+                sink = sink + sum;
+            });
+            report_memory<T>("succinct_memory", n, succinct->memory_bytes(), succinct->topology_bits());
+        }
+
+        // clone copies the whole tree into arena blocks; operator== then compares every node of the two trees
+        Tree<T, 2> copy;
+        measure<T>("clone", n, n, runs, [&] { copy = Tree<T, 2>(); }, [&] { copy = tree.clone(); });
+        copy = tree.clone();
+        measure<T>("operator==", n, n, runs, [] {}, [&] { sink = sink + (copy == tree); });
+
+        // hash computes every node hash of a fresh copy. Then one leaf of the copy is changed per op, and
+        // rehash (only its path) and diff (only the subtrees whose hashes differ) are measured per change
+        measure<T>("hash", n, n, runs, [&] { copy = tree.clone(); }, [&] { sink = sink + copy.hash(); });
+        auto leaf = copy.getRoot();  // the leftmost leaf, at the full depth
+        while (leaf->getChildAt(0)) leaf = leaf->getChildAt(0);
+        sink = sink + tree.hash() + copy.hash();
+        size_t changes = 1000;
+        measure<T>("rehash", n, changes, 1, [] {}, [&] {
+            for (size_t i = 0; i < changes; ++i) {
+                copy.set_value(leaf, make_value<T>(i % 2 == 0 ? n : 0, n));
+                sink = sink + copy.hash();
+            }
+        });
+        measure<T>("diff", n, changes, 1, [] {}, [&] {
+            for (size_t i = 0; i < changes; ++i) {
+                copy.set_value(leaf, make_value<T>(i % 2 == 0 ? n : 0, n));
+                sink = sink + tree.diff(copy).size();
+            }
+        });
+
+        // patch makes and writes the edit script of one changed leaf, as it would be shipped to a replica;
+        // apply replays such a script on the replica (forth and back, so the base hash always matches)
+        measure<T>("patch", n, changes, 1, [] {}, [&] {
+            for (size_t i = 0; i < changes; ++i) {
+                copy.set_value(leaf, make_value<T>(i % 2 == 0 ? n : 0, n));
+                std::ostringstream out;
+                diff(tree, copy).write(out);
+                sink = sink + out.str().size();
+            }
+        });
+        copy.set_value(leaf, make_value<T>(n, n));
+        auto forth = diff(tree, copy), back = diff(copy, tree);
+        auto replica = tree.clone();
+        sink = sink + replica.hash();  // a replica keeps its hashes, so the check of the base hash is O(depth)
+        measure<T>("apply", n, changes, 1, [] {}, [&] {
+            for (size_t i = 0; i < changes; ++i) replica.apply(i % 2 == 0 ? forth : back);
+        });
+        replica = Tree<T, 2>();
+        copy = Tree<T, 2>();
+        leaf.reset();
+
+        // log_add_sub_node builds the tree with a TreeLog attached (one record per node, written in groups of
+        // 1 MiB and synced once at the end); recover reads the snapshot and the log back and replays them
+        if constexpr (std::is_trivially_copyable_v<T>) {
+            auto directory = std::filesystem::temp_directory_path();
+            std::string snapshot_path = (directory / "run_bench_tree.snapshot").string();
+            std::string log_path = (directory / "run_bench_tree.log").string();
+            Tree<T, 2> logged;
+            std::shared_ptr<TreeLog<T, 2>> log;
+            auto start = [&] {
+                logged = Tree<T, 2>();
+                log.reset();
+                logged.add_root(make_value<T>(0, n));
+                log = TreeLog<T, 2>::attach(logged, snapshot_path, log_path);
+            };
+            auto fill = [&] {
+                std::vector<std::shared_ptr<Node<T>>> nodes{logged.getRoot()};
+                nodes.reserve(n);
+                for (size_t i = 1; i < n; ++i) {
+                    nodes.push_back(logged.add_sub_node(nodes[(i - 1) / 2], make_value<T>(i, n)));
+                }
+                log->commit();
+            };
+            measure<T>("log_add_sub_node", n, n, runs, start, fill);
+            if (!log) {  // the filter skipped log_add_sub_node, but recover still needs its files
+                start();
+                fill();
+            }
+            Tree<T, 2> recovered;
+            measure<T>("recover", n, n, runs, [&] { recovered = Tree<T, 2>(); }, [&] {
+                recovered = TreeLog<T, 2>::recover(snapshot_path, log_path);
+            });
+            sink = sink + (recovered == logged);
+            logged = Tree<T, 2>();
+            log.reset();
+            std::filesystem::remove(snapshot_path);
+            std::filesystem::remove(log_path);
+        }
+
+        measure<T>("destruction", n, n, runs, [&] { tree = build_tree<T>(n); }, [&] { tree = Tree<T, 2>(); });
+
+        // Replaces the second half of the nodes in BFS order (the leaves) one at a time: each new node takes the
+        // freed slot of its parent and the memory block of the removed node
+        std::vector<std::shared_ptr<Node<T>>> leaves;
+        measure<T>("remove_and_add", n, n - n / 2, runs, [&] {
+            tree = build_tree<T>(n);
+            std::vector<std::shared_ptr<Node<T>>> order{tree.getRoot()};
+            for (size_t i = 0; i < order.size(); ++i) {
+                for (const auto& child : order[i]->get_children()) {
+                    if (child) order.push_back(child);
+                }
+            }
+            leaves.assign(order.begin() + n / 2, order.end());
+        }, [&] {
+            for (auto& leaf : leaves) {
+                auto up = leaf->parent();
+                if (!up) continue;
+                tree.remove_subtree(std::exchange(leaf, nullptr));
+                leaf = tree.add_sub_node(up, make_value<T>(n, n));
+            }
+        });
+        leaves.clear();
+
+        run_ordered<T>(n, runs, searches);
+    }
+
+    /**
+     * @brief Benchmarks the ordered BTree: inserts in a scattered order, lookups, sorted traversal and erases.
+     */
+    template<typename T>
+    void run_ordered(size_t n, size_t runs, size_t searches) {
+        constexpr int fanout = 16;
+        std::vector<T> values;
+        values.reserve(n);
+        for (size_t i = 0; i < n; ++i) values.push_back(make_value<T>((i * 7919) % n, n));  // 7919 is prime
+        BTree<T, fanout> ordered;
+
+        measure<T>("btree_insert", n, n, runs, [&] { ordered.clear(); }, [&] {
+            for (const auto& value : values) ordered.insert(value);
+        });
+
+        ordered.clear();
+        for (const auto& value : values) ordered.insert(value);
+        measure<T>("btree_lower_bound", n, n, runs, [] {}, [&] {
+            size_t found = 0;
+            for (const auto& value : values) found += ordered.lower_bound(value) != ordered.end_in_order();
+            sink = sink + found;
+        });
+        // Ranges of 32 consecutive values starting at scattered positions (one op per yielded value)
+        size_t queries = std::max<size_t>(1, n / 32);
+        measure<T>("btree_range", n, queries * std::min<size_t>(n, 32), runs, [] {}, [&] {
+            size_t count = 0;
+            for (size_t q = 0; q < queries; ++q) {
+                size_t start = (q * 7919) % (n - std::min<size_t>(n, 32) + 1);  // values decrease with i
+                T lo = make_value<T>(start + std::min<size_t>(n, 32) - 1, n), hi = make_value<T>(start, n);
+                for (auto it = ordered.range(lo, hi); it != ordered.end_range(); ++it) count += sizeof(*it);
+            }
+            sink = sink + count;
+        });
+        measure<T>("btree_find_absent", n, searches, 1, [] {}, [&] {
+            for (size_t i = 0; i < searches; ++i) sink = sink + ordered.contains(absent_value<T>());
+        });
+        measure<T>("btree_in_order", n, n, runs, [] {}, [&] {
+            size_t count = 0;
+            for (auto it = ordered.begin_in_order(); it != ordered.end_in_order(); ++it) count += sizeof(*it);
+            sink = sink + count;
+        });
+        measure<T>("btree_erase", n, n, runs, [&] {
+            ordered.clear();
+            for (const auto& value : values) ordered.insert(value);
+        }, [&] {
+            for (const auto& value : values) ordered.erase(value);
+        });
+    }
+};
+
+
+int main(int argc, char** argv) {
+    try {
+        Benchmark benchmark(argc, argv);
+        benchmark.run_type<int>();
+        benchmark.run_type<double>();
+        benchmark.run_type<Complex>();
+        benchmark.print(std::cout);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,8 +1,10 @@
 //guyes134@gmail.com
 
 #include "Complex.hpp"
+#include <algorithm>
 #include <cmath>
 #include <sstream>
+#include <string_view>
 
 /**
  * @brief Constructs a complex number.
@@ -32,7 +34,7 @@ double Complex::getImag() const {
 
 // Overload the comparison operators
 bool Complex::operator<(const Complex& other) const {
-    return std::sqrt(real * real + imag * imag) < std::sqrt(other.real * real + other.imag * imag);
+    return std::sqrt(real * real + imag * imag) < std::sqrt(other.real * other.real + other.imag * other.imag);
 }
 
 bool Complex::operator==(const Complex& other) const {
@@ -44,3 +46,35 @@ std::ostream& operator<<(std::ostream& os, const Complex& c) {
     os << "(" << c.real << " + " << c.imag << "i)";
     return os;
 }
+
+std::to_chars_result to_chars(char* first, char* last, const Complex& c) {
+    if (last - first < 1) return {last, std::errc::value_too_large};
+    *first++ = '(';
+    auto result = std::to_chars(first, last, c.getReal());
+    if (result.ec != std::errc() || last - result.ptr < 3) return {last, std::errc::value_too_large};
+    first = std::copy_n(" + ", 3, result.ptr);
+    result = std::to_chars(first, last, c.getImag());
+    if (result.ec != std::errc() || last - result.ptr < 2) return {last, std::errc::value_too_large};
+    first = result.ptr;
+    *first++ = 'i';
+    *first++ = ')';
+    return {first, std::errc()};
+}
+
+std::from_chars_result from_chars(const char* first, const char* last, Complex& c) {
+    const std::from_chars_result invalid{first, std::errc::invalid_argument};
+    double real, imag;
+    if (last - first < 1 || *first != '(') return invalid;
+    auto result = std::from_chars(first + 1, last, real);
+    if (result.ec != std::errc() || last - result.ptr < 3 || std::string_view(result.ptr, 3) != " + ") return invalid;
+    result = std::from_chars(result.ptr + 3, last, imag);
+    if (result.ec != std::errc() || last - result.ptr < 2 || std::string_view(result.ptr, 2) != "i)") return invalid;
+    c = Complex(real, imag);
+    return {result.ptr + 2, std::errc()};
+}
+
+// Equal numbers have equal hashes: std::hash<double> gives 0.0 and -0.0 the same hash
+size_t std::hash<Complex>::operator()(const Complex& c) const noexcept {
+    size_t real_hash = std::hash<double>{}(c.getReal());
+    return real_hash ^ (std::hash<double>{}(c.getImag()) + 0x9e3779b97f4a7c15 + (real_hash << 6) + (real_hash >> 2));
+}
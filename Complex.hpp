@@ -3,6 +3,9 @@
 #ifndef COMPLEX_HPP
 #define COMPLEX_HPP
 
+#include <charconv>
+#include <cstddef>
+#include <functional>
 #include <iostream>
 
 /**
@@ -28,4 +31,34 @@ public:
     friend std::ostream& operator<<(std::ostream& os, const Complex& c);
 };
 
+/**
+ * @brief Formats a complex number as operator<< does, "(real + imagi)", but with the shortest digits that read
+ * back exactly (std::to_chars), so TreeWriter can write Complex values without a stream.
+ *
+ * @param first The start of the output range.
+ * @param last The end of the output range.
+ * @param c The number to format.
+ * @return The end of the written characters, or errc::value_too_large if the range is too short.
+ */
+std::to_chars_result to_chars(char* first, char* last, const Complex& c);
+
+/**
+ * @brief Parses a complex number in the format of operator<< and to_chars, "(real + imagi)", so TreeReader
+ * can read Complex values without a stream.
+ *
+ * @param first The start of the input range.
+ * @param last The end of the input range.
+ * @param c The number to set; it is unchanged if the input does not match.
+ * @return The end of the parsed characters, or errc::invalid_argument (pointing at first) if they do not match.
+ */
+std::from_chars_result from_chars(const char* first, const char* last, Complex& c);
+
+/**
+ * @brief Hashes a complex number, so trees of Complex values can compute their hashes.
+ */
+template<>
+struct std::hash<Complex> {
+    size_t operator()(const Complex& c) const noexcept;
+};
+
 #endif // COMPLEX_HPP
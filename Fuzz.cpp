@@ -0,0 +1,370 @@
+//guyes134@gmail.com
+
+// libFuzzer harness for the tree mutations. Each input is decoded into a sequence of operations
+// (add_root, add_sub_node by value and by node, set_value, heapify, persistent updates, long chains,
+// snapshots decoded from a parent array, remove_subtree and detach/reattach) applied to a binary and a 3-ary
+// tree. After the operations every iterator, clone, hash, diff and patch are run and the structure is checked
+// against a count kept by the harness.
+// The same input is also given to the parsers (TreePatch::read, TreeCodec::read, TreeReader::read in each
+// layout, and TreeLog::replay as the records of a snapshot), which must either reject it with std::invalid_argument or read something that writes back and
+// reads back the same. The fuzz builds define FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION, so TreeLog does not
+// check the checksums of its frames.
+//
+// Build with clang:   make fuzz          (libFuzzer + ASan + UBSan; stack exhaustion shows up as a crash
+//                                         and quadratic blowups as timeouts, see FUZZ_ARGS in the Makefile)
+// Replay with g++:    make fuzz_replay && ./run_fuzz_replay crash-file ...
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "Tree.hpp"
+#include "TreePatch.hpp"
+#include "TreeLog.hpp"
+#include "TreeCodec.hpp"
+#include "TreeReader.hpp"
+#include "TreeWriter.hpp"
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t max_nodes = 1 << 16;  ///< Keeps one input from running out of memory.
+
+/**
+ * @brief Reads the fuzzer input one value at a time; reads past the end return 0.
+ */
+class ByteReader {
+private:
+    const uint8_t* data;
+    size_t size;
+    size_t position = 0;
+
+public:
+    ByteReader(const uint8_t* data, size_t size) : data(data), size(size) {}
+
+    bool done() const { return position >= size; }
+
+    uint8_t byte() { return position < size ? data[position++] : 0; }
+
+    uint16_t word() { return static_cast<uint16_t>(byte() | (byte() << 8)); }
+};
+
+/**
+ * @brief Stops the run the way libFuzzer and the sanitizers recognize as a crash.
+ */
+void check(bool condition, const char* message) {
+    if (!condition) {
+        std::cerr << "Fuzz check failed: " << message << std::endl;
+        std::abort();
+    }
+}
+
+/**
+ * @brief Runs a parser, and tells whether it accepted the input; any exception other than
+ * std::invalid_argument is a bug and reaches libFuzzer.
+ */
+template<typename Parse>
+bool parses(Parse parse) {
+    try {
+        parse();
+        return true;
+    } catch (const std::invalid_argument&) {
+        return false;
+    }
+}
+
+/**
+ * @brief Gives the input to each parser; what a parser accepts must write back and read back the same.
+ */
+void check_parsers(const std::string& input) {
+    TreePatch<int> patch;
+    std::istringstream patch_in(input);
+    if (parses([&] { patch = TreePatch<int>::read(patch_in); })) {
+        std::stringstream written;
+        patch.write(written);
+        std::string bytes = written.str();
+        std::ostringstream rewritten;
+        TreePatch<int>::read(written).write(rewritten);
+        check(rewritten.str() == bytes, "a patch did not read back as it was written");
+    }
+
+    Tree<int, 3> decoded;
+    std::istringstream codec_in(input);
+    if (parses([&] { decoded = TreeCodec<int, 3>::read(codec_in); })) {
+        std::stringstream encoded;
+        TreeCodec<int, 3>::write(encoded, decoded);
+        check(TreeCodec<int, 3>::read(encoded) == decoded, "a compact tree did not read back as it was written");
+    }
+
+    for (TreeLayout layout : {TreeLayout::Adjacency, TreeLayout::Indented, TreeLayout::ParentArray}) {
+        Tree<int, 3> parsed;
+        std::istringstream text_in(input);
+        if (parses([&] { parsed = TreeReader<int, 3>::read(text_in, layout); })) {
+            std::stringstream text;
+            TreeWriter<int, 3>::write(text, parsed, layout);
+            check(TreeReader<int, 3>::read(text, layout) == parsed, "a text tree did not read back as it was written");
+        }
+    }
+
+    // The input is the payload of the only frame of a snapshot; a tree it builds is logged again and recovered
+    std::string snapshot = "TREELOG1" + std::string(8, '\0');  // the magic and epoch 0
+    for (std::uint64_t word : {std::uint64_t{input.size()}, std::uint64_t{0}}) {  // the length and the checksum
+        for (int i = 0; i < 8; ++i) snapshot.push_back(static_cast<char>(word >> (8 * i)));
+    }
+    snapshot += input;
+    Tree<int, 3> replayed;
+    if (parses([&] { replayed = TreeLog<int, 3>::replay(snapshot, ""); })) {
+        auto directory = std::filesystem::temp_directory_path();
+        std::string name = "fuzz_tree_log_" + std::to_string(::getpid());
+        std::string snapshot_path = (directory / (name + ".snapshot")).string();
+        std::string log_path = (directory / (name + ".log")).string();
+        TreeLog<int, 3>::attach(replayed, snapshot_path, log_path)->commit();
+        check(TreeLog<int, 3>::recover(snapshot_path, log_path) == replayed, "a replayed tree did not recover as it was logged");
+        std::filesystem::remove(snapshot_path);
+        std::filesystem::remove(log_path);
+    }
+}
+
+/**
+ * @brief A tree under test with the nodes the harness knows about.
+ */
+template<int k>
+struct Subject {
+    Tree<int, k> tree;
+    std::vector<std::shared_ptr<Node<int>>> nodes;  ///< Every node of the tree, in insertion order.
+
+    /**
+     * @brief Adds a child under a known node, if it has a free slot.
+     */
+    void add_under(size_t parent, int value) {
+        if (nodes.empty() || nodes.size() >= max_nodes) return;
+        auto& parent_node = nodes[parent % nodes.size()];
+        if (parent_node->getNumOfChildren() == k) {
+            try {
+                tree.add_sub_node(parent_node, value);
+                check(false, "add_sub_node on a full node did not throw");
+            } catch (const std::out_of_range&) {}
+            return;
+        }
+        nodes.push_back(tree.add_sub_node(parent_node, value));
+    }
+
+    /**
+     * @brief Applies one operation decoded from the input.
+     */
+    void apply(ByteReader& in) {
+        switch (in.byte() % 10) {
+            case 0: {  // add_root replaces the whole tree
+                tree.add_root(in.byte());
+                nodes = {tree.getRoot()};
+                break;
+            }
+            case 1: {  // add_sub_node by value: small values so the searches hit duplicates and misses
+                int parent = in.byte() % 32, child = in.byte();
+                if (nodes.size() >= max_nodes) break;
+                bool exists = tree.find_node(parent) != nullptr;
+                try {
+                    nodes.push_back(tree.add_sub_node(parent, child));
+                    check(exists, "add_sub_node found a parent that find_node did not");
+                } catch (const std::invalid_argument&) {
+                    check(!exists, "add_sub_node did not find an existing parent");
+                } catch (const std::out_of_range&) {}
+                break;
+            }
+            case 2: {  // add_sub_node by node
+                size_t parent = in.word();
+                add_under(parent, in.byte());
+                break;
+            }
+            case 3: {  // a long chain under one node, to build deep trees quickly
+                size_t parent = in.word(), length = in.word();
+                for (size_t i = 0; i < length && !nodes.empty() && nodes.size() < max_nodes; ++i) {
+                    add_under(i == 0 ? parent : nodes.size() - 1, static_cast<int>(i));
+                }
+                break;
+            }
+            case 4: {  // set_value
+                if (nodes.empty()) break;
+                size_t node = in.word();
+                tree.set_value(nodes[node % nodes.size()], static_cast<int8_t>(in.byte()));
+                break;
+            }
+            case 5: {  // heapify, then check the heap property
+                for (auto it = tree.myHeap(); it != tree.end_heap(); ++it) {}
+                for (const auto& node : nodes) {
+                    auto up = node->parent();
+                    check(!up || !(node->get_value() < up->get_value()), "heapify left a child smaller than its parent");
+                }
+                break;
+            }
+            case 6: {  // a snapshot: a parent array decoded into a fresh tree
+                size_t count = in.word() % 4096;
+                tree.add_root(in.byte());
+                nodes = {tree.getRoot()};
+                for (size_t i = 1; i < count && !in.done(); ++i) add_under(in.word() % i, in.byte());
+                break;
+            }
+            case 7: {  // persistent updates must leave this tree unchanged (and its hashes cached for later operations)
+                if (nodes.empty()) break;
+                int key = nodes[in.word() % nodes.size()]->get_value();
+                std::uint64_t hash = tree.hash();
+                try {
+                    auto version = tree.with_value(key, key + 1).with_sub_node(key + 1, 0);
+                    check(count(version) == nodes.size() + 1, "with_sub_node did not add exactly one node");
+                    check(!tree.diff(version).empty(), "diff missed a persistent update");
+                } catch (const std::out_of_range&) {}
+                check(count(tree) == nodes.size(), "a persistent update changed the original tree");
+                check(tree.hash() == hash, "a persistent update changed the hash of the original tree");
+                break;
+            }
+            case 8: {  // remove_subtree, then the harness forgets the removed nodes
+                if (nodes.empty()) break;
+                auto node = nodes[in.word() % nodes.size()];
+                auto up = node->parent();
+                tree.remove_subtree(node);
+                check(!node->parent() && node->getNumOfChildren() == 0, "remove_subtree left the node linked");
+                if (up) check_packed(*up);
+                recollect();
+                break;
+            }
+            case 9: {  // detach a subtree and reattach it somewhere else, or back under its parent
+                if (nodes.size() < 2) break;
+                auto node = nodes[1 + in.word() % (nodes.size() - 1)];  // nodes[0] is the root
+                auto up = node->parent();
+                size_t before = nodes.size();
+                auto detached = tree.detach(node);
+                check_packed(*up);
+                recollect();
+                auto target = nodes[in.word() % nodes.size()];
+                try {
+                    tree.reattach(target, std::move(detached));
+                    check(node->parent() == target, "reattach did not link the subtree to the target");
+                } catch (const std::out_of_range&) {
+                    check(detached.getRoot() == node, "a failed reattach changed the detached tree");
+                    tree.reattach(up, std::move(detached));
+                }
+                recollect();
+                check(nodes.size() == before, "detach and reattach lost nodes");
+                break;
+            }
+        }
+    }
+
+    /**
+     * @brief Checks that the children of a node fill the first slots, as remove_subtree and detach leave them.
+     */
+    static void check_packed(const Node<int>& node) {
+        const auto& children = node.get_children();
+        size_t filled = node.getNumOfChildren();
+        for (size_t i = 0; i < children.size(); ++i) {
+            check((children[i] != nullptr) == (i < filled), "the children slots were not packed");
+            check(!children[i] || children[i]->getIndexInParent() == i, "a moved child has a stale index");
+        }
+    }
+
+    /**
+     * @brief Relearns the nodes of the tree in BFS order, after nodes were removed or moved.
+     */
+    void recollect() {
+        nodes.clear();
+        if (tree.getRoot()) nodes.push_back(tree.getRoot());
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            for (const auto& child : nodes[i]->get_children()) {
+                if (child) nodes.push_back(child);
+            }
+        }
+    }
+
+    /**
+     * @brief Counts the nodes of a tree with the BFS iterator.
+     */
+    static size_t count(const Tree<int, k>& version) {
+        size_t result = 0;
+        for (auto it = version.begin_bfs_scan(); it != version.end_bfs_scan(); ++it) ++result;
+        return result;
+    }
+
+    /**
+     * @brief Runs every iterator and checks that each one visits every node once.
+     */
+    void verify() {
+        check(count(tree) == nodes.size(), "BFS did not visit every node");
+        size_t dfs = 0;
+        for (auto it = tree.begin_dfs_scan(); it != tree.end_dfs_scan(); ++it) ++dfs;
+        check(dfs == nodes.size(), "DFS did not visit every node");
+        auto copy = tree.clone();
+        check(copy == tree && count(copy) == nodes.size(), "clone is not equal to the tree");
+        check(copy.hash() == tree.hash() && tree.diff(copy).empty(), "clone has another hash than the tree");
+        if (!nodes.empty()) {
+            copy.set_value(copy.getRoot(), copy.getRoot()->get_value() + 1);
+            check(!(copy == tree), "operator== missed a changed value");
+            check(copy.hash() != tree.hash(), "set_value did not clear the cached hash of the root");
+            auto differences = tree.diff(copy);
+            check(differences.size() == 1 && differences[0].first == tree.getRoot(), "diff missed a changed root");
+        }
+        if (!nodes.empty() && copy.getRoot()->getChildAt(0)) {  // a patch that changes, inserts and removes nodes
+            copy.remove_subtree(copy.getRoot()->getChildAt(0));  // the later children move, so they differ too
+            copy.add_sub_node(copy.getRoot(), 7);
+            auto replica = tree.clone();
+            replica.apply(diff(tree, copy));
+            check(replica == copy, "applying the patch of diff did not produce the target");
+        }
+        // The subtree bounds are O(depth) to maintain per insertion, so they are built once here, not per operation
+        tree.enable_pruned_find();
+        for (size_t i = 0; i < nodes.size(); i += 1 + nodes.size() / 64) {
+            auto found = tree.find_node(nodes[i]->get_value());
+            check(found && found->get_value() == nodes[i]->get_value(), "find_node missed a value in the tree");
+        }
+        tree.disable_pruned_find();
+        if constexpr (k == 2) {
+            size_t pre = 0, post = 0, in = 0;
+            for (auto it = tree.begin_pre_order(); it != tree.end_pre_order(); ++it) ++pre;
+            for (auto it = tree.begin_post_order(); it != tree.end_post_order(); ++it) ++post;
+            for (auto it = tree.begin_in_order(); it != tree.end_in_order(); ++it) ++in;
+            check(pre == nodes.size() && post == nodes.size() && in == nodes.size(), "a binary iterator missed nodes");
+        }
+        std::ostringstream out;
+        out << tree;
+    }
+};
+
+}  // namespace
+
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    check_parsers(std::string(reinterpret_cast<const char*>(data), size));
+    ByteReader in(data, size);
+    Subject<2> binary;
+    Subject<3> ternary;
+    while (!in.done()) {
+        if (in.byte() & 1) binary.apply(in);
+        else ternary.apply(in);
+    }
+    binary.verify();
+    ternary.verify();
+    return 0;
+}
+
+
+#ifdef FUZZ_STANDALONE
+/**
+ * @brief Replays inputs (for example crash files written by libFuzzer) without libFuzzer.
+ */
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        std::ifstream file(argv[i], std::ios::binary);
+        std::vector<uint8_t> input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        LLVMFuzzerTestOneInput(input.data(), input.size());
+        std::cout << argv[i] << ": ok" << std::endl;
+    }
+    return 0;
+}
+#endif
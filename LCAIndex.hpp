@@ -0,0 +1,196 @@
+//guyes134@gmail.com
+
+#ifndef LCAINDEX_HPP
+#define LCAINDEX_HPP
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Tree.hpp"
+
+
+/**
+ * @brief An index that answers lowest common ancestor queries on a tree that does not change anymore.
+ *
+ * The index stores the Euler tour of the tree (every node is written when it is entered and again after
+ * each of its children) and a sparse table over the depths of the tour. The lowest common ancestor of two
+ * nodes is the shallowest node of the tour between their first occurrences, so after an O(n log n) build
+ * each query is one hash lookup per node plus two table reads.
+ *
+ * The index describes the tree at the time it was built. Build a new one after mutating the tree.
+ *
+ * @tparam T The type of the values stored in the nodes.
+ */
+template<typename T>
+class LCAIndex {
+private:
+    std::vector<std::shared_ptr<Node<T>>> nodes;  ///< The nodes in pre-order; the position is the node id.
+    std::unordered_map<const Node<T>*, uint32_t> ids;  ///< The id of each node.
+    std::vector<uint32_t> depth;  ///< The depth of each node, by id.
+    std::vector<uint32_t> first;  ///< The first position of each node in the Euler tour, by id.
+    std::vector<std::vector<uint32_t>> table;  ///< table[j][i] is the shallowest node of tour[i, i + 2^j).
+
+public:
+    /**
+     * @brief Builds the index of a tree.
+     *
+     * @param tree The tree to index.
+     */
+    template<int k>
+    explicit LCAIndex(const Tree<T, k>& tree) : LCAIndex(tree.getRoot()) {}
+
+    /**
+     * @brief Builds the index of the subtree rooted at a node.
+     *
+     * @param root The root of the subtree to index (nullptr for an empty index).
+     */
+    explicit LCAIndex(const std::shared_ptr<Node<T>>& root) {
+        if (!root) return;
+
+        // Iterative Euler tour: each stack entry is a node id and the next child slot to visit
+        std::vector<uint32_t> tour;
+        std::vector<std::pair<uint32_t, size_t>> stack;
+        add_node(root, 0);
+        stack.emplace_back(0, 0);
+        tour.push_back(0);
+        while (!stack.empty()) {
+            auto& [id, slot] = stack.back();
+            const auto& children = nodes[id]->get_children();
+            while (slot < children.size() && !children[slot]) ++slot;
+            if (slot == children.size()) {
+                stack.pop_back();
+                if (!stack.empty()) tour.push_back(stack.back().first);
+                continue;
+            }
+            uint32_t child = add_node(children[slot++], depth[id] + 1);
+            first[child] = tour.size();
+            tour.push_back(child);
+            stack.emplace_back(child, 0);
+        }
+
+        // Sparse table over the tour
+        table.push_back(std::move(tour));
+        for (size_t width = 2; width <= table[0].size(); width *= 2) {
+            const auto& previous = table.back();
+            std::vector<uint32_t> level(table[0].size() - width + 1);
+            for (size_t i = 0; i < level.size(); ++i) {
+                level[i] = shallower(previous[i], previous[i + width / 2]);
+            }
+            table.push_back(std::move(level));
+        }
+    }
+
+    /**
+     * @brief Gets the number of indexed nodes.
+     *
+     * @return The number of nodes in the indexed tree.
+     */
+    size_t size() const {
+        return nodes.size();
+    }
+
+    /**
+     * @brief Finds the lowest common ancestor of two nodes of the indexed tree.
+     *
+     * @param a A node of the indexed tree.
+     * @param b A node of the indexed tree.
+     * @return The deepest node that is an ancestor of both (a node is an ancestor of itself).
+     * @throws std::invalid_argument If a node is not in the indexed tree.
+     */
+    std::shared_ptr<Node<T>> query(const std::shared_ptr<Node<T>>& a, const std::shared_ptr<Node<T>>& b) const {
+        return nodes[query_id(id_of(a), id_of(b))];
+    }
+
+    /**
+     * @brief Answers many queries, splitting them between several threads.
+     *
+     * @param pairs The pairs of nodes to query.
+     * @param threads The number of threads to use (0 means one per hardware thread).
+     * @return The lowest common ancestor of each pair, in the same order.
+     * @throws std::invalid_argument If a node is not in the indexed tree (after every thread has stopped).
+     */
+    std::vector<std::shared_ptr<Node<T>>> query_batch(
+            const std::vector<std::pair<std::shared_ptr<Node<T>>, std::shared_ptr<Node<T>>>>& pairs,
+            unsigned threads = 0) const {
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        threads = static_cast<unsigned>(std::min<size_t>(threads, std::max<size_t>(1, pairs.size() / 1024)));
+
+        // The workers only write ids; the shared_ptrs are copied afterwards so no refcount is contended
+        // A worker catches its exception, to be rethrown here once all of them are joined
+        std::vector<uint32_t> result_ids(pairs.size());
+        std::vector<std::exception_ptr> errors(threads);
+        size_t chunk = (pairs.size() + threads - 1) / threads;
+        auto work = [&](unsigned t) {
+            try {
+                for (size_t i = std::min(pairs.size(), t * chunk); i < std::min(pairs.size(), (t + 1) * chunk); ++i) {
+                    result_ids[i] = query_id(id_of(pairs[i].first), id_of(pairs[i].second));
+                }
+            } catch (...) {
+                errors[t] = std::current_exception();
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned t = 1; t < threads; ++t) workers.emplace_back(work, t);
+        work(0);
+        for (auto& worker : workers) worker.join();
+        for (const auto& error : errors) {
+            if (error) std::rethrow_exception(error);
+        }
+
+        std::vector<std::shared_ptr<Node<T>>> results;
+        results.reserve(pairs.size());
+        for (uint32_t id : result_ids) results.push_back(nodes[id]);
+        return results;
+    }
+
+private:
+    /**
+     * @brief Gives the next id to a node.
+     */
+    uint32_t add_node(const std::shared_ptr<Node<T>>& node, uint32_t node_depth) {
+        uint32_t id = nodes.size();
+        nodes.push_back(node);
+        ids.emplace(node.get(), id);
+        depth.push_back(node_depth);
+        first.push_back(0);
+        return id;
+    }
+
+    /**
+     * @brief Gets the id of an indexed node.
+     */
+    uint32_t id_of(const std::shared_ptr<Node<T>>& node) const {
+        auto it = ids.find(node.get());
+        if (it == ids.end()) {
+            throw std::invalid_argument("Node is not in the indexed tree");
+        }
+        return it->second;
+    }
+
+    /**
+     * @brief Returns the shallower of two nodes.
+     */
+    uint32_t shallower(uint32_t a, uint32_t b) const {
+        return depth[b] < depth[a] ? b : a;
+    }
+
+    /**
+     * @brief Finds the lowest common ancestor of two node ids with a range minimum query on the tour.
+     */
+    uint32_t query_id(uint32_t a, uint32_t b) const {
+        size_t left = std::min(first[a], first[b]);
+        size_t right = std::max(first[a], first[b]) + 1;
+        size_t level = std::bit_width(right - left) - 1;
+        return shallower(table[level][left], table[level][right - (size_t{1} << level)]);
+    }
+};
+
+#endif // LCAINDEX_HPP
@@ -6,6 +6,16 @@
 #include <memory>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <bit>
+#include <concepts>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include "NodePool.hpp"
+#include "TreeStats.hpp"
 
 
 // * all the implementation are in the tree.hpp file
@@ -20,22 +30,128 @@
  */
 
 
+/**
+ * @brief The value types whose nodes can compute a subtree hash (std::hash must be specialized for them).
+ */
+template<typename T>
+concept HashableValue = requires(const T& value) {
+    { std::hash<T>{}(value) } -> std::convertible_to<size_t>;
+};
+
+
 /**
  * @brief A class representing a node in a k-ary tree.
  *
  * @tparam T The type of the value stored in the node.
  */
 template<typename T>
-class Node {
+class Node : public std::enable_shared_from_this<Node<T>> {
+public:
+    /**
+     * @brief The children slots. Their memory comes from the NodeArena of a clone, or from the allocator.
+     */
+    using Children = std::vector<std::shared_ptr<Node<T>>, ArenaAllocator<std::shared_ptr<Node<T>>>>;
+
 private:
     T value;  ///< The value stored in the node.
-    std::vector<std::shared_ptr<Node<T>>> children;  ///< The children of the node.
+    std::uint32_t index_in_parent = 0;  ///< The index of this node in the children of its parent (next to a small value, in its padding).
+    Children children;  ///< The children of the node.
+    std::weak_ptr<Node<T>> parent_link;  ///< Non-owning link to the parent, so parent and child do not keep each other alive.
+    std::uint64_t occupied = 0;  ///< Bit i is set when children[i] is not null.
+    mutable std::atomic<std::uint64_t> hash_cache{0};  ///< The hash of the subtree, or 0 while it is not computed.
+    std::weak_ptr<Node<T>> heir;  ///< The last copy of a node whose children link here; it takes the links over.
+
+    static inline std::mutex links_mutex;  ///< Guards the parent links and heirs of the nodes shared by versions.
+
+    static constexpr size_t max_recursive_depth = 512;  ///< Levels a destructor may recurse before it switches to a loop.
+
+    /**
+     * @brief Checks the number of children slots given to a constructor.
+     */
+    static size_t checked_slots(size_t k) {
+        if (k > max_children) {
+            throw std::invalid_argument("A node can have at most 64 children slots");
+        }
+        return k;
+    }
 
 public:
+    static constexpr size_t max_children = 64;  ///< The most children slots a node can have (one bit each in a word).
+
     /**
      * @brief Constructs a node with the given value and a fixed number of children.
+     *
+     * @throws std::invalid_argument If k is larger than max_children.
+     */
+    Node(const T& value, size_t k = 2) : value(value), children(checked_slots(k), nullptr) {}
+
+    /**
+     * @brief Constructs a node with a fixed number of children, moving the value into it.
+     */
+    Node(T&& value, size_t k = 2) : value(std::move(value)), children(checked_slots(k), nullptr) {}
+
+    /**
+     * @brief Constructs a node with a fixed number of children and a value constructed in place.
+     *
+     * @param k The number of children slots.
+     * @param args The arguments of a constructor of T.
+     */
+    template<typename... Args>
+    Node(std::in_place_t, size_t k, Args&&... args)
+        : value(std::forward<Args>(args)...), children(checked_slots(k), nullptr) {}
+
+    /**
+     * @brief Constructs a node whose children slots are allocated from an arena (used by Tree::clone).
+     *
+     * @param value The value of the node.
+     * @param k The number of children slots.
+     * @param arena The arena of the slots, or nullptr for the allocator.
+     */
+    Node(const T& value, size_t k, NodeArena* arena)
+        : value(value), children(checked_slots(k), nullptr, ArenaAllocator<std::shared_ptr<Node<T>>>(arena)) {}
+
+    /**
+     * @brief Copies the value and the children links of a node (used for path copying). The hash is not copied,
+     * because the copy is made to be changed, and neither is the parent link: the copy is a root until it is
+     * added to a parent.
+     */
+    Node(const Node& other)
+        : std::enable_shared_from_this<Node<T>>(), value(other.value), index_in_parent(other.index_in_parent),
+          children(other.children), occupied(other.occupied) {}
+
+    /**
+     * @brief Destroys the node and the subtree it owns without unbounded recursion.
+     *
+     * Releasing the last shared_ptr to a child destroys the child from inside this destructor, and so on down
+     * the tree, which overflows the stack on deep trees. The first levels are released that way (it is the
+     * fastest order for the allocator); below max_recursive_depth the children owned only by this node are moved
+     * to a local stack instead, and their own children are moved out before each one is released.
+     * Children that are shared with another owner (a handle, another version of a persistent tree) are just released.
      */
-    Node(const T& value, size_t k = 2) : value(value), children(k, nullptr) {}
+    ~Node() {
+        if (!heir.expired()) handOverChildren();
+        static thread_local size_t destroy_depth = 0;
+        if (destroy_depth < max_recursive_depth) {
+            ++destroy_depth;
+            children.clear();
+            --destroy_depth;
+            return;
+        }
+
+        std::vector<std::shared_ptr<Node<T>>> pending;
+        auto take_children = [&pending](Children& from) {
+            for (auto& child : from) {
+                if (child && child.use_count() == 1) pending.push_back(std::move(child));
+            }
+        };
+
+        take_children(children);
+        while (!pending.empty()) {
+            auto node = std::move(pending.back());
+            pending.pop_back();
+            take_children(node->children);
+        }
+    }
 
     /**
      * @brief Gets the value stored in the node.
@@ -59,9 +175,25 @@ public:
      * @return The number of non-null children.
      */
     int getNumOfChildren() const {
-        return std::count_if(children.begin(), children.end(), [](const std::shared_ptr<Node<T>>& child) {
-            return child != nullptr;
-        });
+        return std::popcount(occupied);
+    }
+
+    /**
+     * @brief Gets the index of the first empty children slot.
+     *
+     * @return The index, or the number of slots if every slot is taken.
+     */
+    size_t firstFreeSlot() const {
+        return std::countr_one(occupied);
+    }
+
+    /**
+     * @brief Gets the occupied children slots as a bitmask.
+     *
+     * @return A word whose bit i is set when the child at index i is not null.
+     */
+    std::uint64_t getOccupancy() const {
+        return occupied;
     }
 
     /**
@@ -78,6 +210,158 @@ public:
             throw std::out_of_range("Index out of range");
         }
         children[index] = child;
+        occupied |= std::uint64_t{1} << index;
+        child->parent_link = this->weak_from_this();
+        child->index_in_parent = static_cast<std::uint32_t>(index);
+        invalidateHash();
+    }
+
+    /**
+     * @brief Removes the child at the specified index and moves the children after it one slot to the left.
+     *
+     * The children stay packed at the front of the slots, so the first free slot is right after them.
+     * The removed child becomes a root (its parent link is cleared).
+     *
+     * @param index The index of the child to remove.
+     * @return The removed child, or nullptr if the slot was empty.
+     */
+    std::shared_ptr<Node<T>> removeChildAt(size_t index) {
+        if (index >= children.size()) {
+            throw std::out_of_range("Index out of range");
+        }
+        auto child = std::move(children[index]);
+        size_t end = std::bit_width(occupied);  // the slots after the last child are already empty
+        for (size_t i = index + 1; i < end; ++i) {
+            children[i - 1] = std::move(children[i]);
+            if (children[i - 1]) children[i - 1]->index_in_parent = static_cast<std::uint32_t>(i - 1);
+        }
+        if (end > index) children[end - 1] = nullptr;
+        std::uint64_t below = (std::uint64_t{1} << index) - 1;
+        occupied = (occupied & below) | ((occupied >> 1) & ~below);
+        if (child) {
+            child->parent_link.reset();
+            child->index_in_parent = 0;
+        }
+        invalidateHash();
+        return child;
+    }
+
+    /**
+     * @brief Removes the child at the specified index and leaves its slot empty (the other children stay in place).
+     *
+     * @param index The index of the child to remove.
+     * @return The removed child, now a root, or nullptr if the slot was empty.
+     */
+    std::shared_ptr<Node<T>> takeChildAt(size_t index) {
+        if (index >= children.size()) {
+            throw std::out_of_range("Index out of range");
+        }
+        auto child = std::move(children[index]);
+        occupied &= ~(std::uint64_t{1} << index);
+        if (child) {
+            child->parent_link.reset();
+            child->index_in_parent = 0;
+        }
+        invalidateHash();
+        return child;
+    }
+
+    /**
+     * @brief Removes all the children of the node; each of them becomes a root.
+     */
+    void clearChildren() {
+        for (; occupied; occupied &= occupied - 1) {
+            auto& child = children[std::countr_zero(occupied)];
+            child->parent_link.reset();
+            child->index_in_parent = 0;
+            child = nullptr;
+        }
+        invalidateHash();
+    }
+
+    /**
+     * @brief Makes this node, a copy that shares the children of another node, the heir of the nodes their
+     * parent links lead to (used for path copying).
+     *
+     * The links stay where they are while those nodes live, so the older version can still be navigated upward;
+     * when one is destroyed, the children this node still shares are linked to it instead. A child whose parent
+     * is already gone is linked to this node at once. O(number of children).
+     */
+    void inheritChildren() {
+        std::vector<std::shared_ptr<Node<T>>> parents;  // released after the lock, as they may be the last owners
+        std::lock_guard lock(links_mutex);
+        for (std::uint64_t bits = occupied; bits; bits &= bits - 1) {
+            auto& child = children[std::countr_zero(bits)];
+            if (auto up = child->parent_link.lock()) {
+                if (up.get() != this) up->heir = this->weak_from_this();
+                parents.push_back(std::move(up));
+            } else {
+                child->parent_link = this->weak_from_this();
+            }
+        }
+    }
+
+    /**
+     * @brief Gets the hash of the subtree rooted at this node, computing the hashes that are not cached.
+     *
+     * The hash combines the value, the occupied slots and the hashes of the children in slot order (a Merkle
+     * hash), so two subtrees with the same shape and values have the same hash, and different subtrees have
+     * different hashes except with probability about 2^-64. Each node caches its hash; a change clears the
+     * hashes on the path to the root (see invalidateHash), so after a change only that path is hashed again.
+     * Iterative, so deep trees do not overflow the stack. Threads may compute the hashes of a shared tree at
+     * the same time; they store the same values.
+     *
+     * @return The hash, never 0.
+     */
+    std::uint64_t getSubtreeHash() const requires HashableValue<T> {
+        if (std::uint64_t cached = getCachedHash()) return cached;
+
+        std::vector<std::pair<const Node<T>*, bool>> stack{{this, false}};  // node and whether its children are pushed
+        while (!stack.empty()) {
+            auto [node, expanded] = stack.back();
+            if (expanded) {
+                stack.pop_back();
+                node->hash_cache.store(node->combineHashes(), std::memory_order_relaxed);
+                continue;
+            }
+            stack.back().second = true;
+            for (auto slots = node->occupied; slots; slots &= slots - 1) {
+                const Node<T>* child = node->children[std::countr_zero(slots)].get();
+                if (child->getCachedHash() == 0) stack.emplace_back(child, false);
+            }
+        }
+        return getCachedHash();
+    }
+
+    /**
+     * @brief Gets the cached hash of the subtree without computing it.
+     *
+     * @return The hash, or 0 if it was not computed since the subtree last changed.
+     */
+    std::uint64_t getCachedHash() const {
+        return hash_cache.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Clears the cached hashes of this node and its ancestors.
+     *
+     * The children functions call it themselves; call it after changing the value through get_value()
+     * (Tree::set_value and heapify do). A node only has a hash when all its descendants have one, so the walk
+     * stops at the first node without a hash, and costs one load when no hashes are used.
+     */
+    void invalidateHash() {
+        if (getCachedHash() == 0) return;
+        hash_cache.store(0, std::memory_order_relaxed);
+        for (auto up = parent(); up && up->getCachedHash() != 0; up = up->parent()) {
+            up->hash_cache.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Gets the index of the node in the children of its parent.
+     */
+    size_t getIndexInParent() const {
+        return index_in_parent;
     }
 
     /**
@@ -85,7 +369,7 @@ public:
      *
      * @return A const reference to the vector of children.
      */
-    const std::vector<std::shared_ptr<Node<T>>>& get_children() const {
+    const Children& get_children() const {
         return children;
     }
 
@@ -99,8 +383,100 @@ public:
         if (index >= children.size()) {
             throw std::out_of_range("Index out of range");
         }
+        TREE_STAT(refcount_operations, 1);
         return children[index];
     }
+
+    /**
+     * @brief Gets the parent of the node.
+     *
+     * The link is set by addChildAt. A node that is shared between versions of a persistent tree
+     * links to the parent it was last added to.
+     *
+     * @return A shared pointer to the parent, or nullptr for a root (or if the parent no longer exists).
+     */
+    std::shared_ptr<Node<T>> parent() const {
+        TREE_STAT(refcount_operations, 1);
+        return parent_link.lock();
+    }
+
+    /**
+     * @brief Gets the depth of the node, following the parent links one step at a time.
+     *
+     * @return The number of edges between the node and its root.
+     */
+    size_t depth() const {
+        size_t result = 0;
+        for (auto node = parent(); node; node = node->parent()) {
+            ++result;
+        }
+        return result;
+    }
+
+    /**
+     * @brief Gets the nodes on the path from this node up to its root.
+     *
+     * @return The ancestors of the node, starting with its parent and ending with the root.
+     */
+    std::vector<std::shared_ptr<Node<T>>> path_to_root() const {
+        std::vector<std::shared_ptr<Node<T>>> path;
+        for (auto node = parent(); node; node = node->parent()) {
+            path.push_back(node);
+        }
+        return path;
+    }
+
+    /**
+     * @brief Gets the next non-null child of the parent after this node.
+     *
+     * @return A shared pointer to the next sibling, or nullptr if there is none.
+     */
+    std::shared_ptr<Node<T>> next_sibling() const {
+        auto up = parent();
+        if (!up || index_in_parent + 1 >= max_children) return nullptr;
+        std::uint64_t later = up->occupied & (~std::uint64_t{0} << (index_in_parent + 1));
+        return later ? up->children[std::countr_zero(later)] : nullptr;
+    }
+
+private:
+    /**
+     * @brief Links the children that are still shared with the heir of this node to the heir (see inheritChildren).
+     */
+    void handOverChildren() {
+        std::shared_ptr<Node<T>> next;  // released after the lock, as it may be the last owner
+        std::lock_guard lock(links_mutex);
+        next = heir.lock();
+        if (!next) return;
+        auto self = this->weak_from_this();
+        for (std::uint64_t bits = occupied; bits; bits &= bits - 1) {
+            size_t i = std::countr_zero(bits);
+            auto& link = children[i]->parent_link;
+            if (next->children[i] == children[i] && !link.owner_before(self) && !self.owner_before(link)) {
+                link = next;
+            }
+        }
+    }
+
+    /**
+     * @brief Mixes a word into a hash (the splitmix64 finalizer, so similar values give unrelated hashes).
+     */
+    static std::uint64_t mixHash(std::uint64_t hash, std::uint64_t word) {
+        std::uint64_t x = hash ^ (word + 0x9e3779b97f4a7c15 + (hash << 6) + (hash >> 2));
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+        return x ^ (x >> 31);
+    }
+
+    /**
+     * @brief Computes the hash of this node from its value and the cached hashes of its children.
+     */
+    std::uint64_t combineHashes() const requires HashableValue<T> {
+        std::uint64_t hash = mixHash(mixHash(0, std::hash<T>{}(value)), occupied);
+        for (auto slots = occupied; slots; slots &= slots - 1) {
+            hash = mixHash(hash, children[std::countr_zero(slots)]->getCachedHash());
+        }
+        return hash == 0 ? 1 : hash;  // 0 marks a hash that is not computed
+    }
 };
 
 #endif // NODE_HPP
\ No newline at end of file
@@ -0,0 +1,303 @@
+//guyes134@gmail.com
+
+#ifndef NODEPOOL_HPP
+#define NODEPOOL_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <new>
+#include "TreeStats.hpp"
+
+// Under AddressSanitizer the blocks go straight back to the allocator, so a use after free is still reported.
+#if defined(__SANITIZE_ADDRESS__)
+#define NODE_POOL_DISABLED
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define NODE_POOL_DISABLED
+#endif
+#endif
+
+
+/**
+ * @brief A per-thread free list of the memory blocks of one node type.
+ *
+ * Tree allocates each node together with its shared_ptr control block in one block taken from here.
+ * When a node is destroyed its block is kept on the free list of the thread and given to the next node,
+ * so a tree that keeps removing and adding nodes reuses the same memory. Every block of the list has
+ * the same size, so the list does not fragment.
+ *
+ * The list keeps at most max_free_blocks blocks; the rest go back to the allocator. Keeping every block of
+ * a large tree would hand them out again in reverse order, scattering the next tree over the memory, while
+ * the allocator gives a fresh tree contiguous memory. The list needs no lock because each thread has its own;
+ * a block freed on another thread than the one that allocated it just joins the list of that thread.
+ *
+ * @tparam Tag The node type the blocks are for (Node<T>).
+ */
+template<typename Tag>
+class NodePool {
+public:
+    static constexpr size_t max_free_blocks = 1024;  ///< The most blocks one thread keeps for reuse.
+
+private:
+    /**
+     * @brief A free block; the link is stored in the memory of the block itself.
+     */
+    struct FreeBlock {
+        FreeBlock* next;  ///< The next free block.
+    };
+
+    /**
+     * @brief The free list of one thread. It gives its blocks back when the thread exits.
+     */
+    struct FreeList {
+        FreeBlock* head = nullptr;  ///< The free blocks.
+        size_t count = 0;  ///< The number of free blocks.
+        size_t block_size = 0;  ///< The size of the blocks, set by the first allocation.
+
+        ~FreeList() {
+            release();
+            closed = true;
+        }
+
+        /**
+         * @brief Gives every free block back to the allocator.
+         */
+        void release() {
+            while (head) {
+                FreeBlock* block = head;
+                head = block->next;
+                ::operator delete(block);
+            }
+            count = 0;
+        }
+    };
+
+    inline static thread_local FreeList list;  ///< The free list of the current thread.
+    inline static thread_local bool closed = false;  ///< Set when the list of the thread is destroyed at exit.
+
+public:
+    /**
+     * @brief Takes a block from the free list, or from the allocator if the list is empty.
+     *
+     * @param bytes The size of the block.
+     * @return The block.
+     */
+    static void* allocate(size_t bytes) {
+#ifndef NODE_POOL_DISABLED
+        if (!closed) {
+            if (list.block_size == 0) list.block_size = bytes;
+            if (list.head && bytes == list.block_size) {
+                FreeBlock* block = list.head;
+                list.head = block->next;
+                --list.count;
+                TREE_STAT(pool_reuses, 1);
+                return block;
+            }
+        }
+#endif
+        return ::operator new(bytes);
+    }
+
+    /**
+     * @brief Puts a block back on the free list, or gives it back to the allocator if the list is full.
+     *
+     * @param block A block returned by allocate.
+     * @param bytes The size it was allocated with.
+     */
+    static void deallocate(void* block, [[maybe_unused]] size_t bytes) {
+#ifndef NODE_POOL_DISABLED
+        if (!closed && list.count < max_free_blocks && bytes == list.block_size) {
+            list.head = new (block) FreeBlock{list.head};
+            ++list.count;
+            return;
+        }
+#endif
+        ::operator delete(block);
+    }
+
+    /**
+     * @brief Gets the number of blocks on the free list of the current thread.
+     */
+    static size_t free_blocks() {
+        return closed ? 0 : list.count;
+    }
+
+    /**
+     * @brief Gives the free blocks of the current thread back to the allocator.
+     */
+    static void trim() {
+        if (!closed) list.release();
+    }
+};
+
+
+/**
+ * @brief A standard allocator that takes single objects from the NodePool of Tag (used with std::allocate_shared).
+ *
+ * @tparam U The type to allocate (the shared_ptr control block that holds the node, after rebinding).
+ * @tparam Tag The node type whose pool is used.
+ */
+template<typename U, typename Tag>
+class PoolAllocator {
+public:
+    using value_type = U;
+
+    template<typename V>
+    struct rebind {
+        using other = PoolAllocator<V, Tag>;
+    };
+
+    PoolAllocator() = default;
+
+    template<typename V>
+    PoolAllocator(const PoolAllocator<V, Tag>&) {}
+
+    U* allocate(size_t n) {
+        static_assert(alignof(U) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "the pool blocks have the default alignment");
+        if (n != 1) return static_cast<U*>(::operator new(n * sizeof(U)));
+        return static_cast<U*>(NodePool<Tag>::allocate(sizeof(U)));
+    }
+
+    void deallocate(U* block, size_t n) {
+        if (n != 1) ::operator delete(block);
+        else NodePool<Tag>::deallocate(block, sizeof(U));
+    }
+
+    template<typename V>
+    bool operator==(const PoolAllocator<V, Tag>&) const { return true; }
+};
+
+
+/**
+ * @brief A block of memory that Tree::clone carves many nodes of a copy from.
+ *
+ * Each node of a copy takes two parts of a block (the node with its control block, and its children slots)
+ * instead of two allocations. Every part handed out is given back with deallocate when its node is destroyed,
+ * and the block is freed when the last part is back and release() was called. The memory of single parts is
+ * not reused: a block is kept until the last of its nodes is gone. Requests that do not fit go to the allocator.
+ */
+class alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) NodeArena {
+public:
+    static constexpr size_t alignment = __STDCPP_DEFAULT_NEW_ALIGNMENT__;  ///< The alignment of every part.
+    /**
+     * @brief The largest block Tree::clone asks for. Larger blocks were slower: the allocator maps each one
+     * freshly from the system and every page faults on first touch, while blocks of a few MiB are reused.
+     */
+    static constexpr size_t max_block_bytes = size_t{4} << 20;
+
+private:
+    std::atomic<size_t> live{1};  ///< The parts handed out and not given back, plus one until release().
+    std::byte* next;  ///< The first free byte of the block.
+    std::byte* end;  ///< One past the last byte of the block.
+
+    explicit NodeArena(size_t bytes) : next(begin()), end(begin() + bytes) {}
+
+    std::byte* begin() {
+        return reinterpret_cast<std::byte*>(this + 1);
+    }
+
+public:
+    NodeArena(const NodeArena&) = delete;
+    NodeArena& operator=(const NodeArena&) = delete;
+
+    /**
+     * @brief Rounds a size up to the alignment of the parts.
+     */
+    static constexpr size_t round_up(size_t bytes) {
+        return (bytes + alignment - 1) / alignment * alignment;
+    }
+
+    /**
+     * @brief Creates an arena with room for the given number of bytes.
+     *
+     * @return The arena, or nullptr under AddressSanitizer (the callers then use the allocator for each part).
+     */
+    static NodeArena* create(size_t bytes) {
+#ifdef NODE_POOL_DISABLED
+        (void)bytes;
+        return nullptr;
+#else
+        return new (::operator new(sizeof(NodeArena) + bytes)) NodeArena(bytes);
+#endif
+    }
+
+    /**
+     * @brief Hands out the next part of the block, or allocates it if the block is full.
+     */
+    void* allocate(size_t bytes) {
+        bytes = round_up(bytes);
+        if (static_cast<size_t>(end - next) < bytes) return ::operator new(bytes);
+        void* part = next;
+        next += bytes;
+        live.fetch_add(1, std::memory_order_relaxed);
+        return part;
+    }
+
+    /**
+     * @brief Gives a part back; the last one frees the block.
+     */
+    void deallocate(void* part) {
+        std::less<const void*> before;
+        if (before(part, begin()) || !before(part, end)) {
+            ::operator delete(part);
+            return;
+        }
+        release();
+    }
+
+    /**
+     * @brief Drops the reference of the creator; called once the copy is complete.
+     */
+    void release() {
+        if (live.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            this->~NodeArena();
+            ::operator delete(static_cast<void*>(this));
+        }
+    }
+};
+
+
+/**
+ * @brief A standard allocator that takes its memory from a NodeArena, or from the allocator if it has none.
+ *
+ * Node uses it for its children slots, so the slots of a cloned node are in the arena of the clone.
+ *
+ * @tparam U The type to allocate.
+ */
+template<typename U>
+class ArenaAllocator {
+public:
+    using value_type = U;
+
+    NodeArena* arena = nullptr;  ///< The arena, or nullptr to use the allocator.
+
+    ArenaAllocator() = default;
+
+    explicit ArenaAllocator(NodeArena* arena) : arena(arena) {}
+
+    template<typename V>
+    ArenaAllocator(const ArenaAllocator<V>& other) : arena(other.arena) {}
+
+    U* allocate(size_t n) {
+        static_assert(alignof(U) <= NodeArena::alignment, "the arena parts have the default alignment");
+        return static_cast<U*>(arena ? arena->allocate(n * sizeof(U)) : ::operator new(n * sizeof(U)));
+    }
+
+    void deallocate(U* part, size_t) {
+        if (arena) arena->deallocate(part);
+        else ::operator delete(part);
+    }
+
+    /**
+     * @brief A copy of a container does not go into the arena (a copied node is not part of the clone).
+     */
+    ArenaAllocator select_on_container_copy_construction() const {
+        return ArenaAllocator();
+    }
+
+    template<typename V>
+    bool operator==(const ArenaAllocator<V>& other) const { return arena == other.arena; }
+};
+
+#endif // NODEPOOL_HPP
@@ -0,0 +1,133 @@
+//guyes134@gmail.com
+
+#ifndef PERFCOUNTERS_HPP
+#define PERFCOUNTERS_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+
+/**
+ * @brief Reads hardware performance counters of the current thread with Linux perf_event_open.
+ *
+ * Each counter is opened on its own, so a counter that the CPU or the kernel does not allow
+ * (for example inside a VM, or with a high perf_event_paranoid) is just reported as unavailable.
+ * On other systems no counter is available.
+ */
+class PerfCounters {
+public:
+    /**
+     * @brief One hardware counter.
+     */
+    struct Counter {
+        std::string name;  ///< The name used in the benchmark output.
+        int fd = -1;  ///< The perf event file descriptor, or -1 if the counter is unavailable.
+        uint64_t value = 0;  ///< The count of the last measured region.
+    };
+
+private:
+    std::vector<Counter> counters;  ///< cycles, instructions, llc_misses, branch_misses and dtlb_misses.
+
+public:
+    /**
+     * @brief Opens the counters (they start disabled).
+     */
+    PerfCounters() {
+#ifdef __linux__
+        open_counter("cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        open_counter("instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        open_counter("llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        open_counter("branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+        open_counter("dtlb_misses", PERF_TYPE_HW_CACHE,
+                     PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    /**
+     * @brief Closes the counters.
+     */
+    ~PerfCounters() {
+#ifdef __linux__
+        for (const auto& counter : counters) {
+            if (counter.fd >= 0) close(counter.fd);
+        }
+#endif
+    }
+
+    /**
+     * @brief Checks whether at least one counter could be opened.
+     */
+    bool available() const {
+        for (const auto& counter : counters) {
+            if (counter.fd >= 0) return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief Resets and enables the counters at the start of a measured region.
+     */
+    void start() {
+#ifdef __linux__
+        for (const auto& counter : counters) {
+            if (counter.fd < 0) continue;
+            ioctl(counter.fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(counter.fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    /**
+     * @brief Disables the counters at the end of a measured region and reads them.
+     */
+    void stop() {
+#ifdef __linux__
+        for (auto& counter : counters) {
+            if (counter.fd < 0) continue;
+            ioctl(counter.fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(counter.fd, &counter.value, sizeof(counter.value)) != sizeof(counter.value)) {
+                counter.value = 0;
+            }
+        }
+#endif
+    }
+
+    /**
+     * @brief Gets the counters with the values of the last measured region.
+     */
+    const std::vector<Counter>& get_counters() const {
+        return counters;
+    }
+
+private:
+#ifdef __linux__
+    /**
+     * @brief Opens one counter for the current thread, user space only.
+     */
+    void open_counter(const std::string& name, uint32_t type, uint64_t config) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        counters.push_back(Counter{name, fd, 0});
+    }
+#endif
+};
+
+#endif // PERFCOUNTERS_HPP
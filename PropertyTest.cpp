@@ -0,0 +1,576 @@
+//guyes134@gmail.com
+
+// Randomized differential tests: random k-ary trees with up to 1e6 nodes are built with the Tree API and,
+// in parallel, as a plain vector-of-children model. Every iterator and query of the tree is compared with a
+// straightforward traversal of the model. The last test cases check that add_sub_node and the traversals scale
+// linearly. Set PROPERTY_MAX_NODES to change the largest tree (default 1000000).
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include "doctest.h"
+#include "Tree.hpp"
+#include "LCAIndex.hpp"
+#include "BTree.hpp"
+#include "TreeCodec.hpp"
+#include "SuccinctTree.hpp"
+#include "TreeWriter.hpp"
+#include "TreeReader.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <queue>
+#include <random>
+#include <set>
+#include <sstream>
+#include <vector>
+
+namespace {
+
+/**
+ * @brief A random tree together with its reference model.
+ */
+template<int k>
+struct RandomTree {
+    Tree<int, k> tree;
+    std::vector<std::shared_ptr<Node<int>>> nodes;  ///< nodes[i] is the node with value i.
+    std::vector<std::vector<int>> children;  ///< The model: the children of node i, in slot order.
+    std::vector<int> parent;  ///< The model: the parent of node i (-1 for the root).
+};
+
+/**
+ * @brief The shapes of the generated trees.
+ */
+enum class Shape {
+    Random,  ///< Each node goes under a uniformly random node that has a free slot.
+    Bushy,   ///< Nodes fill the tree level by level.
+    Stringy  ///< Each node goes under one of the most recent nodes, so the tree is deep.
+};
+
+size_t max_nodes() {
+    const char* value = std::getenv("PROPERTY_MAX_NODES");
+    return value ? std::stoull(value) : 1000000;
+}
+
+/**
+ * @brief Builds a random tree with n nodes whose values are 0..n-1 in insertion order.
+ */
+template<int k>
+RandomTree<k> make_random_tree(size_t n, Shape shape, std::mt19937& rng) {
+    RandomTree<k> result;
+    result.children.resize(n);
+    result.parent.assign(n, -1);
+    if (n == 0) return result;
+
+    result.tree.add_root(0);
+    result.nodes.push_back(result.tree.getRoot());
+    std::vector<int> open{0};  // nodes with a free slot
+    size_t next_open = 0;  // for Bushy: the first open node in insertion order
+    for (size_t i = 1; i < n; ++i) {
+        size_t pick;
+        if (shape == Shape::Random) pick = rng() % open.size();
+        else if (shape == Shape::Bushy) pick = next_open;
+        else pick = open.size() - 1 - rng() % std::min<size_t>(open.size(), 3);
+
+        int parent = open[pick];
+        result.nodes.push_back(result.tree.add_sub_node(result.nodes[parent], static_cast<int>(i)));
+        result.children[parent].push_back(static_cast<int>(i));
+        result.parent[i] = parent;
+        open.push_back(static_cast<int>(i));
+        if (result.children[parent].size() == k) {
+            if (shape == Shape::Bushy) ++next_open;
+            else {
+                open[pick] = open.back();
+                open.pop_back();
+            }
+        }
+    }
+    return result;
+}
+
+/**-----------------------------------Reference Traversals-------------------------------------------**/
+
+std::vector<int> reference_pre_order(const std::vector<std::vector<int>>& children) {
+    std::vector<int> order;
+    std::vector<int> stack;
+    if (!children.empty()) stack.push_back(0);
+    while (!stack.empty()) {
+        int node = stack.back();
+        stack.pop_back();
+        order.push_back(node);
+        for (auto it = children[node].rbegin(); it != children[node].rend(); ++it) stack.push_back(*it);
+    }
+    return order;
+}
+
+std::vector<int> reference_post_order(const std::vector<std::vector<int>>& children) {
+    // Reversing a pre-order that visits the children right to left gives the post-order
+    std::vector<int> mirrored;
+    std::vector<int> stack;
+    if (!children.empty()) stack.push_back(0);
+    while (!stack.empty()) {
+        int node = stack.back();
+        stack.pop_back();
+        mirrored.push_back(node);
+        for (int child : children[node]) stack.push_back(child);
+    }
+    return {mirrored.rbegin(), mirrored.rend()};
+}
+
+std::vector<int> reference_in_order(const std::vector<std::vector<int>>& children) {
+    std::vector<int> order;
+    std::vector<std::pair<int, bool>> stack;  // node, and whether its left subtree is done
+    if (!children.empty()) stack.emplace_back(0, false);
+    while (!stack.empty()) {
+        auto [node, left_done] = stack.back();
+        stack.pop_back();
+        if (left_done) {
+            order.push_back(node);
+            if (children[node].size() > 1) stack.emplace_back(children[node][1], false);
+        } else {
+            stack.emplace_back(node, true);
+            if (!children[node].empty()) stack.emplace_back(children[node][0], false);
+        }
+    }
+    return order;
+}
+
+std::vector<int> reference_bfs(const std::vector<std::vector<int>>& children) {
+    std::vector<int> order;
+    if (children.empty()) return order;
+    order.push_back(0);
+    for (size_t i = 0; i < order.size(); ++i) {
+        for (int child : children[order[i]]) order.push_back(child);
+    }
+    return order;
+}
+
+template<typename Iterator>
+std::vector<int> collect(Iterator begin, Iterator end) {
+    std::vector<int> result;
+    for (auto it = begin; it != end; ++it) result.push_back(*it);
+    return result;
+}
+
+/**
+ * @brief Measures the best of three runs of a function, in nanoseconds.
+ */
+double best_time(const std::function<void()>& function) {
+    double best = 1e300;
+    for (int run = 0; run < 3; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        function();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+std::vector<size_t> test_sizes() {
+    std::vector<size_t> sizes;
+    for (size_t n : {size_t{1}, size_t{2}, size_t{7}, size_t{100}, size_t{10000}, size_t{1000000}}) {
+        if (n <= max_nodes()) sizes.push_back(n);
+    }
+    return sizes;
+}
+
+}  // namespace
+
+
+TEST_CASE("Binary iterators match the reference traversals") {
+    std::mt19937 rng(2024);
+    for (Shape shape : {Shape::Random, Shape::Bushy, Shape::Stringy}) {
+        for (size_t n : test_sizes()) {
+            CAPTURE(n);
+            CAPTURE(static_cast<int>(shape));
+            auto random_tree = make_random_tree<2>(n, shape, rng);
+            const auto& tree = random_tree.tree;
+
+            CHECK(collect(tree.begin_pre_order(), tree.end_pre_order()) == reference_pre_order(random_tree.children));
+            CHECK(collect(tree.begin_dfs_scan(), tree.end_dfs_scan()) == reference_pre_order(random_tree.children));
+            CHECK(collect(tree.begin_post_order(), tree.end_post_order()) == reference_post_order(random_tree.children));
+            CHECK(collect(tree.begin_in_order(), tree.end_in_order()) == reference_in_order(random_tree.children));
+            CHECK(collect(tree.begin_bfs_scan(), tree.end_bfs_scan()) == reference_bfs(random_tree.children));
+        }
+    }
+}
+
+TEST_CASE("k-ary iterators and queries match the reference") {
+    std::mt19937 rng(7);
+    for (size_t n : test_sizes()) {
+        CAPTURE(n);
+        auto random_tree = make_random_tree<5>(n, Shape::Random, rng);
+        const auto& tree = random_tree.tree;
+
+        CHECK(collect(tree.begin_dfs_scan(), tree.end_dfs_scan()) == reference_pre_order(random_tree.children));
+        CHECK(collect(tree.begin_bfs_scan(), tree.end_bfs_scan()) == reference_bfs(random_tree.children));
+
+        // a deep copy has the same shape and values, in new nodes
+        auto copy = tree.clone();
+        CHECK(copy == tree);
+        CHECK(collect(copy.begin_dfs_scan(), copy.end_dfs_scan()) == reference_pre_order(random_tree.children));
+        CHECK(copy.getRoot() != tree.getRoot());
+
+        // find returns the node with the value, and nothing for a value that is not in the tree
+        int probe = static_cast<int>(rng() % n);
+        CHECK(tree.find_node(probe) == random_tree.nodes[probe]);
+        CHECK(tree.find_node(-1) == nullptr);
+
+        // the pruned search finds the same nodes
+        random_tree.tree.enable_pruned_find();
+        CHECK(tree.find_node(probe) == random_tree.nodes[probe]);
+        CHECK(tree.find_node(static_cast<int>(n)) == nullptr);
+        random_tree.tree.disable_pruned_find();
+
+        // parent links and subtree sizes
+        bool parents_match = true;
+        for (size_t i = 0; i < n; i += std::max<size_t>(1, n / 1000)) {
+            auto up = random_tree.nodes[i]->parent();
+            int expected = random_tree.parent[i];
+            parents_match = parents_match && (expected < 0 ? up == nullptr : up == random_tree.nodes[expected]);
+        }
+        CHECK(parents_match);
+
+        auto sizes = random_tree.tree.add_aggregate(SubtreeSize<int>());
+        std::vector<size_t> reference_sizes(n, 1);
+        for (size_t i = n; i-- > 1;) reference_sizes[random_tree.parent[i]] += reference_sizes[i];
+        bool sizes_match = true;
+        for (size_t i = 0; i < n; ++i) sizes_match = sizes_match && sizes->of(random_tree.nodes[i]) == reference_sizes[i];
+        CHECK(sizes_match);
+    }
+}
+
+TEST_CASE("Merkle hashes and diff find exactly the changed nodes") {
+    std::mt19937 rng(13);
+    for (size_t n : test_sizes()) {
+        for (Shape shape : {Shape::Random, Shape::Stringy}) {
+            CAPTURE(n);
+            auto random_tree = make_random_tree<3>(n, shape, rng);
+            const auto& tree = random_tree.tree;
+            auto copy = tree.clone();
+            CHECK(copy.hash() == tree.hash());
+
+            // the nodes of the copy by value, found through the model
+            std::vector<std::shared_ptr<Node<int>>> copies(n);
+            copies[0] = copy.getRoot();
+            for (size_t i = 0; i < n; ++i) {
+                const auto& slots = random_tree.nodes[i]->get_children();
+                for (size_t slot = 0; slot < slots.size(); ++slot) {
+                    if (slots[slot]) copies[slots[slot]->get_value()] = copies[i]->getChildAt(slot);
+                }
+            }
+
+            std::set<int> changed;
+            for (size_t j = 0; j < 8; ++j) changed.insert(static_cast<int>(rng() % n));
+            for (int value : changed) copy.set_value(copies[value], -value - 1);
+            CHECK(copy.hash() != tree.hash());
+            auto differences = tree.diff(copy);
+            std::set<int> found;
+            bool pairs_match = true;
+            for (const auto& [a, b] : differences) {
+                pairs_match = pairs_match && a && b && b == copies[a->get_value()];
+                if (a) found.insert(a->get_value());
+            }
+            CHECK(pairs_match);
+            CHECK(found == changed);
+
+            for (int value : changed) copy.set_value(copies[value], value);
+            CHECK(copy.hash() == tree.hash());
+            CHECK(tree.diff(copy).empty());
+        }
+    }
+}
+
+TEST_CASE("A patch made by diff turns the tree into the target") {
+    std::mt19937 rng(17);
+    for (size_t n : test_sizes()) {
+        CAPTURE(n);
+        auto random_tree = make_random_tree<3>(n, Shape::Random, rng);
+        const auto& tree = random_tree.tree;
+        auto target = tree.clone();
+        std::vector<std::shared_ptr<Node<int>>> nodes{target.getRoot()};
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            for (const auto& child : nodes[i]->get_children()) {
+                if (child) nodes.push_back(child);
+            }
+        }
+
+        // value changes and insertions first, then removals (which may take some of the changed nodes with them)
+        for (size_t j = 0; j < 8; ++j) {
+            auto& node = nodes[rng() % n];
+            target.set_value(node, -node->get_value() - 1);
+            if (node->getNumOfChildren() < 3) target.add_sub_node(node, static_cast<int>(n + j));
+        }
+        for (size_t j = 0; j < 4 && n > 1; ++j) {
+            try {
+                target.remove_subtree(nodes[1 + rng() % (n - 1)]);
+            } catch (const std::invalid_argument&) {}  // already removed with an ancestor
+        }
+
+        auto patch = diff(tree, target);
+        auto replica = tree.clone();
+        replica.apply(patch);
+        CHECK(replica == target);
+
+        std::stringstream stream;
+        patch.write(stream);
+        auto read = TreePatch<int>::read(stream);
+        auto other = tree.clone();
+        other.apply(read);
+        CHECK(other.hash() == target.hash());
+        CHECK(diff(other, target).empty());
+    }
+}
+
+TEST_CASE("The compact form reads back as the same tree") {
+    std::mt19937 rng(19);
+    for (Shape shape : {Shape::Random, Shape::Bushy, Shape::Stringy}) {
+        for (size_t n : test_sizes()) {
+            CAPTURE(n);
+            auto random_tree = make_random_tree<4>(n, shape, rng);
+            auto& tree = random_tree.tree;
+            for (size_t j = 0; j < 4 && n > 1; ++j) {  // a few gaps among the children
+                auto& node = random_tree.nodes[rng() % n];
+                if (node->getNumOfChildren() > 1) node->takeChildAt(0);
+            }
+
+            std::stringstream stream;
+            TreeCodec<int, 4>::write(stream, tree);
+            auto read = TreeCodec<int, 4>::read(stream);
+            CHECK(read == tree);
+            // 2 bits of shape and at most 5 bytes of value delta per node, the gaps and the header
+            CHECK(stream.str().size() <= n / 4 + 5 * n + 64);
+        }
+    }
+}
+
+TEST_CASE("The text forms read back as the same tree") {
+    std::mt19937 rng(29);
+    for (Shape shape : {Shape::Random, Shape::Bushy, Shape::Stringy}) {
+        for (size_t n : test_sizes()) {
+            CAPTURE(n);
+            auto tree = make_random_tree<3>(n, shape, rng).tree;  // the children fill the first slots
+            std::stringstream streamed;
+            streamed << tree;
+            CHECK(TreeReader<int, 3>::read(streamed) == tree);
+            std::stringstream parents;
+            TreeWriter<int, 3>::write(parents, tree, TreeLayout::ParentArray);
+            CHECK(TreeReader<int, 3>::read(parents, TreeLayout::ParentArray) == tree);
+        }
+    }
+}
+
+TEST_CASE("The succinct tree navigates like the reference") {
+    std::mt19937 rng(23);
+    for (Shape shape : {Shape::Random, Shape::Bushy, Shape::Stringy}) {
+        for (size_t n : test_sizes()) {
+            CAPTURE(n);
+            auto random_tree = make_random_tree<3>(n, shape, rng);
+            SuccinctTree<int> succinct(random_tree.tree);
+            REQUIRE(succinct.size() == n);
+
+            // node values are the model ids, so every navigation step is checked against the model
+            bool match = true;
+            for (size_t v = 0; v < n; ++v) {
+                int id = succinct.value(v);
+                const auto& children = random_tree.children[id];
+                size_t up = succinct.parent(v);
+                match = match && (up == SuccinctTree<int>::npos ? -1 : succinct.value(up)) == random_tree.parent[id];
+                match = match && succinct.degree(v) == children.size();
+                size_t child = succinct.first_child(v);
+                for (size_t i = 0; i < children.size(); ++i) {
+                    match = match && child != SuccinctTree<int>::npos && succinct.value(child) == children[i];
+                    match = match && succinct.child(v, i) == child;
+                    size_t next = succinct.next_sibling(child);
+                    if (next != SuccinctTree<int>::npos) match = match && succinct.prev_sibling(next) == child;
+                    child = next;
+                }
+                match = match && child == SuccinctTree<int>::npos;
+            }
+            CHECK(match);
+            CHECK(collect(succinct.begin_bfs_scan(), succinct.end_bfs_scan()) == reference_bfs(random_tree.children));
+            CHECK(collect(succinct.begin_dfs_scan(), succinct.end_dfs_scan()) == reference_pre_order(random_tree.children));
+        }
+    }
+}
+
+TEST_CASE("remove_subtree, detach and reattach match the reference") {
+    std::mt19937 rng(11);
+    for (size_t n : test_sizes()) {
+        CAPTURE(n);
+        auto random_tree = make_random_tree<3>(n, Shape::Random, rng);
+        auto& tree = random_tree.tree;
+        auto& children = random_tree.children;
+        auto& parent = random_tree.parent;
+        auto sizes = tree.add_aggregate(SubtreeSize<int>());
+        std::vector<bool> alive(n, true);
+
+        // a random node other than the root that is still in the tree, or -1
+        auto pick = [&]() {
+            for (int attempt = 0; attempt < 64 && n > 1; ++attempt) {
+                int node = 1 + static_cast<int>(rng() % (n - 1));
+                if (alive[node]) return node;
+            }
+            return -1;
+        };
+        auto unlink = [&](int node) {
+            std::erase(children[parent[node]], node);  // the later children move left, like the slots
+            parent[node] = -1;
+        };
+
+        for (int op = 0; op < 1000; ++op) {
+            int node = pick();
+            if (node < 0) break;
+            if (rng() % 4 == 0) {
+                tree.remove_subtree(random_tree.nodes[node]);
+                unlink(node);
+                std::vector<int> stack{node};
+                while (!stack.empty()) {
+                    int removed = stack.back();
+                    stack.pop_back();
+                    alive[removed] = false;
+                    for (int child : children[removed]) stack.push_back(child);
+                    children[removed].clear();
+                }
+                continue;
+            }
+
+            int target = rng() % 2 ? pick() : 0;
+            bool inside = target < 0;  // the target must not be in the moved subtree
+            for (int up = target; up >= 0 && !inside; up = parent[up]) inside = up == node;
+            if (inside || children[target].size() == 3) continue;
+            tree.reattach(random_tree.nodes[target], tree.detach(random_tree.nodes[node]));
+            unlink(node);
+            children[target].push_back(node);
+            parent[node] = target;
+        }
+
+        CHECK(collect(tree.begin_dfs_scan(), tree.end_dfs_scan()) == reference_pre_order(children));
+        CHECK(collect(tree.begin_bfs_scan(), tree.end_bfs_scan()) == reference_bfs(children));
+
+        std::vector<size_t> reference_sizes(n, 1);
+        for (int node : reference_post_order(children)) {
+            if (parent[node] >= 0) reference_sizes[parent[node]] += reference_sizes[node];
+        }
+        bool sizes_match = true;
+        for (size_t i = 0; i < n; ++i) {
+            sizes_match = sizes_match && (!alive[i] || sizes->of(random_tree.nodes[i]) == reference_sizes[i]);
+        }
+        CHECK(sizes_match);
+    }
+}
+
+TEST_CASE("LCA index matches the parent-walk reference") {
+    std::mt19937 rng(99);
+    for (size_t n : test_sizes()) {
+        CAPTURE(n);
+        auto random_tree = make_random_tree<3>(n, Shape::Random, rng);
+        LCAIndex<int> index(random_tree.tree);
+
+        std::vector<int> depth(n, 0);
+        for (size_t i = 1; i < n; ++i) depth[i] = depth[random_tree.parent[i]] + 1;  // parents come first
+        bool all_match = true;
+        for (int q = 0; q < 1000; ++q) {
+            int a = static_cast<int>(rng() % n), b = static_cast<int>(rng() % n);
+            auto answer = index.query(random_tree.nodes[a], random_tree.nodes[b]);
+            while (a != b) {
+                if (depth[a] >= depth[b]) a = random_tree.parent[a];
+                else b = random_tree.parent[b];
+            }
+            all_match = all_match && answer == random_tree.nodes[a];
+        }
+        CHECK(all_match);
+    }
+}
+
+TEST_CASE("Heapify produces a min-heap with the same values") {
+    std::mt19937 rng(5);
+    for (size_t n : test_sizes()) {
+        CAPTURE(n);
+        auto random_tree = make_random_tree<2>(n, Shape::Bushy, rng);
+        for (const auto& node : random_tree.nodes) node->get_value() = static_cast<int>(rng() % 1000);
+        auto before = collect(random_tree.tree.begin_bfs_scan(), random_tree.tree.end_bfs_scan());
+
+        auto heap_order = collect(random_tree.tree.myHeap(), random_tree.tree.end_heap());
+        CHECK(heap_order == collect(random_tree.tree.begin_bfs_scan(), random_tree.tree.end_bfs_scan()));
+
+        bool heap_property = true;
+        for (size_t i = 1; i < n; ++i) {
+            heap_property = heap_property && random_tree.nodes[random_tree.parent[i]]->get_value() <= random_tree.nodes[i]->get_value();
+        }
+        CHECK(heap_property);
+
+        std::sort(before.begin(), before.end());
+        std::sort(heap_order.begin(), heap_order.end());
+        CHECK(before == heap_order);
+    }
+}
+
+TEST_CASE("BTree matches std::set under random inserts, erases and range queries") {
+    std::mt19937 rng(11);
+    auto check_fanout = [&rng](auto tree) {
+        for (size_t n : test_sizes()) {
+            CAPTURE(n);
+            CAPTURE(tree.getK_Ary());
+            tree.clear();
+            std::set<int> reference;
+            int range = static_cast<int>(2 * n);
+            bool results_match = true;
+            for (size_t i = 0; i < 2 * n; ++i) {
+                int value = static_cast<int>(rng() % range);
+                if (rng() % 3 == 0) results_match = results_match && tree.erase(value) == (reference.erase(value) == 1);
+                else results_match = results_match && tree.insert(value) == reference.insert(value).second;
+            }
+            CHECK(results_match);
+            CHECK(tree.size() == reference.size());
+            CHECK(std::equal(tree.begin(), tree.end(), reference.begin(), reference.end()));
+
+            bool bounds_match = true;
+            for (int q = 0; q < 1000; ++q) {
+                int key = static_cast<int>(rng() % (range + 2)) - 1;
+                auto it = tree.lower_bound(key);
+                auto expected = reference.lower_bound(key);
+                bounds_match = bounds_match && (expected == reference.end() ? it == tree.end() : it != tree.end() && *it == *expected);
+            }
+            CHECK(bounds_match);
+
+            bool ranges_match = true;
+            for (int q = 0; q < 1000; ++q) {
+                int lo = static_cast<int>(rng() % range), hi = lo + static_cast<int>(rng() % 64);
+                auto it = tree.range(lo, hi);
+                for (auto expected = reference.lower_bound(lo); expected != reference.end() && *expected <= hi; ++expected, ++it) {
+                    ranges_match = ranges_match && it != tree.end_range() && *it == *expected;
+                    if (!ranges_match) break;
+                }
+                ranges_match = ranges_match && it == tree.end_range();
+            }
+            CHECK(ranges_match);
+        }
+    };
+    check_fanout(BTree<int, 3>());
+    check_fanout(BTree<int, 8>());
+    check_fanout(BTree<int, 64>());
+}
+
+TEST_CASE("add_sub_node and traversals scale linearly") {
+    size_t small = std::min<size_t>(max_nodes(), 1000000) / 8;
+    if (small < 1000) return;
+    std::mt19937 rng(1);
+
+    // 8 times the nodes should take about 8 times as long; a quadratic algorithm would take 64 times as long
+    double build_small = best_time([&] { make_random_tree<4>(small, Shape::Bushy, rng); });
+    double build_large = best_time([&] { make_random_tree<4>(small * 8, Shape::Bushy, rng); });
+    CHECK(build_large / build_small < 24);
+
+    auto small_tree = make_random_tree<2>(small, Shape::Bushy, rng);
+    auto large_tree = make_random_tree<2>(small * 8, Shape::Bushy, rng);
+    auto traverse = [](const Tree<int, 2>& tree) {
+        size_t count = 0;
+        for (auto it = tree.begin_pre_order(); it != tree.end_pre_order(); ++it) ++count;
+        for (auto it = tree.begin_bfs_scan(); it != tree.end_bfs_scan(); ++it) ++count;
+        for (auto it = tree.begin_in_order(); it != tree.end_in_order(); ++it) ++count;
+        return count;
+    };
+    double traverse_small = best_time([&] { CHECK(traverse(small_tree.tree) == 3 * small); });
+    double traverse_large = best_time([&] { CHECK(traverse(large_tree.tree) == 3 * 8 * small); });
+    CHECK(traverse_large / traverse_small < 24);
+}
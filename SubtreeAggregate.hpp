@@ -0,0 +1,194 @@
+//guyes134@gmail.com
+
+#ifndef SUBTREEAGGREGATE_HPP
+#define SUBTREEAGGREGATE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Node.hpp"
+#include "TreeObserver.hpp"
+
+
+/**
+ * A monoid describes the aggregate of a subtree. It must provide:
+ *  - value_type: the type of the aggregate.
+ *  - lift(value): the aggregate of a single node with the given value.
+ *  - combine(a, b): the aggregate of two disjoint parts of a subtree (associative).
+ * The aggregate of a node is lift(value) combined with the aggregates of its children from left to right.
+ */
+
+/**
+ * @brief Counts the nodes of a subtree.
+ */
+template<typename T>
+struct SubtreeSize {
+    using value_type = size_t;
+    value_type lift(const T&) const { return 1; }
+    value_type combine(value_type a, value_type b) const { return a + b; }
+};
+
+/**
+ * @brief Sums the values of a subtree.
+ */
+template<typename T>
+struct SubtreeSum {
+    using value_type = T;
+    value_type lift(const T& value) const { return value; }
+    value_type combine(const value_type& a, const value_type& b) const { return a + b; }
+};
+
+/**
+ * @brief Finds the smallest value of a subtree.
+ */
+template<typename T>
+struct SubtreeMin {
+    using value_type = T;
+    value_type lift(const T& value) const { return value; }
+    value_type combine(const value_type& a, const value_type& b) const { return b < a ? b : a; }
+};
+
+/**
+ * @brief Finds the largest value of a subtree.
+ */
+template<typename T>
+struct SubtreeMax {
+    using value_type = T;
+    value_type lift(const T& value) const { return value; }
+    value_type combine(const value_type& a, const value_type& b) const { return a < b ? b : a; }
+};
+
+/**
+ * @brief Finds the smallest and the largest value of a subtree (used by Tree::enable_pruned_find).
+ */
+template<typename T>
+struct SubtreeBounds {
+    using value_type = std::pair<T, T>;  ///< The smallest and the largest value.
+    value_type lift(const T& value) const { return {value, value}; }
+    value_type combine(const value_type& a, const value_type& b) const {
+        return {b.first < a.first ? b.first : a.first, a.second < b.second ? b.second : a.second};
+    }
+};
+
+
+/**
+ * @brief Keeps the aggregate of every subtree of a tree up to date.
+ *
+ * Create it with Tree::add_aggregate. Each mutation of the tree recomputes only the changed node and its
+ * ancestors, using the parent links. The aggregates are kept in a hash map keyed by the node address, so
+ * reading one is a hash lookup (expected O(1)), and each ancestor costs k + 1 lookups to recompute.
+ *
+ * @tparam T The type of the values stored in the nodes.
+ * @tparam Monoid The aggregate to maintain (see SubtreeSize, SubtreeSum, SubtreeMin, SubtreeMax and SubtreeBounds).
+ */
+template<typename T, typename Monoid>
+class SubtreeAggregate : public TreeObserver<T> {
+public:
+    using value_type = typename Monoid::value_type;
+
+private:
+    Monoid monoid;  ///< The aggregate operations.
+    std::unordered_map<const Node<T>*, value_type> values;  ///< The aggregate of the subtree of each node.
+
+public:
+    /**
+     * @brief Computes the aggregates of an existing tree.
+     *
+     * @param root The root of the tree, or nullptr for an empty tree.
+     * @param monoid The aggregate operations.
+     */
+    explicit SubtreeAggregate(const std::shared_ptr<Node<T>>& root, Monoid monoid = Monoid())
+        : monoid(std::move(monoid)) {
+        on_reset(root);
+    }
+
+    /**
+     * @brief Gets the aggregate of the subtree rooted at a node, with one hash lookup.
+     *
+     * @param node A node of the observed tree.
+     * @return The aggregate of the node and all its descendants.
+     */
+    const value_type& of(const std::shared_ptr<Node<T>>& node) const {
+        return values.at(node.get());
+    }
+
+    /**
+     * @brief Gets the aggregate of the subtree rooted at a node, without a shared_ptr (one hash lookup).
+     */
+    const value_type& of(const Node<T>& node) const {
+        return values.at(&node);
+    }
+
+    void on_reset(const std::shared_ptr<Node<T>>& root) override {
+        values.clear();
+        if (root) build(root);
+    }
+
+    void on_attach(const std::shared_ptr<Node<T>>& node) override {
+        build(node);
+        propagate(node);
+    }
+
+    void on_detach(const std::shared_ptr<Node<T>>& node, const std::shared_ptr<Node<T>>& parent) override {
+        std::vector<Node<T>*> stack{node.get()};
+        while (!stack.empty()) {
+            Node<T>* current = stack.back();
+            stack.pop_back();
+            values.erase(current);
+            for (const auto& child : current->get_children()) {
+                if (child) stack.push_back(child.get());
+            }
+        }
+        on_update(parent);
+    }
+
+    void on_update(const std::shared_ptr<Node<T>>& node) override {
+        values.insert_or_assign(node.get(), recompute(*node));
+        propagate(node);
+    }
+
+private:
+    /**
+     * @brief Computes the aggregate of a node from its value and the stored aggregates of its children.
+     */
+    value_type recompute(const Node<T>& node) const {
+        value_type result = monoid.lift(node.get_value());
+        for (const auto& child : node.get_children()) {
+            if (child) result = monoid.combine(result, values.at(child.get()));
+        }
+        return result;
+    }
+
+    /**
+     * @brief Computes the aggregates of a whole subtree, children before parents.
+     */
+    void build(const std::shared_ptr<Node<T>>& subtree) {
+        std::vector<Node<T>*> order;  // pre-order, so walking it backwards visits children first
+        std::vector<Node<T>*> stack{subtree.get()};
+        while (!stack.empty()) {
+            Node<T>* node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            for (const auto& child : node->get_children()) {
+                if (child) stack.push_back(child.get());
+            }
+        }
+        for (auto it = order.rbegin(); it != order.rend(); ++it) {
+            values.insert_or_assign(*it, recompute(**it));
+        }
+    }
+
+    /**
+     * @brief Recomputes the aggregates of the ancestors of a node.
+     */
+    void propagate(const std::shared_ptr<Node<T>>& node) {
+        for (auto up = node->parent(); up; up = up->parent()) {
+            values.insert_or_assign(up.get(), recompute(*up));
+        }
+    }
+};
+
+#endif // SUBTREEAGGREGATE_HPP
@@ -0,0 +1,432 @@
+//guyes134@gmail.com
+
+#ifndef SUCCINCTTREE_HPP
+#define SUCCINCTTREE_HPP
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "Tree.hpp"
+
+
+/**
+ * @brief A bit vector that answers rank (how many 1 bits before a position) and select (where the r-th 1 or 0
+ * bit is) in O(1) and O(log) time, with about 6% extra space.
+ *
+ * Rank adds a count per 4096 bits (64 bits) and a count per 512 bits relative to it (16 bits) to the popcount
+ * of at most 8 words. Select starts from a sample, the block of every 4096th 1 (or 0) bit, binary searches the
+ * block counts up to the next sample and then scans the words of one block.
+ */
+class RankSelectBits {
+private:
+    static constexpr size_t block_bits = 512;  ///< The bits counted by one entry of block_ranks.
+    static constexpr size_t super_bits = 4096;  ///< The bits counted by one entry of super_ranks.
+    static constexpr size_t sample_rate = 4096;  ///< Every this many 1 (or 0) bits, select keeps the block.
+
+    std::vector<std::uint64_t> words;  ///< The bits, low bit first.
+    size_t bit_count = 0;  ///< The number of bits.
+    std::vector<std::uint64_t> super_ranks;  ///< The 1 bits before each super block.
+    std::vector<std::uint16_t> block_ranks;  ///< The 1 bits before each block, from the start of its super block.
+    std::vector<std::uint64_t> one_samples;  ///< The block of the 1 bit number i * sample_rate.
+    std::vector<std::uint64_t> zero_samples;  ///< The block of the 0 bit number i * sample_rate.
+    size_t one_count = 0;  ///< The number of 1 bits.
+
+public:
+    RankSelectBits() = default;
+
+    /**
+     * @brief Builds the rank and select directories of a bit vector. O(n / 64).
+     *
+     * @param words The bits, low bit first (the bits after size are ignored).
+     * @param size The number of bits.
+     */
+    RankSelectBits(std::vector<std::uint64_t> words, size_t size) : words(std::move(words)), bit_count(size) {
+        this->words.resize((size + 63) / 64);
+        if (size % 64) this->words.back() &= (std::uint64_t{1} << (size % 64)) - 1;
+        this->words.push_back(0);  // one more word, so select never reads past the end
+        this->words.shrink_to_fit();
+        size_t blocks = (size + block_bits - 1) / block_bits + 1;
+        block_ranks.resize(blocks);
+        super_ranks.resize((blocks * block_bits + super_bits - 1) / super_bits);
+        size_t ones = 0;
+        for (size_t block = 0; block < blocks; ++block) {
+            size_t position = block * block_bits;
+            if (position % super_bits == 0) super_ranks[position / super_bits] = ones;
+            block_ranks[block] = static_cast<std::uint16_t>(ones - super_ranks[position / super_bits]);
+            size_t block_ones = 0;
+            for (size_t w = position / 64; w < std::min(position / 64 + block_bits / 64, this->words.size()); ++w) {
+                block_ones += static_cast<size_t>(std::popcount(this->words[w]));
+            }
+            size_t block_zeros = std::min(block_bits, size > position ? size - position : 0) - block_ones;
+            size_t zeros = position - ones;
+            // the samples whose bit falls in this block
+            while (one_samples.size() * sample_rate < ones + block_ones) one_samples.push_back(block);
+            while (zero_samples.size() * sample_rate < zeros + block_zeros) zero_samples.push_back(block);
+            ones += block_ones;
+        }
+        one_count = ones;
+    }
+
+    /**
+     * @brief Gets the number of bits.
+     */
+    size_t size() const {
+        return bit_count;
+    }
+
+    /**
+     * @brief Gets a bit.
+     */
+    bool operator[](size_t position) const {
+        return (words[position / 64] >> (position % 64)) & 1;
+    }
+
+    /**
+     * @brief Counts the 1 bits before a position. O(1).
+     *
+     * @param position A position from 0 to size().
+     */
+    size_t rank1(size_t position) const {
+        size_t block = position / block_bits;
+        size_t rank = super_ranks[position / super_bits] + block_ranks[block];
+        for (size_t w = block * (block_bits / 64); w < position / 64; ++w) rank += static_cast<size_t>(std::popcount(words[w]));
+        if (position % 64) rank += static_cast<size_t>(std::popcount(words[position / 64] << (64 - position % 64)));
+        return rank;
+    }
+
+    /**
+     * @brief Counts the 1 bits from a position up to the next 0 bit. O(length / 64).
+     */
+    size_t run_of_ones(size_t position) const {
+        size_t run = 0;
+        while (true) {
+            int offset = static_cast<int>(position % 64);
+            size_t ones = static_cast<size_t>(std::countr_one(words[position / 64] >> offset));
+            run += std::min(ones, static_cast<size_t>(64 - offset));
+            if (ones < static_cast<size_t>(64 - offset)) return run;
+            position += 64 - offset;
+        }
+    }
+
+    /**
+     * @brief Counts the 0 bits before a position. O(1).
+     */
+    size_t rank0(size_t position) const {
+        return position - rank1(position);
+    }
+
+    /**
+     * @brief Finds the 1 bit number r (from 0). O(log(sample_rate)) in the worst case.
+     *
+     * @throws std::out_of_range If there are not more than r 1 bits.
+     */
+    size_t select1(size_t r) const {
+        if (r >= one_count) throw std::out_of_range("select1 beyond the last 1 bit");
+        return select<true>(r, one_samples);
+    }
+
+    /**
+     * @brief Finds the 0 bit number r (from 0). O(log(sample_rate)) in the worst case.
+     *
+     * @throws std::out_of_range If there are not more than r 0 bits.
+     */
+    size_t select0(size_t r) const {
+        if (r >= bit_count - one_count) throw std::out_of_range("select0 beyond the last 0 bit");
+        return select<false>(r, zero_samples);
+    }
+
+    /**
+     * @brief Gets the memory used by the bits and the directories, in bytes.
+     */
+    size_t memory_bytes() const {
+        return words.capacity() * sizeof(std::uint64_t) + super_ranks.capacity() * sizeof(std::uint64_t) +
+               block_ranks.capacity() * sizeof(std::uint16_t) +
+               (one_samples.capacity() + zero_samples.capacity()) * sizeof(std::uint64_t);
+    }
+
+private:
+    /**
+     * @brief The 1 (or 0) bits before a block.
+     */
+    template<bool one>
+    size_t block_rank(size_t block) const {
+        size_t ones = super_ranks[block * block_bits / super_bits] + block_ranks[block];
+        return one ? ones : block * block_bits - ones;
+    }
+
+    /**
+     * @brief Finds the 1 (or 0) bit number r: the sampled block, a binary search over the blocks up to the next
+     * sample, then the words of the block.
+     */
+    template<bool one>
+    size_t select(size_t r, const std::vector<std::uint64_t>& samples) const {
+        size_t low = samples[r / sample_rate];
+        size_t high = r / sample_rate + 1 < samples.size() ? samples[r / sample_rate + 1] : block_ranks.size() - 1;
+        while (low < high) {  // the last block that starts with at most r such bits
+            size_t middle = low + (high - low + 1) / 2;
+            if (block_rank<one>(middle) <= r) low = middle;
+            else high = middle - 1;
+        }
+        r -= block_rank<one>(low);
+        for (size_t w = low * (block_bits / 64);; ++w) {
+            std::uint64_t word = one ? words[w] : ~words[w];
+            size_t count = static_cast<size_t>(std::popcount(word));
+            if (r < count) {
+                for (; r > 0; --r) word &= word - 1;
+                return w * 64 + static_cast<size_t>(std::countr_zero(word));
+            }
+            r -= count;
+        }
+    }
+};
+
+
+/**
+ * @brief A read-only copy of a tree in about 2 bits per node plus the values, for large trees that no longer change.
+ *
+ * The shape is stored as its LOUDS (level-order unary degree sequence): a 1 bit for the root, a 0 bit, and then
+ * for each node in BFS order a 1 bit per child and a 0 bit, 2n + 1 bits in all. The nodes are named by their BFS
+ * position, which is also the index of their value in a packed array, and every navigation step is one select
+ * on the bits:
+ * - node v is the 1 bit number v, so its parent owns the block of that bit: select1(v) - v - 1;
+ * - the children of v are the 1 bits after the 0 bit number v; they have consecutive ids from select0(v) - v.
+ *
+ * The copy keeps the order of the children but not the empty slots between them. It describes the tree at the
+ * time it was built; build a new one after mutating the tree.
+ *
+ * @tparam T The type of the values stored in the nodes.
+ */
+template<typename T>
+class SuccinctTree {
+public:
+    static constexpr size_t npos = static_cast<size_t>(-1);  ///< The id of a node that does not exist.
+
+private:
+    RankSelectBits bits;  ///< The LOUDS of the tree.
+    std::vector<T> values;  ///< The values in BFS order; the index is the node id.
+
+public:
+    /**
+     * @brief Builds the succinct copy of a tree. O(n).
+     *
+     * @param tree The tree to copy.
+     */
+    template<int k>
+    explicit SuccinctTree(const Tree<T, k>& tree) {
+        std::vector<const Node<T>*> order;  // BFS order; also used as the queue
+        if (tree.getRoot()) order.push_back(tree.getRoot().get());
+        std::vector<std::uint64_t> words{order.empty() ? 0u : 1u};  // the 1 bit of the root and its 0 bit
+        size_t bit = order.empty() ? 0 : 2;
+        for (size_t i = 0; i < order.size(); ++i) {
+            const Node<T>* node = order[i];
+            values.push_back(node->get_value());
+            const auto& children = node->get_children();
+            for (auto slots = node->getOccupancy(); slots; slots &= slots - 1) {
+                order.push_back(children[std::countr_zero(slots)].get());
+                if (bit / 64 >= words.size()) words.push_back(0);
+                words[bit / 64] |= std::uint64_t{1} << (bit % 64);
+                ++bit;
+            }
+            ++bit;  // the 0 bit after the children
+            if (bit / 64 >= words.size()) words.push_back(0);
+        }
+        values.shrink_to_fit();
+        bits = RankSelectBits(std::move(words), bit);
+    }
+
+    /**
+     * @brief Gets the number of nodes.
+     */
+    size_t size() const {
+        return values.size();
+    }
+
+    /**
+     * @brief Checks whether the tree has no nodes.
+     */
+    bool empty() const {
+        return values.empty();
+    }
+
+    /**
+     * @brief Gets the id of the root, or npos for an empty tree.
+     */
+    size_t root() const {
+        return empty() ? npos : 0;
+    }
+
+    /**
+     * @brief Gets the value of a node.
+     */
+    const T& value(size_t node) const {
+        return values[node];
+    }
+
+    /**
+     * @brief Gets the number of children of a node. O(1) select operations.
+     */
+    size_t degree(size_t node) const {
+        return bits.run_of_ones(bits.select0(node) + 1);
+    }
+
+    /**
+     * @brief Gets a child of a node.
+     *
+     * @param node The node.
+     * @param index The position among its children (0 for the first).
+     * @return The child, or npos if the node has no more children.
+     */
+    size_t child(size_t node, size_t index) const {
+        size_t zero = bits.select0(node);
+        return index < bits.run_of_ones(zero + 1) ? zero - node + index : npos;
+    }
+
+    /**
+     * @brief Gets the first child of a node, or npos for a leaf.
+     */
+    size_t first_child(size_t node) const {
+        size_t zero = bits.select0(node);
+        return bits[zero + 1] ? zero - node : npos;
+    }
+
+    /**
+     * @brief Gets the parent of a node, or npos for the root.
+     */
+    size_t parent(size_t node) const {
+        size_t owner = bits.select1(node) - node;  // the 0 bits before the 1 bit of the node
+        return owner == 0 ? npos : owner - 1;
+    }
+
+    /**
+     * @brief Gets the next child of the parent of a node, or npos for the last child and the root.
+     */
+    size_t next_sibling(size_t node) const {
+        return node != 0 && bits[bits.select1(node) + 1] ? node + 1 : npos;
+    }
+
+    /**
+     * @brief Gets the previous child of the parent of a node, or npos for the first child and the root.
+     */
+    size_t prev_sibling(size_t node) const {
+        return node != 0 && bits[bits.select1(node) - 1] ? node - 1 : npos;
+    }
+
+    /**
+     * @brief Gets the number of bits that store the shape, with the rank and select directories.
+     */
+    size_t topology_bits() const {
+        return bits.memory_bytes() * 8;
+    }
+
+    /**
+     * @brief Gets the memory used by the shape and the values, in bytes (the iterators use O(depth) more).
+     */
+    size_t memory_bytes() const {
+        return sizeof(*this) + bits.memory_bytes() + values.capacity() * sizeof(T);
+    }
+
+
+/**---------------------------------------Iterators-------------------------------------------**/
+
+    /**
+     * @brief Visits the nodes in BFS order, which is the order of their ids.
+     */
+    class BFSIterator {
+    private:
+        const SuccinctTree* tree;  ///< The tree.
+        size_t current;  ///< The id of the current node.
+
+    public:
+        BFSIterator(const SuccinctTree* tree, size_t current) : tree(tree), current(current) {}
+
+        const T& operator*() const { return tree->values[current]; }
+
+        /**
+         * @brief Gets the id of the current node.
+         */
+        size_t id() const { return current; }
+
+        BFSIterator& operator++() {
+            ++current;
+            return *this;
+        }
+
+        bool operator==(const BFSIterator& other) const { return current == other.current; }
+
+        bool operator!=(const BFSIterator& other) const { return !(*this == other); }
+    };
+
+    /**
+     * @brief Visits the nodes in DFS order (pre-order, children in order), as Tree::begin_dfs_scan does.
+     *
+     * The children of a node have consecutive ids, so the stack holds one range of ids per level instead of
+     * the nodes themselves. The 0 bit of node v + 1 is the 0 bit of v plus its degree plus one, so the stack
+     * also keeps the 0 bit of the next sibling on each level, and only the first children take a select.
+     */
+    class DFSIterator {
+    private:
+        /**
+         * @brief The later siblings on one level of the path.
+         */
+        struct Siblings {
+            size_t next;  ///< The next sibling to visit.
+            size_t end;  ///< One past the last sibling.
+            size_t zero;  ///< The position of the 0 bit of next, once its previous sibling was visited.
+        };
+
+        const SuccinctTree* tree;  ///< The tree.
+        size_t current;  ///< The id of the current node, or npos at the end.
+        size_t zero = npos;  ///< The position of the 0 bit of the current node, if known.
+        std::vector<Siblings> pending;  ///< The later siblings on each level of the path.
+
+    public:
+        DFSIterator(const SuccinctTree* tree, size_t current) : tree(tree), current(current) {}
+
+        const T& operator*() const { return tree->values[current]; }
+
+        /**
+         * @brief Gets the id of the current node.
+         */
+        size_t id() const { return current; }
+
+        DFSIterator& operator++() {
+            if (zero == npos) zero = tree->bits.select0(current);
+            size_t children = tree->bits.run_of_ones(zero + 1);
+            if (!pending.empty() && pending.back().next == current + 1) pending.back().zero = zero + children + 1;
+            if (children > 0) {
+                size_t first = zero - current;
+                if (children > 1) pending.push_back({first + 1, first + children, npos});
+                current = first;
+                zero = npos;
+            } else if (pending.empty()) {
+                current = npos;
+            } else {
+                auto& siblings = pending.back();
+                current = siblings.next++;
+                zero = siblings.zero;
+                siblings.zero = npos;
+                if (siblings.next == siblings.end) pending.pop_back();
+            }
+            return *this;
+        }
+
+        bool operator==(const DFSIterator& other) const { return current == other.current; }
+
+        bool operator!=(const DFSIterator& other) const { return !(*this == other); }
+    };
+
+    BFSIterator begin_bfs_scan() const { return BFSIterator(this, 0); }
+
+    BFSIterator end_bfs_scan() const { return BFSIterator(this, size()); }
+
+    DFSIterator begin_dfs_scan() const { return DFSIterator(this, root()); }
+
+    DFSIterator end_dfs_scan() const { return DFSIterator(this, npos); }
+};
+
+#endif // SUCCINCTTREE_HPP
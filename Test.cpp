@@ -1,10 +1,26 @@
 //guyes134@gmail.com
 
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#define TREE_STATS  // the tests also check the instrumentation counters
 #include "doctest.h"
 #include "Node.hpp"
 #include "Tree.hpp"
 #include "Complex.hpp"
+#include "VersionedTree.hpp"
+#include "LCAIndex.hpp"
+#include "BTree.hpp"
+#include "TreeLog.hpp"
+#include "TreeCodec.hpp"
+#include "SuccinctTree.hpp"
+#include "TreeWriter.hpp"
+#include "TreeReader.hpp"
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
 
 // Node Class Tests
 TEST_CASE("Node Class - Basic Functionality") {
@@ -63,6 +79,281 @@ TEST_CASE("Node Class - Basic Functionality") {
         node.addChildAt(child3, 2);
         CHECK_THROWS_AS(node.addChildAt(child4, 3), std::out_of_range);
         CHECK(node.getNumOfChildren() == 3);
+        CHECK(node.firstFreeSlot() == 3);  // no free slot
+    }
+
+    SUBCASE("Testing the occupancy bitmask and the first free slot") {
+        CHECK(node.firstFreeSlot() == 0);
+        node.addChildAt(std::make_shared<Node<int>>(10, 3), 0);
+        node.addChildAt(std::make_shared<Node<int>>(20, 3), 2);
+        CHECK(node.getOccupancy() == 0b101);
+        CHECK(node.firstFreeSlot() == 1);
+
+        node.removeChildAt(0);  // the child in slot 2 moves to slot 1
+        CHECK(node.getOccupancy() == 0b010);
+        CHECK(node.getChildAt(1)->get_value() == 20);
+        CHECK(node.firstFreeSlot() == 0);
+    }
+
+    SUBCASE("Testing nodes with 64 slots") {
+        auto wide = std::make_shared<Node<int>>(0, 64);
+        bool slots_match = true;
+        for (int i = 0; i < 64; ++i) {
+            slots_match = slots_match && wide->firstFreeSlot() == static_cast<size_t>(i);
+            wide->addChildAt(std::make_shared<Node<int>>(i + 1, 64), i);
+        }
+        CHECK(slots_match);
+        CHECK(wide->getNumOfChildren() == 64);
+        CHECK(wide->firstFreeSlot() == 64);
+        CHECK(wide->getChildAt(62)->next_sibling() == wide->getChildAt(63));
+        CHECK(wide->getChildAt(63)->next_sibling() == nullptr);
+
+        wide->removeChildAt(63);
+        CHECK(wide->firstFreeSlot() == 63);
+        CHECK(wide->getChildAt(62)->next_sibling() == nullptr);
+        CHECK_THROWS_AS(Node<int>(0, 65), std::invalid_argument);
+    }
+}
+
+TEST_CASE("Node Class - Parent Links") {
+    Tree<int, 3> tree;
+    tree.add_root(1);
+    tree.add_sub_node(1, 2);
+    tree.add_sub_node(1, 3);
+    tree.add_sub_node(1, 4);
+    tree.add_sub_node(3, 5);
+    auto root = tree.getRoot();
+    auto leaf = root->getChildAt(1)->getChildAt(0);
+
+    SUBCASE("Parent and depth") {
+        CHECK(root->parent() == nullptr);
+        CHECK(root->depth() == 0);
+        CHECK(leaf->parent() == root->getChildAt(1));
+        CHECK(leaf->depth() == 2);
+    }
+
+    SUBCASE("Path to root") {
+        auto path = leaf->path_to_root();
+        REQUIRE(path.size() == 2);
+        CHECK(path[0]->get_value() == 3);
+        CHECK(path[1] == root);
+    }
+
+    SUBCASE("Next sibling") {
+        CHECK(root->getChildAt(0)->next_sibling()->get_value() == 3);
+        CHECK(root->getChildAt(1)->next_sibling()->get_value() == 4);
+        CHECK(root->getChildAt(2)->next_sibling() == nullptr);
+        CHECK(root->next_sibling() == nullptr);
+    }
+
+    SUBCASE("Parent links do not keep the tree alive") {
+        std::weak_ptr<Node<int>> weak_root = root;
+        std::weak_ptr<Node<int>> weak_leaf = leaf;
+        root.reset();
+        leaf.reset();
+        tree.add_root(10);
+        CHECK(weak_root.expired());
+        CHECK(weak_leaf.expired());
+    }
+}
+
+TEST_CASE("Tree - Sift up after decreasing a heap value") {
+    Tree<int, 2> tree;
+    tree.add_root(10);
+    tree.add_sub_node(10, 15);
+    tree.add_sub_node(10, 20);
+    tree.add_sub_node(15, 30);
+    auto leaf = tree.getRoot()->getChildAt(0)->getChildAt(0);
+
+    leaf->get_value() = 5;
+    tree.sift_up(leaf);
+
+    std::vector<int> result;
+    for (auto it = tree.begin_bfs_scan(); it != tree.end_bfs_scan(); ++it) result.push_back(*it);
+    CHECK(result == std::vector<int>{5, 10, 20, 15});
+}
+
+TEST_CASE("Tree - Subtree aggregates") {
+    Tree<int, 3> tree;
+    tree.add_root(1);
+    auto sizes = tree.add_aggregate(SubtreeSize<int>());
+    auto sums = tree.add_aggregate(SubtreeSum<int>());
+    auto mins = tree.add_aggregate(SubtreeMin<int>());
+    auto maxs = tree.add_aggregate(SubtreeMax<int>());
+
+    auto two = tree.add_sub_node(1, 2);
+    tree.add_sub_node(1, 3);
+    auto four = tree.add_sub_node(two, 4);
+    tree.add_sub_node(2, 5);
+    auto root = tree.getRoot();
+
+    SUBCASE("Appending updates the path to the root") {
+        CHECK(sizes->of(root) == 5);
+        CHECK(sums->of(root) == 15);
+        CHECK(sizes->of(two) == 3);
+        CHECK(sums->of(two) == 11);
+        CHECK(mins->of(two) == 2);
+        CHECK(maxs->of(two) == 5);
+        CHECK(sizes->of(four) == 1);
+    }
+
+    SUBCASE("Updating a value updates the path to the root") {
+        tree.set_value(four, -10);
+        CHECK(sums->of(two) == -3);
+        CHECK(sums->of(root) == 1);
+        CHECK(mins->of(root) == -10);
+        CHECK(maxs->of(root) == 5);
+    }
+
+    SUBCASE("Heapify keeps the aggregates up to date") {
+        Tree<int, 2> heap;
+        heap.add_root(50);
+        auto heap_mins = heap.add_aggregate(SubtreeMin<int>());
+        heap.add_sub_node(50, 40);
+        heap.add_sub_node(50, 30);
+        heap.add_sub_node(40, 10);
+        heap.myHeap();
+        CHECK(heap.getRoot()->get_value() == 10);
+        CHECK(heap_mins->of(heap.getRoot()->getChildAt(0)) == heap.getRoot()->getChildAt(0)->get_value());
+    }
+
+    SUBCASE("A new root resets the aggregates") {
+        tree.add_root(7);
+        CHECK(sizes->of(tree.getRoot()) == 1);
+        CHECK(sums->of(tree.getRoot()) == 7);
+    }
+
+    SUBCASE("An aggregate added later is built from the existing tree") {
+        auto late = tree.add_aggregate(SubtreeSize<int>());
+        CHECK(late->of(root) == 5);
+        tree.remove_observer(late);
+        tree.add_sub_node(3, 6);
+        CHECK(late->of(root) == 5);
+        CHECK(sizes->of(root) == 6);
+    }
+
+    SUBCASE("A copy of the tree does not update the aggregates of the original") {
+        Tree<int, 3> copy = tree;
+        copy.add_root(100);
+        CHECK(sizes->of(root) == 5);
+        CHECK(sums->of(tree.getRoot()) == 15);
+        Tree<int, 3> assigned;
+        assigned = tree;
+        assigned.add_root(100);
+        tree.add_sub_node(3, 6);
+        CHECK(sizes->of(root) == 6);
+        CHECK(sums->of(root) == 21);
+    }
+}
+
+TEST_CASE("Tree - Instrumentation counters") {
+    Tree<int, 2> tree;
+    Tree<int, 2>::reset_stats();
+    tree.add_root(1);
+    tree.add_sub_node(1, 2);
+    tree.add_sub_node(1, 3);
+    tree.add_sub_node(2, 4);
+
+    SUBCASE("Node allocations and find comparisons are counted") {
+        TreeStats stats = Tree<int, 2>::stats();
+        CHECK(stats.node_allocations == 4);
+        CHECK(stats.bytes_allocated >= 4 * sizeof(Node<int>));
+        CHECK(stats.find_comparisons == 1 + 1 + 2);  // 1 is the root; 2 is its first child
+    }
+
+    SUBCASE("A search for a missing value compares every node") {
+        Tree<int, 2>::reset_stats();
+        CHECK(tree.find_node(42) == nullptr);
+        CHECK(Tree<int, 2>::stats().find_comparisons == 4);
+        CHECK(Tree<int, 2>::stats().node_allocations == 0);
+    }
+
+    SUBCASE("Iterators count refcount operations and container growths") {
+        Tree<int, 2>::reset_stats();
+        int count = 0;
+        for (auto it = tree.begin_bfs_scan(); it != tree.end_bfs_scan(); ++it) ++count;
+        CHECK(count == 4);
+        CHECK(Tree<int, 2>::stats().refcount_operations >= 4);
+        CHECK(Tree<int, 2>::stats().container_growths >= 2);  // the queue reached sizes 1 and 2
+    }
+}
+
+TEST_CASE("Tree - Pruned find") {
+    // A heap-ordered tree: every subtree holds values between its root and the largest value below it
+    Tree<int, 2> tree;
+    tree.add_root(1);
+    auto two = tree.add_sub_node(1, 2);
+    auto three = tree.add_sub_node(1, 3);
+    auto four = tree.add_sub_node(2, 4);
+    auto five = tree.add_sub_node(2, 5);
+    tree.enable_pruned_find();
+
+    SUBCASE("Values outside the bounds of the tree are rejected at the root") {
+        Tree<int, 2>::reset_stats();
+        CHECK(tree.find_node(0) == nullptr);
+        CHECK(tree.find_node(42) == nullptr);
+        CHECK(Tree<int, 2>::stats().find_comparisons == 0);
+        CHECK(Tree<int, 2>::stats().find_pruned_subtrees == 2);
+    }
+
+    SUBCASE("Subtrees that cannot contain the value are skipped") {
+        Tree<int, 2>::reset_stats();
+        CHECK(tree.find_node(3) == three);
+        CHECK(Tree<int, 2>::stats().find_comparisons == 3);  // 1, 2 (its subtree holds 2..5) and 3
+        CHECK(Tree<int, 2>::stats().find_pruned_subtrees == 2);  // the leaves 4 and 5
+        Tree<int, 2>::reset_stats();
+        CHECK(tree.find_node(5) == five);
+        CHECK(Tree<int, 2>::stats().find_pruned_subtrees == 1);  // the leaf 4
+        CHECK(tree.find_node(2) == two);
+    }
+
+    SUBCASE("The bounds follow the mutations") {
+        tree.set_value(four, 40);
+        CHECK(tree.find_node(40) == four);
+        CHECK(tree.find_node(4) == nullptr);
+        auto six = tree.add_sub_node(three, -6);
+        CHECK(tree.find_node(-6) == six);
+        tree.myHeap();
+        CHECK(tree.getRoot()->get_value() == -6);
+        CHECK(tree.find_node(-6) == tree.getRoot());
+        for (int value : {1, 2, 3, 5, 40}) CHECK(tree.find_node(value) != nullptr);
+
+        tree.add_root(7);
+        CHECK(tree.find_node(7) == tree.getRoot());
+        CHECK(tree.find_node(1) == nullptr);
+    }
+
+    SUBCASE("A copy of the tree does not share the bounds") {
+        Tree<int, 2> copy = tree;
+        copy.add_root(100);
+        CHECK(tree.find_node(2) == two);
+        CHECK(tree.add_sub_node(4, 6) != nullptr);
+        CHECK(tree.find_node(6) != nullptr);
+        CHECK(copy.find_node(100) == copy.getRoot());
+        Tree<int, 2> assigned;
+        assigned = tree;
+        assigned.add_root(100);
+        CHECK(tree.find_node(5) == five);
+        CHECK(tree.find_node(42) == nullptr);
+    }
+
+    SUBCASE("Disabling the bounds visits every node again") {
+        tree.disable_pruned_find();
+        Tree<int, 2>::reset_stats();
+        CHECK(tree.find_node(42) == nullptr);
+        CHECK(Tree<int, 2>::stats().find_comparisons == 5);
+    }
+
+    SUBCASE("Complex values are bounded by their magnitude") {
+        CHECK(Complex(1, 0) < Complex(0, 2));
+        CHECK_FALSE(Complex(0, 2) < Complex(1, 0));
+        Tree<Complex, 3> complex_tree;
+        complex_tree.add_root(Complex(1, 0));
+        complex_tree.enable_pruned_find();
+        auto child = complex_tree.add_sub_node(Complex(1, 0), Complex(0, 2));
+        complex_tree.add_sub_node(Complex(1, 0), Complex(3, 4));
+        CHECK(complex_tree.find_node(Complex(0, 2)) == child);
+        CHECK(complex_tree.find_node(Complex(0, 9)) == nullptr);
     }
 }
 
@@ -354,4 +645,1137 @@ TEST_CASE("Tree Iterators - HeapIterator") {
     }
 }
 
+TEST_CASE("Tree - Persistent operations") {
+    Tree<int, 2> v1 = Tree<int, 2>().with_root(1);
+    Tree<int, 2> v2 = v1.with_sub_node(1, 2);
+    Tree<int, 2> v3 = v2.with_sub_node(1, 3);
+    Tree<int, 2> v4 = v3.with_sub_node(2, 4);
+    Tree<int, 2> v5 = v4.with_value(3, 30);
+
+    auto bfs = [](const Tree<int, 2>& tree) {
+        std::vector<int> result;
+        for (auto it = tree.begin_bfs_scan(); it != tree.end_bfs_scan(); ++it) result.push_back(*it);
+        return result;
+    };
+
+    SUBCASE("Older versions are unchanged") {
+        CHECK(bfs(v1) == std::vector<int>{1});
+        CHECK(bfs(v2) == std::vector<int>{1, 2});
+        CHECK(bfs(v3) == std::vector<int>{1, 2, 3});
+        CHECK(bfs(v4) == std::vector<int>{1, 2, 3, 4});
+        CHECK(bfs(v5) == std::vector<int>{1, 2, 30, 4});
+    }
+
+    SUBCASE("Untouched subtrees are shared") {
+        CHECK(v4.getRoot()->getChildAt(1) == v3.getRoot()->getChildAt(1));
+        CHECK(v5.getRoot()->getChildAt(0) == v4.getRoot()->getChildAt(0));
+        CHECK(v5.getRoot() != v4.getRoot());
+    }
+
+    SUBCASE("Many versions cost O(changes x depth) nodes") {
+        Tree<int, 2> base;
+        base.add_root(0);
+        for (int i = 1; i < 1023; ++i) base.add_sub_node((i - 1) / 2, i);  // a full tree of depth 9
+
+        std::vector<Tree<int, 2>> versions{base};
+        for (int i = 0; i < 100; ++i) {
+            versions.push_back(versions.back().with_value(1000 - i, -i));
+        }
+
+        std::set<const void*> nodes;
+        for (const auto& version : versions) {
+            std::vector<std::shared_ptr<Node<int>>> stack{version.getRoot()};
+            while (!stack.empty()) {
+                auto node = stack.back();
+                stack.pop_back();
+                if (!nodes.insert(node.get()).second) continue;
+                for (const auto& child : node->get_children()) if (child) stack.push_back(child);
+            }
+        }
+        CHECK(nodes.size() <= 1023 + 100 * 10);
+    }
+
+    SUBCASE("The newest version can be navigated upward after the older ones are dropped") {
+        Tree<int, 2> base;
+        base.add_root(1);
+        base.add_sub_node(1, 2);
+        base.add_sub_node(1, 3);
+        base.add_sub_node(2, 4);
+        base.add_sub_node(2, 5);
+        base.with_value(1, 10).with_sub_node(3, 6);  // a version that is dropped at once
+        CHECK(base.find_node(4)->depth() == 2);
+        CHECK(base.find_node(4)->path_to_root().back() == base.getRoot());
+
+        Tree<int, 2> next = base.with_value(1, 10).with_sub_node(3, 6);
+        CHECK(base.find_node(4)->path_to_root().back() == base.getRoot());  // the older version keeps its links
+        base = Tree<int, 2>();
+
+        auto two = next.find_node(2);
+        auto five = next.find_node(5);
+        CHECK(two->parent() == next.getRoot());
+        CHECK(two->depth() == 1);
+        CHECK(five->depth() == 2);
+        CHECK(five->path_to_root().back() == next.getRoot());
+        CHECK(two->next_sibling() == next.find_node(3));
+        CHECK(next.find_node(6)->depth() == 2);
+        next.detach(five);
+        CHECK(bfs(next) == std::vector<int>{10, 2, 3, 4, 6});
+    }
+
+    SUBCASE("Invalid persistent operations throw") {
+        CHECK_THROWS_AS(v5.with_sub_node(42, 5), std::invalid_argument);
+        CHECK_THROWS_AS(v5.with_sub_node(1, 5), std::out_of_range);
+        CHECK_THROWS_AS(v5.with_value(42, 5), std::invalid_argument);
+    }
+}
+
+TEST_CASE("VersionedTree - Snapshot isolation") {
+    VersionedTree<int, 2> tree;
+    tree.add_root(0);
+    tree.add_sub_node(0, 1);
+
+    SUBCASE("A pinned snapshot does not see later writes") {
+        auto snapshot = tree.pin();
+        tree.add_sub_node(0, 2);
+        tree.add_sub_node(1, 3);
+
+        std::vector<int> old_result, new_result;
+        for (auto it = snapshot->begin_bfs_scan(); it != snapshot->end_bfs_scan(); ++it) old_result.push_back(*it);
+        auto latest = tree.pin();
+        for (auto it = latest->begin_bfs_scan(); it != latest->end_bfs_scan(); ++it) new_result.push_back(*it);
+
+        CHECK(old_result == std::vector<int>{0, 1});
+        CHECK(new_result == std::vector<int>{0, 1, 2, 3});
+        CHECK(snapshot.epoch() == 2);
+        CHECK(latest.epoch() == 4);
+    }
+
+    SUBCASE("Untouched subtrees are shared between versions") {
+        tree.add_sub_node(0, 2);
+        auto before = tree.pin();
+        tree.add_sub_node(2, 3);
+        auto after = tree.pin();
+
+        CHECK(before->getRoot() != after->getRoot());
+        CHECK(before->getRoot()->getChildAt(0) == after->getRoot()->getChildAt(0));
+    }
+
+    SUBCASE("Old versions are reclaimed once no snapshot holds them") {
+        {
+            auto snapshot = tree.pin();
+            tree.add_sub_node(0, 2);
+            CHECK(tree.live_versions() == 2);
+        }
+        CHECK(tree.live_versions() == 1);
+    }
+
+    SUBCASE("Updating a value publishes a new version") {
+        auto before = tree.pin();
+        tree.update_value(1, 10);
+        CHECK(before->getRoot()->getChildAt(0)->get_value() == 1);
+        CHECK(tree.pin()->getRoot()->getChildAt(0)->get_value() == 10);
+    }
+
+    SUBCASE("Adding to a missing parent throws") {
+        CHECK_THROWS_AS(tree.add_sub_node(42, 5), std::invalid_argument);
+        CHECK(tree.epoch() == 2);
+    }
+}
+
+TEST_CASE("VersionedTree - Concurrent readers and a writer") {
+    VersionedTree<int, 2> tree;
+    const int nodes = 2000;
+    std::atomic<bool> done{false};
+    std::atomic<bool> consistent{true};
+
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 3; ++r) {
+        readers.emplace_back([&] {
+            while (!done.load()) {
+                auto snapshot = tree.pin();
+                std::uint64_t count = 0;
+                for (auto it = snapshot->begin_bfs_scan(); it != snapshot->end_bfs_scan(); ++it) ++count;
+                if (count != snapshot.epoch()) consistent = false;  // each write adds exactly one node
+            }
+        });
+    }
+
+    tree.add_root(0);
+    for (int i = 1; i < nodes; ++i) {
+        tree.add_sub_node((i - 1) / 2, i);
+    }
+    done = true;
+    for (auto& reader : readers) reader.join();
+
+    CHECK(consistent.load());
+    CHECK(tree.epoch() == nodes);
+}
+
+TEST_CASE("LCAIndex - Lowest common ancestor queries") {
+    Tree<int, 3> tree;
+    tree.add_root(0);
+    std::vector<std::shared_ptr<Node<int>>> nodes{tree.getRoot()};
+    std::mt19937 rng(42);
+    while (nodes.size() < 500) {
+        auto parent = nodes[rng() % nodes.size()];
+        if (parent->getNumOfChildren() < 3) nodes.push_back(tree.add_sub_node(parent, static_cast<int>(nodes.size())));
+    }
+    LCAIndex<int> index(tree);
+
+    // The reference answer walks the parent links
+    auto naive = [](std::shared_ptr<Node<int>> a, std::shared_ptr<Node<int>> b) {
+        std::set<Node<int>*> ancestors{a.get()};
+        for (const auto& up : a->path_to_root()) ancestors.insert(up.get());
+        while (!ancestors.count(b.get())) b = b->parent();
+        return b;
+    };
+
+    SUBCASE("Single queries match the naive answer") {
+        CHECK(index.size() == 500);
+        CHECK(index.query(nodes[7], nodes[7]) == nodes[7]);
+        CHECK(index.query(tree.getRoot(), nodes[123]) == tree.getRoot());
+        bool all_match = true;
+        for (int i = 0; i < 2000; ++i) {
+            auto a = nodes[rng() % nodes.size()];
+            auto b = nodes[rng() % nodes.size()];
+            all_match = all_match && index.query(a, b) == naive(a, b);
+        }
+        CHECK(all_match);
+    }
+
+    SUBCASE("Batch queries match single queries") {
+        std::vector<std::pair<std::shared_ptr<Node<int>>, std::shared_ptr<Node<int>>>> pairs;
+        for (int i = 0; i < 5000; ++i) pairs.emplace_back(nodes[rng() % nodes.size()], nodes[rng() % nodes.size()]);
+        auto results = index.query_batch(pairs, 4);
+        REQUIRE(results.size() == pairs.size());
+        bool all_match = true;
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            all_match = all_match && results[i] == index.query(pairs[i].first, pairs[i].second);
+        }
+        CHECK(all_match);
+    }
+
+    SUBCASE("Nodes outside the index throw") {
+        auto stranger = std::make_shared<Node<int>>(1, 3);
+        CHECK_THROWS_AS(index.query(stranger, nodes[0]), std::invalid_argument);
+
+        // In a batch, the worker that meets the node hands the exception back to the calling thread
+        std::vector<std::pair<std::shared_ptr<Node<int>>, std::shared_ptr<Node<int>>>> pairs(5000, {nodes[1], nodes[2]});
+        pairs[4000].second = stranger;
+        CHECK_THROWS_AS(index.query_batch(pairs, 4), std::invalid_argument);
+        pairs[4000].second = nodes[3];
+        pairs[0].first = stranger;
+        CHECK_THROWS_AS(index.query_batch(pairs, 4), std::invalid_argument);
+    }
+}
+
+TEST_CASE("Tree - Deep trees do not overflow the stack") {
+    // A chain several hundred thousand levels deep: find, add_sub_node by value, clone, operator==, heapify and
+    // the destructor must not recurse once per level
+    const int depth = 500000;
+    auto tree = std::make_unique<Tree<int, 2>>();
+    tree->add_root(0);
+    auto bottom = tree->getRoot();
+    for (int i = 1; i < depth; ++i) bottom = tree->add_sub_node(bottom, i);
+
+    CHECK(tree->find_node(depth - 1) == bottom);
+    CHECK(tree->find_node(depth) == nullptr);
+    auto copy = tree->clone();
+    CHECK(copy == *tree);
+    copy = Tree<int, 2>();
+    auto leaf = tree->add_sub_node(depth - 1, -1);
+    CHECK(leaf->parent() == bottom);
+
+    // Only the -1 at the bottom is out of place, so it moves up one level per sifted ancestor
+    auto it = tree->myHeap();
+    CHECK(*it == -1);
+    int previous = -2, count = 0;
+    bool sorted = true;
+    for (; it != tree->end_heap(); ++it, ++count) {
+        sorted = sorted && previous < *it;
+        previous = *it;
+    }
+    CHECK(sorted);
+    CHECK(count == depth + 1);
+
+    // The chain is freed once the last handle to it is gone
+    std::weak_ptr<Node<int>> watch = leaf;
+    bottom.reset();
+    leaf.reset();
+    tree.reset();
+    CHECK(watch.expired());
+}
+
+/**
+ * @brief A value that counts its copies, to check that the tree moves or constructs values in place.
+ */
+struct CopyCounted {
+    inline static int copies = 0;
+    std::string text;
+
+    explicit CopyCounted(std::string text) : text(std::move(text)) {}
+    CopyCounted(const std::string& first, const std::string& second) : text(first + second) {}
+    CopyCounted(const CopyCounted& other) : text(other.text) { ++copies; }
+    CopyCounted(CopyCounted&&) noexcept = default;
+    CopyCounted& operator=(const CopyCounted& other) {
+        text = other.text;
+        ++copies;
+        return *this;
+    }
+    CopyCounted& operator=(CopyCounted&&) noexcept = default;
+    bool operator==(const CopyCounted& other) const { return text == other.text; }
+};
+
+TEST_CASE("Tree - Emplacing and moving values") {
+    CopyCounted::copies = 0;
+    Tree<CopyCounted, 3> tree;
+    auto sizes = tree.add_aggregate<SubtreeSize<CopyCounted>>();
+
+    auto root = tree.emplace_root("root");
+    auto ab = tree.emplace_sub_node(root, "a", "b");
+    tree.add_sub_node(root, CopyCounted("c"));
+    tree.add_sub_node(CopyCounted("root"), CopyCounted("d"));
+    CHECK(ab->get_value().text == "ab");
+    CHECK(root->getChildAt(2)->get_value().text == "d");
+    CHECK(CopyCounted::copies == 0);
+
+    const CopyCounted e("e");
+    tree.add_sub_node(ab, e);  // an lvalue is still copied
+    CHECK(CopyCounted::copies == 1);
+    CHECK_THROWS_AS(tree.emplace_sub_node(root, "f"), std::out_of_range);
+    CHECK(CopyCounted::copies == 1);
+
+    SUBCASE("Moving a tree moves its nodes and observers without copying") {
+        Tree<CopyCounted, 3> moved(std::move(tree));
+        CHECK(moved.getRoot() == root);
+        CHECK(tree.getRoot() == nullptr);
+        moved.emplace_sub_node(ab, "g");
+        CHECK(sizes->of(root) == 6);
+
+        tree = std::move(moved);
+        CHECK(tree.getRoot() == root);
+        CHECK(moved.getRoot() == nullptr);
+        CHECK(CopyCounted::copies == 1);
+    }
+
+    SUBCASE("Values that cannot be copied") {
+        Tree<std::unique_ptr<int>, 2> owners;
+        owners.emplace_root(std::make_unique<int>(1));
+        owners.add_sub_node(owners.getRoot(), std::make_unique<int>(2));
+        owners.emplace_sub_node(owners.getRoot(), new int(3));
+        CHECK(*owners.getRoot()->getChildAt(0)->get_value() == 2);
+        CHECK(*owners.getRoot()->getChildAt(1)->get_value() == 3);
+    }
+}
+
+TEST_CASE("Tree - Deep clone and equality") {
+    Tree<int, 3> tree;
+    tree.add_root(1);
+    auto n2 = tree.add_sub_node(1, 2);
+    tree.add_sub_node(1, 3);
+    tree.add_sub_node(2, 5);
+    n2->addChildAt(std::make_shared<Node<int>>(9, 3), 2);  // leaves slot 1 of node 2 empty
+
+    auto copy = tree.clone();
+    CHECK(copy == tree);
+    CHECK(copy.getRoot() != tree.getRoot());
+    auto copy2 = copy.getRoot()->getChildAt(0);
+    CHECK(copy2->get_value() == 2);
+    CHECK(copy2->parent() == copy.getRoot());
+    CHECK(copy2->getOccupancy() == 0b101);
+    CHECK(copy2->getChildAt(2)->get_value() == 9);
+    std::vector<int> values;
+    for (auto it = copy.begin_bfs_scan(); it != copy.end_bfs_scan(); ++it) values.push_back(*it);
+    CHECK(values == std::vector<int>{1, 2, 3, 5, 9});
+
+    SUBCASE("The copy is independent of the original") {
+        copy.set_value(copy.find_node(5), 50);
+        CHECK_FALSE(copy == tree);
+        CHECK(tree.find_node(5) != nullptr);
+
+        auto other = tree.clone();
+        other.add_sub_node(9, 10);
+        CHECK_FALSE(other == tree);
+        other.remove_subtree(other.find_node(10));
+        CHECK(other == tree);
+    }
+
+    SUBCASE("Empty trees and shared versions") {
+        CHECK(Tree<int, 3>() == Tree<int, 3>());
+        CHECK_FALSE(tree == Tree<int, 3>());
+        CHECK(tree.clone() == tree);
+        CHECK(tree.with_value(5, 5) == tree);  // only the path to 5 is compared; the rest is shared
+        CHECK_FALSE(tree.with_value(5, 6) == tree);
+    }
 
+    SUBCASE("A node of the copy outlives the copy") {
+        auto nine = copy.find_node(9);
+        std::weak_ptr<Node<int>> watch = nine;
+        copy2.reset();
+        copy = Tree<int, 3>();
+        CHECK(nine->get_value() == 9);
+        CHECK(nine->parent() == nullptr);
+        nine.reset();
+        CHECK(watch.expired());
+    }
+}
+
+TEST_CASE("Tree - Merkle hashes and diff") {
+    Tree<int, 3> tree;
+    tree.add_root(1);
+    auto n2 = tree.add_sub_node(1, 2);
+    auto n3 = tree.add_sub_node(1, 3);
+    auto n5 = tree.add_sub_node(2, 5);
+    auto n6 = tree.add_sub_node(3, 6);
+    CHECK(tree.getRoot()->getCachedHash() == 0);  // nothing is hashed until it is asked for
+
+    auto copy = tree.clone();
+    std::uint64_t hash = tree.hash();
+    CHECK(hash != 0);
+    CHECK(copy.hash() == hash);
+    CHECK(Tree<int, 3>().hash() == 0);
+    CHECK(tree.diff(copy).empty());
+
+    SUBCASE("A change clears only the hashes on its path") {
+        tree.set_value(n5, 50);
+        CHECK(n5->getCachedHash() == 0);
+        CHECK(n2->getCachedHash() == 0);
+        CHECK(tree.getRoot()->getCachedHash() == 0);
+        CHECK(n3->getCachedHash() == n3->getSubtreeHash());  // the sibling subtree keeps its hash
+        CHECK(tree.hash() != hash);
+        CHECK_FALSE(tree == copy);
+
+        auto differences = tree.diff(copy);
+        REQUIRE(differences.size() == 1);
+        CHECK(differences[0].first == n5);
+        CHECK(differences[0].second->get_value() == 5);
+
+        tree.set_value(n5, 5);
+        CHECK(tree.hash() == hash);
+    }
+
+    SUBCASE("The hash depends on the shape") {
+        auto moved = tree.clone();
+        auto moved6 = moved.find_node(6);
+        auto detached = moved.detach(moved6);
+        moved.getRoot()->getChildAt(1)->addChildAt(detached.getRoot(), 2);  // the same values, another slot
+        CHECK(moved.hash() != hash);
+        CHECK_FALSE(moved == tree);
+
+        auto differences = tree.diff(moved);
+        REQUIRE(differences.size() == 2);
+        CHECK((differences[0].first == n6 && differences[0].second == nullptr));
+        CHECK((differences[1].first == nullptr && differences[1].second == moved6));
+
+        moved.remove_subtree(moved6);
+        moved.reattach(moved.find_node(3), Tree<int, 3>().with_root(6));
+        CHECK(moved.hash() == hash);
+    }
+
+    SUBCASE("Insertions, removals and heapify change the hash") {
+        auto leaf = tree.add_sub_node(n5, 7);
+        CHECK(tree.hash() != hash);
+        auto differences = copy.diff(tree);
+        REQUIRE(differences.size() == 1);
+        CHECK((differences[0].first == nullptr && differences[0].second == leaf));
+        tree.remove_subtree(leaf);
+        CHECK(tree.hash() == hash);
+
+        tree.set_value(tree.getRoot(), 9);
+        std::uint64_t before = tree.hash();
+        tree.heapify(tree.getRoot());
+        CHECK(tree.getRoot()->get_value() == 2);
+        CHECK(tree.hash() != before);
+        CHECK(tree.hash() == tree.clone().hash());
+    }
+
+    SUBCASE("Persistent versions share the hashes of the subtrees they share") {
+        auto version = tree.with_value(6, 60);
+        CHECK(version.getRoot()->getCachedHash() == 0);
+        CHECK(version.getRoot()->getChildAt(0)->getCachedHash() == n2->getCachedHash());
+        CHECK(version.hash() != hash);
+        CHECK(tree.hash() == hash);  // the original kept its hashes
+
+        auto differences = tree.diff(version);
+        REQUIRE(differences.size() == 1);
+        CHECK(differences[0].first == n6);
+        CHECK(differences[0].second->get_value() == 60);
+        CHECK(version.with_value(60, 6).hash() == hash);
+    }
+
+    SUBCASE("Complex values and unhashable values") {
+        Tree<Complex, 2> complex;
+        complex.add_root(Complex(1, 2));
+        complex.add_sub_node(Complex(1, 2), Complex(3, 4));
+        auto other = complex.clone();
+        CHECK(other.hash() == complex.hash());
+        other.set_value(other.find_node(Complex(3, 4)), Complex(3, -4));
+        CHECK(other.hash() != complex.hash());
+        CHECK(complex.diff(other).size() == 1);
+
+        struct Unhashable {
+            int id;
+            bool operator==(const Unhashable&) const = default;
+        };
+        Tree<Unhashable, 2> plain;
+        plain.add_root(Unhashable{1});
+        auto changed = plain.clone();
+        changed.set_value(changed.getRoot(), Unhashable{2});
+        CHECK(plain.diff(plain.clone()).empty());  // compared value by value
+        CHECK(plain.diff(changed).size() == 1);
+    }
+}
+
+TEST_CASE("Tree - Diff and patch") {
+    Tree<int, 3> tree;
+    tree.add_root(1);
+    tree.add_sub_node(1, 2);
+    tree.add_sub_node(1, 3);
+    tree.add_sub_node(1, 4);
+    tree.add_sub_node(2, 5);
+
+    auto target = tree.clone();
+    target.set_value(target.find_node(5), 50);
+    target.getRoot()->takeChildAt(1);  // removes 3 and leaves 4 in slot 2
+    target.add_sub_node(50, 6);
+    target.add_sub_node(6, 7);
+
+    auto patch = diff(tree, target);
+    using EditKind = TreePatch<int>::EditKind;
+    REQUIRE(patch.edits.size() == 3);
+    CHECK(patch.base_hash == tree.hash());
+    CHECK((patch.edits[0].kind == EditKind::Change && patch.edits[0].values == std::vector<int>{50}));  // in pre-order
+    CHECK((patch.edits[1].kind == EditKind::Insert && patch.edits[1].path == std::vector<std::uint8_t>{0, 0, 0}));
+    CHECK(patch.edits[1].values == std::vector<int>{6, 7});
+    CHECK((patch.edits[2].kind == EditKind::Remove && patch.edits[2].path == std::vector<std::uint8_t>{1}));
+    CHECK(diff(tree, tree.clone()).empty());
+
+    SUBCASE("Applying the patch, also after writing and reading it") {
+        auto replica = tree.clone();
+        auto sizes = replica.add_aggregate(SubtreeSize<int>());
+        replica.apply(patch);
+        CHECK(replica == target);
+        CHECK(replica.getRoot()->getChildAt(2)->get_value() == 4);  // the other children stay in their slots
+        CHECK(sizes->of(replica.getRoot()) == 6);
+
+        std::stringstream stream;
+        patch.write(stream);
+        CHECK(stream.str().size() < 64);
+        auto read = TreePatch<int>::read(stream);
+        auto other = tree.clone();
+        other.apply(read);
+        CHECK(other == target);
+        CHECK(other.hash() == target.hash());
+    }
+
+    SUBCASE("Empty trees and persistent versions") {
+        Tree<int, 3> empty;
+        empty.apply(diff(empty, tree));
+        CHECK(empty == tree);
+        empty.apply(diff(empty, Tree<int, 3>()));
+        CHECK(empty.getRoot() == nullptr);
+
+        auto version = tree.with_value(5, 55);
+        auto small = diff(tree, version);
+        REQUIRE(small.edits.size() == 1);
+        auto replica = tree.clone();
+        replica.apply(small);
+        CHECK(replica == version);
+    }
+
+    SUBCASE("A patch for another tree or a damaged patch is rejected") {
+        CHECK_THROWS_AS(target.apply(patch), std::invalid_argument);
+        TreePatch<int> unchecked = patch;
+        unchecked.base_hash = 0;
+        unchecked.edits[2].path = {0, 2};  // an empty slot
+        auto replica = tree.clone();
+        CHECK_THROWS_AS(replica.apply(unchecked), std::invalid_argument);
+
+        std::stringstream stream;
+        patch.write(stream);
+        std::string bytes = stream.str();
+        std::stringstream truncated(bytes.substr(0, bytes.size() - 2));
+        CHECK_THROWS_AS(TreePatch<int>::read(truncated), std::invalid_argument);
+        std::stringstream garbage("not a patch");
+        CHECK_THROWS_AS(TreePatch<int>::read(garbage), std::invalid_argument);
+    }
+}
+
+TEST_CASE("TreeLog - Write-ahead log and recovery") {
+    using Log = TreeLog<int, 3>;
+    auto directory = std::filesystem::temp_directory_path();
+    std::string snapshot = (directory / "tree_log_test.snapshot").string();
+    std::string log_path = (directory / "tree_log_test.log").string();
+
+    Tree<int, 3> tree;
+    tree.add_root(1);
+    tree.add_sub_node(1, 2);
+    auto log = Log::attach(tree, snapshot, log_path, TreeLogOptions{64, size_t{1} << 20});
+    tree.add_sub_node(1, 3);
+    tree.add_sub_node(1, 4);
+    tree.add_sub_node(2, 5);
+    tree.set_value(tree.find_node(3), 30);
+    tree.remove_subtree(tree.find_node(2));  // 30 and 4 move one slot to the left
+    auto replica = tree.clone();
+    replica.set_value(replica.find_node(4), 40);
+    replica.add_sub_node(40, 6);
+    tree.apply(diff(tree, replica));  // an update and an insert
+    auto moved = tree.detach(tree.find_node(30));
+    tree.reattach(tree.find_node(6), std::move(moved));
+    for (auto it = tree.myHeap(); it != tree.end_heap(); ++it) {}  // the swaps are value updates
+    log->commit();
+
+    SUBCASE("Recovering the snapshot and the log") {
+        auto recovered = Log::recover(snapshot, log_path);
+        CHECK(recovered == tree);
+        CHECK(recovered.hash() == tree.hash());
+        CHECK(log->syncs() >= 3);  // the snapshot, the new log and the commit
+        CHECK(log->bytes_written() < 200);
+        auto contents = [](const std::string& path) {
+            std::ifstream file(path, std::ios::binary);
+            return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        };
+        CHECK(Log::replay(contents(snapshot), contents(log_path)) == tree);
+        size_t nodes = 0;
+        for (auto it = tree.begin_bfs_scan(); it != tree.end_bfs_scan(); ++it) ++nodes;
+        Tree<int, 3>::reset_stats();
+        Log::replay(contents(snapshot), contents(log_path));
+        CHECK(Tree<int, 3>::stats().node_allocations >= nodes);  // the replayed nodes come from NodePool
+        CHECK(Log::replay(contents(snapshot), "") == Log::recover(snapshot, log_path + ".missing"));
+        CHECK_THROWS_AS(Log::replay("not a snapshot", ""), std::invalid_argument);
+    }
+
+    SUBCASE("A torn last frame is dropped") {
+        tree.add_sub_node(tree.getRoot(), 7);
+        log->commit();
+        std::filesystem::resize_file(log_path, std::filesystem::file_size(log_path) - 1);
+        auto recovered = Log::recover(snapshot, log_path);
+        CHECK(recovered.find_node(7) == nullptr);
+        tree.remove_subtree(tree.find_node(7));
+        CHECK(recovered == tree);
+    }
+
+    SUBCASE("A checkpoint starts a new log; uncommitted records are lost") {
+        log->checkpoint(tree);
+        CHECK(std::filesystem::file_size(log_path) == 16);
+        CHECK(Log::recover(snapshot, log_path) == tree);
+        tree.add_sub_node(tree.getRoot(), 8);
+        auto before = tree.clone();
+        tree.set_value(tree.find_node(8), 80);
+        log->commit();
+        auto replica_log = Log::recover(snapshot, log_path);
+        CHECK(replica_log == tree);
+        CHECK(!(replica_log == before));
+
+        tree.add_root(9);
+        CHECK(Log::recover(snapshot, log_path) == replica_log);  // not committed yet
+        tree.remove_subtree(tree.getRoot());
+        log->commit();
+        CHECK(Log::recover(snapshot, log_path).getRoot() == nullptr);
+    }
+
+    SUBCASE("A checkpoint of a tree larger than a group") {
+        tree.add_root(100);
+        std::vector<std::shared_ptr<Node<int>>> nodes{tree.getRoot()};
+        for (int i = 1; i < 200; ++i) nodes.push_back(tree.add_sub_node(nodes[(i - 1) / 3], 100 + i));
+        log->checkpoint(tree);  // the snapshot records pass group_bytes (64) many times
+        log->commit();
+        CHECK(std::filesystem::file_size(snapshot) > 200);
+        CHECK(Log::recover(snapshot, log_path) == tree);
+    }
+
+    SUBCASE("A missing log recovers the snapshot; a damaged snapshot is rejected") {
+        auto recovered = Log::recover(snapshot, log_path + ".missing");
+        REQUIRE(recovered.getRoot() != nullptr);
+        CHECK(recovered.getRoot()->getNumOfChildren() == 1);
+        CHECK(recovered.find_node(2) != nullptr);
+
+        std::filesystem::resize_file(snapshot, std::filesystem::file_size(snapshot) - 1);
+        CHECK_THROWS_AS(Log::recover(snapshot, log_path), std::invalid_argument);
+    }
+
+    tree.remove_observer(log);
+    log.reset();
+    std::filesystem::remove(snapshot);
+    std::filesystem::remove(log_path);
+    CHECK_THROWS_AS(Log::recover(snapshot, log_path), std::system_error);
+}
+
+TEST_CASE("TreeCodec - Compact serialization") {
+    using Codec = TreeCodec<int, 3>;
+    using Narrow = TreeCodec<int, 2>;
+    Tree<int, 3> tree;
+    tree.add_root(10);
+    std::vector<std::shared_ptr<Node<int>>> nodes{tree.getRoot()};
+    for (int i = 1; i < 1000; ++i) nodes.push_back(tree.add_sub_node(nodes[(i - 1) / 3], 10 + i));
+
+    std::stringstream stream;
+    Codec::write(stream, tree);
+    std::ostringstream text;
+    text << tree;
+    CHECK(stream.str().size() < 1000 + 2 * 1000 / 8 + 16);  // one byte per value delta and 2 bits per node
+    CHECK(stream.str().size() * 5 < text.str().size());
+    Tree<int, 3>::reset_stats();
+    auto read = Codec::read(stream);
+    CHECK(read == tree);
+    CHECK(Tree<int, 3>::stats().node_allocations == 1000);  // the nodes come from NodePool
+
+    SUBCASE("Children with gaps, negative deltas and empty trees") {
+        tree.getRoot()->takeChildAt(1);  // leaves slot 1 empty
+        tree.set_value(nodes[3], -1000000);
+        nodes[4]->takeChildAt(0);
+        std::stringstream gapped;
+        Codec::write(gapped, tree);
+        auto copy = Codec::read(gapped);
+        CHECK(copy == tree);
+        CHECK(copy.getRoot()->getChildAt(1) == nullptr);
+        CHECK(copy.getRoot()->getChildAt(2)->get_value() == -1000000);
+
+        std::stringstream empty;
+        Codec::write(empty, Tree<int, 3>());
+        CHECK(Codec::read(empty).getRoot() == nullptr);
+    }
+
+    SUBCASE("Values stored as their bytes") {
+        Tree<Complex, 2> complex;
+        complex.add_root(Complex(1.5, -2));
+        complex.add_sub_node(Complex(1.5, -2), Complex(0, 1));
+        complex.add_sub_node(Complex(1.5, -2), Complex(3, 4));
+        std::stringstream bytes;
+        TreeCodec<Complex, 2>::write(bytes, complex);
+        CHECK(TreeCodec<Complex, 2>::read(bytes) == complex);
+    }
+
+    SUBCASE("Damaged input is rejected") {
+        std::string bytes = stream.str();
+        std::stringstream truncated(bytes.substr(0, bytes.size() - 1));
+        CHECK_THROWS_AS(Codec::read(truncated), std::invalid_argument);
+        std::stringstream garbage("not a tree");
+        CHECK_THROWS_AS(Codec::read(garbage), std::invalid_argument);
+        std::stringstream narrow(bytes);
+        CHECK_THROWS_AS(Narrow::read(narrow), std::invalid_argument);  // the nodes have 3 children
+    }
+}
+
+TEST_CASE("TreeWriter - Buffered text layouts") {
+    using Writer = TreeWriter<int, 3>;
+    Tree<int, 3> tree;
+    tree.add_root(1);
+    tree.add_sub_node(1, 2);
+    tree.add_sub_node(1, 3);
+    tree.add_sub_node(2, 4);
+    tree.add_sub_node(3, -5);
+    tree.add_sub_node(3, 6);
+
+    std::ostringstream adjacency, indented, parents, streamed;
+    Writer::write(adjacency, tree);
+    Writer::write(indented, tree, TreeLayout::Indented);
+    Writer::write(parents, tree, TreeLayout::ParentArray);
+    streamed << tree;
+    CHECK(adjacency.str() == streamed.str());
+    CHECK(adjacency.str() == "1: 2 3 \n2: 4 \n3: -5 6 \n4: \n-5: \n6: \n");
+    CHECK(indented.str() == "1\n  2\n    4\n  3\n    -5\n    6\n");
+    CHECK(parents.str() == "-1 1\n0 2\n0 3\n1 4\n2 -5\n2 6\n");
+
+    SUBCASE("Empty trees write nothing") {
+        std::ostringstream empty;
+        Writer::write(empty, Tree<int, 3>(), TreeLayout::ParentArray);
+        CHECK(empty.str().empty());
+    }
+
+    SUBCASE("Complex and string values") {
+        Tree<Complex, 2> complex;
+        complex.add_root(Complex(1.5, -2));
+        complex.add_sub_node(Complex(1.5, -2), Complex(0.1, 3));
+        std::ostringstream out;
+        TreeWriter<Complex, 2>::write(out, complex);
+        CHECK(out.str() == "(1.5 + -2i): (0.1 + 3i) \n(0.1 + 3i): \n");
+
+        Tree<std::string, 2> words;
+        words.add_root("a");
+        words.add_sub_node(std::string("a"), std::string("b"));
+        std::ostringstream text;
+        TreeWriter<std::string, 2>::write(text, words, TreeLayout::Indented);
+        CHECK(text.str() == "a\n  b\n");
+    }
+
+    SUBCASE("Output larger than the buffer") {
+        Tree<int, 2> large;
+        large.add_root(0);
+        std::vector<std::shared_ptr<Node<int>>> nodes{large.getRoot()};
+        for (int i = 1; i < 200000; ++i) nodes.push_back(large.add_sub_node(nodes[(i - 1) / 2], 1000000 + i));
+        std::ostringstream out, expected;
+        TreeWriter<int, 2>::write(out, large);
+        expected << large;
+        CHECK(out.str().size() > (size_t{1} << 20));
+        CHECK(out.str() == expected.str());
+
+        Tree<int, 2> chain;  // the indentation alone fills the buffer
+        chain.add_root(0);
+        auto last = chain.getRoot();
+        for (int i = 1; i < 1200; ++i) last = chain.add_sub_node(last, i);
+        std::ostringstream deep;
+        TreeWriter<int, 2>::write(deep, chain, TreeLayout::Indented);
+        CHECK(deep.str().size() == 1199 * 1200 + 1200 + 10 + 90 * 2 + 900 * 3 + 200 * 4);
+        CHECK(deep.str().ends_with(std::string(2 * 1199, ' ') + "1199\n"));
+    }
+}
+
+TEST_CASE("TreeReader - Parsing the text layouts") {
+    using Reader = TreeReader<int, 3>;
+    Tree<int, 3> tree;
+    tree.add_root(1);
+    tree.add_sub_node(1, 2);
+    tree.add_sub_node(1, 2);  // duplicate values are matched by position
+    tree.add_sub_node(tree.getRoot()->getChildAt(1), -5);
+    tree.add_sub_node(tree.getRoot()->getChildAt(1), 6);
+    tree.add_sub_node(6, 7);
+
+    std::ostringstream streamed;
+    streamed << tree;
+    std::istringstream adjacency(streamed.str());
+    CHECK(Reader::read(adjacency) == tree);
+    for (TreeLayout layout : {TreeLayout::Adjacency, TreeLayout::Indented, TreeLayout::ParentArray}) {
+        std::stringstream text;
+        TreeWriter<int, 3>::write(text, tree, layout);
+        CHECK(Reader::read(text, layout) == tree);
+    }
+    std::istringstream parents("-1 1\n0 2\n0 2\n2 -5\n2 6\n4 7");  // no line break at the end
+    Tree<int, 3>::reset_stats();
+    CHECK(Reader::read(parents, TreeLayout::ParentArray) == tree);
+    CHECK(Tree<int, 3>::stats().node_allocations == 6);  // the nodes come from NodePool
+
+    SUBCASE("Empty trees") {
+        std::ostringstream text;
+        text << Tree<int, 3>();
+        std::istringstream empty(text.str()), nothing("");
+        CHECK(Reader::read(empty).getRoot() == nullptr);
+        CHECK(Reader::read(nothing, TreeLayout::Indented).getRoot() == nullptr);
+    }
+
+    SUBCASE("Complex and string values") {
+        Tree<Complex, 2> complex;
+        complex.add_root(Complex(1.5, -2));
+        complex.add_sub_node(Complex(1.5, -2), Complex(0.1, 3));
+        complex.add_sub_node(Complex(1.5, -2), Complex(-4, 0.25));
+        std::ostringstream text;
+        text << complex;
+        std::istringstream in(text.str());
+        CHECK(TreeReader<Complex, 2>::read(in) == complex);
+
+        Tree<std::string, 2> words;
+        words.add_root("a");
+        words.add_sub_node(std::string("a"), std::string("b"));
+        std::stringstream out;
+        out << words;
+        CHECK(TreeReader<std::string, 2>::read(out) == words);
+    }
+
+    SUBCASE("Malformed text is rejected") {
+        auto rejects = [](const std::string& text, TreeLayout layout) {
+            std::istringstream in(text);
+            try {
+                Reader::read(in, layout);
+            } catch (const std::invalid_argument&) {
+                return true;
+            }
+            return false;
+        };
+        bool rejected = rejects("1: 2 \n3: \n", TreeLayout::Adjacency) &&  // not the queued node
+                        rejects("1: 2 \n", TreeLayout::Adjacency) &&  // a node without its line
+                        rejects("1: 2 3 4 5 \n", TreeLayout::Adjacency) &&  // more than k children
+                        rejects("1: x \n", TreeLayout::Adjacency) &&
+                        rejects("1\n    2\n", TreeLayout::Indented) &&
+                        rejects("1\n2\n", TreeLayout::Indented) &&
+                        rejects("0 1\n", TreeLayout::ParentArray) &&
+                        rejects("-1 1\n1 2\n", TreeLayout::ParentArray);
+        CHECK(rejected);
+    }
+
+    SUBCASE("Large inputs from a stream and from a file") {
+        using Binary = TreeReader<int, 2>;
+        Tree<int, 2> large;
+        large.add_root(0);
+        std::vector<std::shared_ptr<Node<int>>> nodes{large.getRoot()};
+        for (int i = 1; i < 200000; ++i) nodes.push_back(large.add_sub_node(nodes[(i - 1) / 2], i % 100));
+        std::stringstream text;
+        TreeWriter<int, 2>::write(text, large);
+        CHECK(text.str().size() > (size_t{1} << 20));  // more than one chunk
+        CHECK(Binary::read(text) == large);
+
+        auto path = (std::filesystem::temp_directory_path() / "tree_reader_test.txt").string();
+        {
+            std::ofstream file(path);
+            TreeWriter<int, 2>::write(file, large, TreeLayout::ParentArray);
+        }
+        CHECK(Binary::read_file(path, TreeLayout::ParentArray) == large);
+        CHECK(Binary::read_file(path, TreeLayout::ParentArray, 10000) == large);  // many small windows
+        std::filesystem::remove(path);
+        CHECK_THROWS_AS(Binary::read_file(path), std::system_error);
+    }
+}
+
+TEST_CASE("SuccinctTree - LOUDS navigation and iterators") {
+    Tree<int, 3> tree;
+    tree.add_root(1);
+    tree.add_sub_node(1, 2);
+    tree.add_sub_node(1, 3);
+    tree.add_sub_node(1, 4);
+    tree.add_sub_node(2, 5);
+    tree.add_sub_node(4, 6);
+    tree.add_sub_node(4, 7);
+    tree.add_sub_node(7, 8);
+
+    SuccinctTree<int> succinct(tree);
+    REQUIRE(succinct.size() == 8);
+    CHECK(succinct.value(succinct.root()) == 1);
+    CHECK(succinct.degree(0) == 3);
+    size_t third = succinct.child(0, 2);
+    CHECK(succinct.value(third) == 4);
+    CHECK(succinct.child(0, 3) == SuccinctTree<int>::npos);
+    CHECK(succinct.value(succinct.child(third, 1)) == 7);
+    CHECK(succinct.parent(succinct.child(third, 1)) == third);
+    CHECK(succinct.parent(0) == SuccinctTree<int>::npos);
+    CHECK(succinct.value(succinct.next_sibling(succinct.first_child(0))) == 3);
+    CHECK(succinct.prev_sibling(succinct.first_child(0)) == SuccinctTree<int>::npos);
+    CHECK(succinct.next_sibling(third) == SuccinctTree<int>::npos);
+    CHECK(succinct.first_child(succinct.child(0, 1)) == SuccinctTree<int>::npos);  // 3 is a leaf
+
+    std::vector<int> bfs, dfs, expected_bfs, expected_dfs;
+    for (auto it = succinct.begin_bfs_scan(); it != succinct.end_bfs_scan(); ++it) bfs.push_back(*it);
+    for (auto it = succinct.begin_dfs_scan(); it != succinct.end_dfs_scan(); ++it) dfs.push_back(*it);
+    for (auto it = tree.begin_bfs_scan(); it != tree.end_bfs_scan(); ++it) expected_bfs.push_back(*it);
+    for (auto it = tree.begin_dfs_scan(); it != tree.end_dfs_scan(); ++it) expected_dfs.push_back(*it);
+    CHECK(bfs == expected_bfs);
+    CHECK(dfs == expected_dfs);
+
+    SUBCASE("A large tree in about 2 bits per node") {
+        Tree<int, 2> large;
+        large.add_root(0);
+        std::vector<std::shared_ptr<Node<int>>> nodes{large.getRoot()};
+        for (int i = 1; i < 100000; ++i) nodes.push_back(large.add_sub_node(nodes[(i - 1) / 2], i));
+        SuccinctTree<int> compact(large);
+        CHECK(compact.topology_bits() < 100000 * 9 / 4);  // 2n + 1 bits and about 5% for rank and select
+        CHECK(compact.memory_bytes() < 100000 * (sizeof(int) + 1));
+        bool parents_match = true;
+        for (size_t v = 1; v < compact.size(); ++v) {
+            parents_match = parents_match && compact.value(compact.parent(v)) == (compact.value(v) - 1) / 2;
+        }
+        CHECK(parents_match);
+        size_t count = 0;
+        for (auto it = compact.begin_dfs_scan(); it != compact.end_dfs_scan(); ++it) ++count;
+        CHECK(count == 100000);
+    }
+
+    SUBCASE("Empty trees") {
+        SuccinctTree<int> empty{Tree<int, 2>()};
+        CHECK(empty.empty());
+        CHECK(empty.root() == SuccinctTree<int>::npos);
+        CHECK(empty.begin_bfs_scan() == empty.end_bfs_scan());
+        CHECK(empty.begin_dfs_scan() == empty.end_dfs_scan());
+    }
+}
+
+TEST_CASE("RankSelectBits - Rank and select match a scan") {
+    std::mt19937 rng(5);
+    for (size_t size : {size_t{1}, size_t{64}, size_t{513}, size_t{100000}}) {
+        std::vector<std::uint64_t> words((size + 63) / 64);
+        std::vector<bool> plain(size);
+        for (size_t i = 0; i < size; ++i) {
+            plain[i] = (i / 5000) % 3 == 0 ? rng() % 8 == 0 : rng() % 2 == 0;  // sparse and dense stretches
+            if (plain[i]) words[i / 64] |= std::uint64_t{1} << (i % 64);
+        }
+        RankSelectBits bits(words, size);
+        bool match = true;
+        size_t ones = 0;
+        for (size_t i = 0; i < size; ++i) {
+            match = match && bits.rank1(i) == ones && bits[i] == plain[i];
+            if (plain[i]) match = match && bits.select1(ones) == i;
+            else match = match && bits.select0(i - ones) == i;
+            ones += plain[i];
+        }
+        CHECK(match);
+        CHECK(bits.rank1(size) == ones);
+        CHECK_THROWS_AS(bits.select1(ones), std::out_of_range);
+    }
+}
+
+TEST_CASE("Tree - Removing, detaching and reattaching subtrees") {
+    Tree<int, 2> tree;
+    tree.add_root(1);
+    auto n2 = tree.add_sub_node(1, 2);
+    auto n3 = tree.add_sub_node(1, 3);
+    auto n4 = tree.add_sub_node(2, 4);
+    tree.add_sub_node(2, 5);
+    auto n6 = tree.add_sub_node(3, 6);
+    auto sizes = tree.add_aggregate<SubtreeSize<int>>();
+    auto root = tree.getRoot();
+
+    SUBCASE("remove_subtree unlinks the nodes and packs the remaining children") {
+        tree.remove_subtree(n2);
+        CHECK(root->getChildAt(0) == n3);
+        CHECK(root->getChildAt(1) == nullptr);
+        CHECK(n3->getIndexInParent() == 0);
+        CHECK(sizes->of(root) == 3);
+        CHECK(tree.find_node(4) == nullptr);
+        CHECK(n2->parent() == nullptr);
+        CHECK(n2->getNumOfChildren() == 0);
+        CHECK(n4->parent() == nullptr);
+
+        // The free slot is the one after the remaining child
+        auto n7 = tree.add_sub_node(root, 7);
+        CHECK(root->getChildAt(1) == n7);
+        CHECK(sizes->of(root) == 4);
+    }
+
+    SUBCASE("The memory of removed nodes is reused") {
+        std::weak_ptr<Node<int>> watch = n4;
+        n2.reset();
+        n4.reset();
+        tree.remove_subtree(tree.find_node(2));
+        CHECK(watch.expired());
+
+        Tree<int, 2>::reset_stats();
+        tree.add_sub_node(1, 8);
+        tree.add_sub_node(8, 9);
+#ifndef NODE_POOL_DISABLED
+        CHECK(Tree<int, 2>::stats().pool_reuses == 2);
+#endif
+        CHECK(sizes->of(root) == 5);
+    }
+
+    SUBCASE("detach and reattach move a subtree") {
+        auto detached = tree.detach(n3);
+        CHECK(detached.getRoot() == n3);
+        CHECK(n3->parent() == nullptr);
+        CHECK(n3->getChildAt(0) == n6);
+        CHECK(root->getChildAt(1) == nullptr);
+        CHECK(sizes->of(root) == 4);
+
+        CHECK(tree.reattach(n4, std::move(detached)) == n3);
+        CHECK(detached.getRoot() == nullptr);
+        CHECK(n3->parent() == n4);
+        CHECK(tree.find_node(6) == n6);
+        CHECK(sizes->of(root) == 6);
+        CHECK(sizes->of(n2) == 5);
+    }
+
+    SUBCASE("Detaching the root empties the tree") {
+        auto detached = tree.detach(root);
+        CHECK(tree.getRoot() == nullptr);
+        CHECK(detached.getRoot() == root);
+        CHECK(detached.find_node(6) == n6);
+    }
+
+    SUBCASE("Invalid handles and trees are rejected") {
+        Tree<int, 2> other;
+        other.add_root(10);
+        CHECK_THROWS_AS(tree.detach(other.getRoot()), std::invalid_argument);
+        CHECK_THROWS_AS(tree.remove_subtree(nullptr), std::invalid_argument);
+        CHECK_THROWS_AS(tree.reattach(n6, Tree<int, 2>(n3)), std::invalid_argument);
+        CHECK_THROWS_AS(tree.reattach(n6, Tree<int, 2>()), std::invalid_argument);
+        CHECK_THROWS_AS(tree.reattach(n2, std::move(other)), std::out_of_range);
+        CHECK(other.getRoot() != nullptr);
+        CHECK(sizes->of(root) == 6);
+    }
+}
+
+TEST_CASE("BTree - Ordered set of values") {
+    SUBCASE("In-order iteration is sorted for any fanout") {
+        std::mt19937 rng(3);
+        auto check_fanout = [&rng](auto tree) {
+            std::set<int> reference;
+            bool results_match = true;
+            for (int i = 0; i < 3000; ++i) {
+                int value = static_cast<int>(rng() % 2000);
+                results_match = results_match && tree.insert(value) == reference.insert(value).second;
+            }
+            CHECK(tree.size() == reference.size());
+            CHECK(std::vector<int>(tree.begin(), tree.end()) == std::vector<int>(reference.begin(), reference.end()));
+
+            for (int i = 0; i < 3000; ++i) {
+                int value = static_cast<int>(rng() % 2000);
+                results_match = results_match && tree.erase(value) == (reference.erase(value) == 1);
+            }
+            CHECK(results_match);
+            CHECK(tree.size() == reference.size());
+            CHECK(std::vector<int>(tree.begin(), tree.end()) == std::vector<int>(reference.begin(), reference.end()));
+        };
+        check_fanout(BTree<int, 3>());
+        check_fanout(BTree<int, 4>());
+        check_fanout(BTree<int, 5>());
+        check_fanout(BTree<int, 64>());
+    }
+
+    SUBCASE("lower_bound and find") {
+        BTree<int, 4> tree;
+        for (int i = 0; i < 100; i += 2) tree.insert(i);
+        CHECK(*tree.lower_bound(10) == 10);
+        CHECK(*tree.lower_bound(11) == 12);
+        CHECK(*tree.lower_bound(-5) == 0);
+        CHECK(tree.lower_bound(99) == tree.end_in_order());
+        CHECK(tree.find(42) != tree.end_in_order());
+        CHECK(tree.find(43) == tree.end_in_order());
+        CHECK(tree.contains(98));
+        CHECK_FALSE(tree.contains(1));
+
+        std::vector<int> tail;
+        for (auto it = tree.lower_bound(91); it != tree.end_in_order(); ++it) tail.push_back(*it);
+        CHECK(tail == std::vector<int>{92, 94, 96, 98});
+    }
+
+    SUBCASE("The height is logarithmic in the fanout") {
+        BTree<int, 16> tree;
+        CHECK(tree.height() == 0);
+        for (int i = 0; i < 100000; ++i) tree.insert(i);  // ascending inserts split the rightmost leaf every time
+        CHECK(tree.height() <= 6);  // log base 8 of 100000 is about 5.5
+        for (int i = 0; i < 100000; ++i) tree.erase(i);
+        CHECK(tree.empty());
+        CHECK(tree.height() == 0);
+        CHECK(tree.begin_in_order() == tree.end_in_order());
+    }
+
+    SUBCASE("Complex values are ordered by magnitude") {
+        BTree<Complex, 3> tree;
+        CHECK(tree.insert(Complex(3, 4)));
+        CHECK(tree.insert(Complex(1, 0)));
+        CHECK(tree.insert(Complex(0, 2)));
+        CHECK_FALSE(tree.insert(Complex(5, 0)));  // the same magnitude as 3 + 4i
+        std::vector<Complex> sorted(tree.begin(), tree.end());
+        CHECK(sorted == std::vector<Complex>{Complex(1, 0), Complex(0, 2), Complex(3, 4)});
+    }
+}
+
+TEST_CASE("BTree - Range queries") {
+    auto collect_range = [](const auto& tree, const auto& lo, const auto& hi) {
+        std::vector<std::decay_t<decltype(lo)>> result;
+        for (auto it = tree.range(lo, hi); it != tree.end_range(); ++it) result.push_back(*it);
+        return result;
+    };
+
+    SUBCASE("int") {
+        BTree<int, 5> tree;
+        for (int i = 0; i < 1000; i += 3) tree.insert(i);
+        CHECK(collect_range(tree, 10, 20) == std::vector<int>{12, 15, 18});
+        CHECK(collect_range(tree, 12, 18) == std::vector<int>{12, 15, 18});  // both ends are included
+        CHECK(collect_range(tree, 13, 14).empty());
+        CHECK(collect_range(tree, 20, 10).empty());
+        CHECK(collect_range(tree, -100, 3) == std::vector<int>{0, 3});
+        CHECK(collect_range(tree, 995, 5000) == std::vector<int>{996, 999});
+        CHECK(collect_range(tree, -1000, 5000).size() == tree.size());
+        CHECK(collect_range(BTree<int, 5>(), 0, 10).empty());
+    }
+
+    SUBCASE("double") {
+        BTree<double, 4> tree;
+        for (double value : {0.5, -1.25, 3.0, 2.75, 1e9, -1e-9}) tree.insert(value);
+        CHECK(collect_range(tree, -1.0, 2.75) == std::vector<double>{-1e-9, 0.5, 2.75});
+    }
+
+    SUBCASE("Complex by magnitude") {
+        BTree<Complex, 3> tree;
+        for (int i = 1; i <= 20; ++i) tree.insert(Complex(i, i));  // magnitude i * sqrt(2)
+        auto values = collect_range(tree, Complex(4, 0), Complex(0, 8));  // magnitudes 4 to 8
+        CHECK(values == std::vector<Complex>{Complex(3, 3), Complex(4, 4), Complex(5, 5)});
+    }
+}
@@ -3,12 +3,20 @@
 #ifndef TREE_HPP
 #define TREE_HPP
 
+#include <algorithm>
+#include <bit>
 #include <iostream>
+#include <utility>
 #include <vector>
 #include <queue>
 #include <stack>
 #include <memory>
 #include "Node.hpp"
+#include "NodePool.hpp"
+#include "TreeStats.hpp"
+#include "TreeObserver.hpp"
+#include "SubtreeAggregate.hpp"
+#include "TreePatch.hpp"
 
 
 // * all the implementation are in the tree.hpp file
@@ -19,14 +27,18 @@
  * @brief A generic k-ary tree class.
  *
  * @tparam T The type of the values stored in the nodes.
- * @tparam k The maximum number of children each node can have. Defaults to 2 (binary tree).
+ * @tparam k The maximum number of children each node can have (at most 64). Defaults to 2 (binary tree).
  */
 
 template<typename T, int k = 2>
 class Tree {
+    static_assert(k >= 1 && k <= static_cast<int>(Node<T>::max_children), "k must be between 1 and 64");
+
 private:
     std::shared_ptr<Node<T>> root;  ///< Pointer to the root node.
     int k_ary;  ///< Maximum number of children per node.
+    std::vector<std::shared_ptr<TreeObserver<T>>> observers;  ///< Notified after every mutation.
+    std::shared_ptr<SubtreeAggregate<T, SubtreeBounds<T>>> search_bounds;  ///< Subtree bounds used by find, if enabled.
 
 public:
     /**
@@ -34,6 +46,36 @@ public:
     */
     Tree() : root(nullptr), k_ary(k) {}
 
+    /**
+    * @brief Constructs a tree around an existing root node.
+    *
+    * The nodes are shared, not copied, so the new tree sees the same structure as the tree the root came from.
+    *
+    * @param root The root node of the tree.
+    */
+    explicit Tree(std::shared_ptr<Node<T>> root) : root(std::move(root)), k_ary(k) {}
+
+    /**
+    * @brief Makes a tree that shares the nodes of another tree (the nodes are not copied).
+    *
+    * The observers, the aggregates and the bounds of enable_pruned_find are not carried over, so mutating
+    * the copy leaves the ones of the other tree alone. Use clone() for a copy that shares no nodes either.
+    */
+    Tree(const Tree& other) : root(other.root), k_ary(other.k_ary) {}
+    Tree& operator=(const Tree& other) {
+        if (this == &other) return *this;
+        root = other.root;
+        observers.clear();
+        search_bounds.reset();
+        return *this;
+    }
+
+    /**
+    * @brief Takes the nodes and the observers of another tree in O(1); the other tree becomes empty.
+    */
+    Tree(Tree&&) noexcept = default;
+    Tree& operator=(Tree&&) noexcept = default;
+
     /**
     * @brief Destructor that resets the root.
     */
@@ -65,7 +107,29 @@ public:
      * @param key The value of the root node.
      */
     void add_root(const T& key) {
-        root = std::make_shared<Node<T>>(key, k);
+        emplace_root(key);
+    }
+
+    /**
+     * @brief Adds a root node to the tree, moving the value into it.
+     *
+     * @param key The value of the root node.
+     */
+    void add_root(T&& key) {
+        emplace_root(std::move(key));
+    }
+
+    /**
+     * @brief Adds a root node whose value is constructed in place from the arguments.
+     *
+     * @param args The arguments of a constructor of T.
+     * @return A shared pointer to the new root.
+     */
+    template<typename... Args>
+    std::shared_ptr<Node<T>> emplace_root(Args&&... args) {
+        root = make_node(std::forward<Args>(args)...);
+        for (const auto& observer : observers) observer->on_reset(root);
+        return root;
     }
 
     /**
@@ -73,21 +137,513 @@ public:
      *
      * @param parent_key The value of the parent node.
      * @param child_key The value of the child node to add.
+     * @return A shared pointer to the new node.
      */
-    void add_sub_node(const T& parent_key, const T& child_key) {
+    std::shared_ptr<Node<T>> add_sub_node(const T& parent_key, const T& child_key) {
         auto parent_node = find(root, parent_key);
         if (parent_node != nullptr) {
-            // Find the first available slot for the child
-            for (size_t i = 0; i < parent_node->get_children().size(); ++i) {
-                if (!parent_node->getChildAt(i)) {
-                    parent_node->addChildAt(std::make_shared<Node<T>>(child_key, k), i);
-                    return;
+            return add_sub_node(parent_node, child_key);
+        } else {
+            throw std::invalid_argument("Parent node not found");
+        }
+    }
+
+    /**
+     * @brief Adds a child node to a specified parent node, moving the value into it.
+     *
+     * @param parent_key The value of the parent node.
+     * @param child_key The value of the child node to add.
+     * @return A shared pointer to the new node.
+     */
+    std::shared_ptr<Node<T>> add_sub_node(const T& parent_key, T&& child_key) {
+        auto parent_node = find(root, parent_key);
+        if (parent_node != nullptr) {
+            return emplace_sub_node(parent_node, std::move(child_key));
+        } else {
+            throw std::invalid_argument("Parent node not found");
+        }
+    }
+
+    /**
+     * @brief Adds a child node to a given parent node, without searching for the parent.
+     *
+     * @param parent_node A node of this tree.
+     * @param child_key The value of the child node to add.
+     * @return A shared pointer to the new node.
+     */
+    std::shared_ptr<Node<T>> add_sub_node(const std::shared_ptr<Node<T>>& parent_node, const T& child_key) {
+        return emplace_sub_node(parent_node, child_key);
+    }
+
+    /**
+     * @brief Adds a child node to a given parent node, moving the value into it.
+     *
+     * @param parent_node A node of this tree.
+     * @param child_key The value of the child node to add.
+     * @return A shared pointer to the new node.
+     */
+    std::shared_ptr<Node<T>> add_sub_node(const std::shared_ptr<Node<T>>& parent_node, T&& child_key) {
+        return emplace_sub_node(parent_node, std::move(child_key));
+    }
+
+    /**
+     * @brief Adds a child node whose value is constructed in place from the arguments.
+     *
+     * The free slot is checked first, so nothing is constructed if the parent is full.
+     *
+     * @param parent_node A node of this tree.
+     * @param args The arguments of a constructor of T.
+     * @return A shared pointer to the new node.
+     */
+    template<typename... Args>
+    std::shared_ptr<Node<T>> emplace_sub_node(const std::shared_ptr<Node<T>>& parent_node, Args&&... args) {
+        size_t slot = parent_node->firstFreeSlot();
+        if (slot >= parent_node->get_children().size()) {
+            throw std::out_of_range("No available slot for a new child");
+        }
+        auto child = make_node(std::forward<Args>(args)...);
+        parent_node->addChildAt(child, slot);
+        for (const auto& observer : observers) observer->on_attach(child);
+        return child;
+    }
+
+    /**
+     * @brief Removes a node and its whole subtree from the tree.
+     *
+     * The children after it move one slot to the left (see Node::removeChildAt), so the free slots of the
+     * parent stay at the end. The removed nodes are unlinked from each other, so each one is freed, and its
+     * memory goes back to the NodePool, as soon as no handle refers to it; a handle that is still held keeps
+     * only its own node. O(depth + size of the subtree): the depth is walked to check that the node is in this tree.
+     *
+     * @param node A node of this tree. Removing the root empties the tree.
+     */
+    void remove_subtree(const std::shared_ptr<Node<T>>& node) {
+        dismantle(detach(node).root);
+    }
+
+    /**
+     * @brief Unlinks a node and its subtree from the tree and returns them as a tree of their own.
+     *
+     * The children after it move one slot to the left, as in remove_subtree. The nodes are moved, not copied,
+     * so the existing handles to them stay valid; the observers of this tree are not moved with them. O(depth + k).
+     *
+     * @param node A node of this tree. Detaching the root empties the tree.
+     * @return A tree whose root is the node.
+     */
+    Tree detach(const std::shared_ptr<Node<T>>& node) {
+        check_in_tree(node);
+        if (node == root) {
+            Tree detached(std::move(root));
+            for (const auto& observer : observers) observer->on_reset(root);
+            return detached;
+        }
+
+        auto parent_node = node->parent();
+        auto detached = parent_node->removeChildAt(node->getIndexInParent());
+        for (const auto& observer : observers) observer->on_detach(detached, parent_node);
+        return Tree(std::move(detached));
+    }
+
+    /**
+     * @brief Attaches the nodes of another tree (for example one returned by detach) under a node of this tree.
+     *
+     * The root of the other tree takes the first free slot of the parent, and the other tree becomes empty.
+     *
+     * @param parent_node A node of this tree.
+     * @param subtree The tree to attach; it must not contain parent_node.
+     * @return The root of the attached nodes.
+     */
+    std::shared_ptr<Node<T>> reattach(const std::shared_ptr<Node<T>>& parent_node, Tree&& subtree) {
+        check_in_tree(parent_node);
+        auto node = subtree.root;
+        if (!node) {
+            throw std::invalid_argument("Cannot attach an empty tree");
+        }
+        for (auto up = parent_node; up; up = up->parent()) {
+            if (up == node) throw std::invalid_argument("Cannot attach a tree under one of its own nodes");
+        }
+
+        size_t slot = parent_node->firstFreeSlot();
+        if (slot >= parent_node->get_children().size()) {
+            throw std::out_of_range("No available slot for a new child");
+        }
+        parent_node->addChildAt(node, slot);
+        subtree.root = nullptr;
+        for (const auto& observer : subtree.observers) observer->on_reset(nullptr);
+        for (const auto& observer : observers) observer->on_attach(node);
+        return node;
+    }
+
+    /**
+     * @brief Gets the instrumentation counters of the current thread.
+     *
+     * The counters are only collected when the code is compiled with -DTREE_STATS; otherwise they stay 0.
+     * To measure one operation, call reset_stats() before it and stats() after it.
+     *
+     * @return The counters since the last reset_stats().
+     */
+    static TreeStats stats() {
+#ifdef TREE_STATS
+        return tree_stats;
+#else
+        return TreeStats();
+#endif
+    }
+
+    /**
+     * @brief Resets the instrumentation counters of the current thread.
+     */
+    static void reset_stats() {
+#ifdef TREE_STATS
+        tree_stats = TreeStats();
+#endif
+    }
+
+    /**
+     * @brief Finds a node with the specified value.
+     *
+     * @param key The value to search for.
+     * @return A shared pointer to the first node (in pre-order) with the value, or nullptr if not found.
+     */
+    std::shared_ptr<Node<T>> find_node(const T& key) const {
+        return find(root, key);
+    }
+
+    /**
+     * @brief Changes the value of a node and updates the observers of the tree.
+     *
+     * @param node A node of this tree.
+     * @param value The new value.
+     */
+    void set_value(const std::shared_ptr<Node<T>>& node, const T& value) {
+        node->get_value() = value;
+        node->invalidateHash();
+        notify_update(node);
+    }
+
+    /**
+     * @brief Registers an observer that is notified after every mutation of the tree.
+     *
+     * @param observer The observer to register.
+     */
+    void add_observer(std::shared_ptr<TreeObserver<T>> observer) {
+        observers.push_back(std::move(observer));
+    }
+
+    /**
+     * @brief Removes an observer registered with add_observer or add_aggregate.
+     *
+     * @param observer The observer to remove.
+     */
+    void remove_observer(const std::shared_ptr<TreeObserver<T>>& observer) {
+        std::erase(observers, observer);
+    }
+
+    /**
+     * @brief Starts maintaining an aggregate (such as SubtreeSize or SubtreeSum) for every subtree.
+     *
+     * The aggregates are computed once in O(n) and then updated along the path to the root by each
+     * add_sub_node, remove_subtree, detach, reattach, set_value, heapify and sift_up (k + 1 hash lookups per
+     * ancestor). Reading one is a hash lookup.
+     *
+     * @param monoid The aggregate operations.
+     * @return The aggregate; query it with of(node).
+     */
+    template<typename Monoid>
+    std::shared_ptr<SubtreeAggregate<T, Monoid>> add_aggregate(Monoid monoid = Monoid()) {
+        auto aggregate = std::make_shared<SubtreeAggregate<T, Monoid>>(root, std::move(monoid));
+        add_observer(aggregate);
+        return aggregate;
+    }
+
+    /**
+     * @brief Makes find skip every subtree whose smallest and largest values do not bound the key.
+     *
+     * The bounds are kept up to date like the other aggregates (O(n) once, then along the path to the root
+     * on each mutation), so change values with set_value, not through get_value(). A key outside the range
+     * of the tree is then rejected in O(1), and a tree whose values grow or shrink with the depth (like a heap)
+     * is searched in about O(depth * k). T must be ordered by < consistently with ==.
+     *
+     * The bounds live in a hash map keyed by node, so find pays one hash lookup per visited node, and each
+     * mutation k + 1 lookups per ancestor: add_sub_node at 1e5 int nodes takes about 780 ns instead of 120 ns.
+     * A lookup costs about 4 comparisons at 1e5 nodes, so the bounds only speed up searches that skip most of
+     * the tree (see find_scrambled_pruned in Benchmark.cpp).
+     */
+    void enable_pruned_find() {
+        if (!search_bounds) search_bounds = add_aggregate(SubtreeBounds<T>());
+    }
+
+    /**
+     * @brief Stops maintaining the bounds of enable_pruned_find; find visits every node again.
+     */
+    void disable_pruned_find() {
+        if (!search_bounds) return;
+        remove_observer(search_bounds);
+        search_bounds.reset();
+    }
+
+    /**
+     * @brief Copies every node of the tree into a new tree that shares nothing with this one.
+     *
+     * The copies are carved from NodeArena blocks instead of being allocated one by one: the first block holds
+     * 64 nodes and each next one twice as many, up to NodeArena::max_block_bytes, so copying n nodes makes
+     * O(log n + n / (nodes per block)) allocations instead of 2n. The observers are not copied. O(n), iterative.
+     *
+     * @return The copy.
+     */
+    Tree clone() const {
+        Tree copy;
+        if (!root) return copy;
+
+        struct Arenas {
+            NodeArena* arena = nullptr;  ///< The block the nodes are carved from.
+            size_t nodes_left = 0;  ///< The nodes that still fit in it.
+            size_t next_nodes = 64;  ///< The nodes the next block is sized for.
+            ~Arenas() { if (arena) arena->release(); }
+        } arenas;
+        constexpr size_t max_block_nodes = std::max<size_t>(1, NodeArena::max_block_bytes / clone_node_bytes);
+        auto copy_node = [&](const Node<T>& node) {
+            if (arenas.nodes_left == 0) {
+                if (arenas.arena) arenas.arena->release();
+                arenas.arena = nullptr;  // the block is released even if create throws
+                arenas.arena = NodeArena::create(arenas.next_nodes * clone_node_bytes);
+                arenas.nodes_left = arenas.next_nodes;
+                arenas.next_nodes = std::min(2 * arenas.next_nodes, max_block_nodes);
+            }
+            --arenas.nodes_left;
+            TREE_STAT(node_allocations, 1);
+            TREE_STAT(bytes_allocated, node_bytes);
+            return std::allocate_shared<Node<T>>(ArenaAllocator<Node<T>>(arenas.arena), node.get_value(), k, arenas.arena);
+        };
+
+        copy.root = copy_node(*root);
+        std::vector<std::pair<const Node<T>*, Node<T>*>> pending{{root.get(), copy.root.get()}};
+        while (!pending.empty()) {
+            auto [source, target] = pending.back();
+            pending.pop_back();
+            const auto& children = source->get_children();
+            for (auto slots = source->getOccupancy(); slots; slots &= slots - 1) {
+                size_t i = std::countr_zero(slots);
+                auto child = copy_node(*children[i]);
+                target->addChildAt(child, i);
+                pending.emplace_back(children[i].get(), child.get());
+            }
+        }
+        return copy;
+    }
+
+    /**
+     * @brief Checks whether two trees have the same shape (children in the same slots) and the same values.
+     *
+     * Iterative, and it stops at the first difference. A subtree that both trees share (as versions made by
+     * the persistent operations do) is equal to itself and is not visited, and two subtrees whose cached hashes
+     * differ are unequal without being visited. For trees that keep their hashes, comparing hash() is an O(1)
+     * test that is wrong only on a hash collision.
+     */
+    friend bool operator==(const Tree& a, const Tree& b) {
+        std::vector<std::pair<const Node<T>*, const Node<T>*>> stack{{a.root.get(), b.root.get()}};
+        while (!stack.empty()) {
+            auto [x, y] = stack.back();
+            stack.pop_back();
+            if (x == y) continue;
+            if (!x || !y || x->getOccupancy() != y->getOccupancy() || !(x->get_value() == y->get_value())) {
+                return false;
+            }
+            if (x->getCachedHash() && y->getCachedHash() && x->getCachedHash() != y->getCachedHash()) return false;
+            const auto& x_children = x->get_children();
+            const auto& y_children = y->get_children();
+            for (auto slots = x->getOccupancy(); slots; slots &= slots - 1) {
+                size_t i = std::countr_zero(slots);
+                stack.emplace_back(x_children[i].get(), y_children[i].get());
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Gets the Merkle hash of the tree (see Node::getSubtreeHash).
+     *
+     * The first call hashes every node in O(n). The hashes stay cached in the nodes, and a mutation clears
+     * only the hashes on the path from the changed node to the root, so the next call costs O(depth * k).
+     * Versions made by the persistent operations share the cached hashes of their shared subtrees.
+     *
+     * @return The hash of the root, or 0 for an empty tree.
+     */
+    std::uint64_t hash() const requires HashableValue<T> {
+        return root ? root->getSubtreeHash() : 0;
+    }
+
+    /**
+     * @brief Finds the topmost places where this tree and another one differ, matching the nodes by slot.
+     *
+     * The two roots are matched, then the children in the same slots of matched nodes. A matched pair is
+     * reported when the values differ (its children are still compared), and a node whose slot is empty in
+     * the other tree is reported with nullptr on the other side (its subtree is not visited). Subtrees that both
+     * trees share, or whose hashes are equal, are skipped, so after a few changes to a hashed tree or one of its
+     * persistent versions the diff costs O(k * changed nodes * depth) instead of O(n). Iterative.
+     *
+     * @param other The tree to compare with.
+     * @return The pairs (node of this tree, node of other) in pre-order.
+     */
+    std::vector<std::pair<std::shared_ptr<Node<T>>, std::shared_ptr<Node<T>>>> diff(const Tree& other) const {
+        std::vector<std::pair<std::shared_ptr<Node<T>>, std::shared_ptr<Node<T>>>> differences;
+        auto handle = [](Node<T>* node) { return node ? node->shared_from_this() : nullptr; };
+        visit_differences(other, [&](Node<T>* x, Node<T>* y, const std::vector<std::uint8_t>&) {
+            differences.emplace_back(handle(x), handle(y));
+        });
+        return differences;
+    }
+
+    /**
+     * @brief Makes the edit script that turns one tree into another (see TreePatch).
+     *
+     * The differences are found as by Tree::diff: a pair of nodes with different values becomes a Change,
+     * a node missing from `to` a Remove, and a node missing from `from` an Insert that carries its whole
+     * subtree. So the patch between two versions that differ in a few nodes is made in time proportional to
+     * the changed region when the versions share their other subtrees or have their hashes cached.
+     *
+     * @param from The tree the patch applies to.
+     * @param to The tree the patch produces.
+     * @return The patch; from.apply(patch) makes from equal to to.
+     */
+    friend TreePatch<T> diff(const Tree& from, const Tree& to) {
+        using EditKind = typename TreePatch<T>::EditKind;
+        TreePatch<T> patch;
+        from.visit_differences(to, [&](Node<T>* x, Node<T>* y, const std::vector<std::uint8_t>& path) {
+            if (!y) {
+                patch.edits.push_back({EditKind::Remove, path, {}, {}});
+            } else if (x) {
+                patch.edits.push_back({EditKind::Change, path, {y->get_value()}, {}});
+            } else {
+                typename TreePatch<T>::Edit edit{EditKind::Insert, path, {}, {}};
+                std::vector<const Node<T>*> stack{y};  // pre-order: the children are pushed last slot first
+                while (!stack.empty()) {
+                    const Node<T>* node = stack.back();
+                    stack.pop_back();
+                    edit.values.push_back(node->get_value());
+                    edit.shapes.push_back(node->getOccupancy());
+                    const auto& children = node->get_children();
+                    for (size_t i = children.size(); i-- > 0;) {
+                        if (children[i]) stack.push_back(children[i].get());
+                    }
                 }
+                patch.edits.push_back(std::move(edit));
             }
-            throw std::out_of_range("No available slot for a new child");
-        } else {
+        });
+        if constexpr (HashableValue<T>) patch.base_hash = from.hash();
+        return patch;
+    }
+
+    /**
+     * @brief Applies an edit script made by diff(*this, target) (or read back with TreePatch::read).
+     *
+     * Each edit changes the node at its path in place: Change goes through set_value, Remove empties the slot
+     * without moving the other children (unlike remove_subtree), and Insert builds the subtree and puts it in
+     * its slot. The observers hear about every edit. O(size of the patch * depth).
+     *
+     * @param patch The patch.
+     * @throws std::invalid_argument If the patch was made for another tree (its base hash differs from hash()),
+     * or if a path does not lead to a node; the edits before that one stay applied.
+     */
+    void apply(const TreePatch<T>& patch) {
+        using EditKind = typename TreePatch<T>::EditKind;
+        if constexpr (HashableValue<T>) {
+            if (patch.base_hash != 0 && hash() != patch.base_hash) {
+                throw std::invalid_argument("The patch was made for another tree");
+            }
+        }
+        for (const auto& edit : patch.edits) {
+            const auto& path = edit.path;
+            if (edit.kind == EditKind::Change) {
+                if (edit.values.size() != 1) throw std::invalid_argument("A change edit needs one value");
+                set_value(node_at(path, path.size()), edit.values[0]);
+            } else if (edit.kind == EditKind::Remove) {
+                if (path.empty()) {
+                    remove_subtree(node_at(path, 0));
+                    continue;
+                }
+                auto parent_node = node_at(path, path.size() - 1);
+                auto removed = parent_node->takeChildAt(path.back());
+                if (!removed) throw std::invalid_argument("The patch removes a node that does not exist");
+                for (const auto& observer : observers) observer->on_detach(removed, parent_node);
+                dismantle(std::move(removed));
+            } else {
+                auto subtree = build_subtree(edit.values, edit.shapes);
+                if (path.empty()) {
+                    if (root) throw std::invalid_argument("The patch inserts a root into a tree that has one");
+                    root = std::move(subtree);
+                    for (const auto& observer : observers) observer->on_reset(root);
+                    continue;
+                }
+                auto parent_node = node_at(path, path.size() - 1);
+                if (path.back() >= k || parent_node->get_children()[path.back()]) {
+                    throw std::invalid_argument("The patch inserts into a slot that is not empty");
+                }
+                parent_node->addChildAt(subtree, path.back());
+                for (const auto& observer : observers) observer->on_attach(subtree);
+            }
+        }
+    }
+
+
+/**-----------------------------------Persistent Operations-------------------------------------------**/
+
+// These functions never modify this tree. They return a new version that copies only the nodes on the path
+// from the root to the changed node and shares every other subtree with this tree, so a version costs
+// O(depth) new nodes. Do not use the in-place functions (add_root, add_sub_node, remove_subtree, heapify) on a tree
+// that shares nodes with other versions, because the shared nodes would change in all of them.
+// A node has a single parent link. The links of the shared nodes stay on the oldest version while it lives and
+// then pass to the last version copied from it, so parent(), depth(), path_to_root(), next_sibling() and the
+// functions that check a node belongs to the tree (detach, reattach) work on a version once the older ones are gone.
+
+    /**
+     * @brief Returns a new version of the tree with a new root node.
+     *
+     * @param key The value of the root node.
+     * @return A tree whose only node is the new root.
+     */
+    Tree with_root(const T& key) const {
+        return Tree(make_node(key));
+    }
+
+    /**
+     * @brief Returns a new version of the tree with a child node added to a specified parent node.
+     *
+     * @param parent_key The value of the parent node.
+     * @param child_key The value of the child node to add.
+     * @return The new version of the tree.
+     */
+    Tree with_sub_node(const T& parent_key, const T& child_key) const {
+        auto path = find_path(parent_key);
+        if (path.empty()) {
             throw std::invalid_argument("Parent node not found");
         }
+
+        size_t slot = path.back()->firstFreeSlot();
+        if (slot >= path.back()->get_children().size()) {
+            throw std::out_of_range("No available slot for a new child");
+        }
+        auto parent_copy = copy_node(*path.back());
+        parent_copy->addChildAt(make_node(child_key), slot);
+        return Tree(copy_path(path, parent_copy));
+    }
+
+    /**
+     * @brief Returns a new version of the tree with the value of a node replaced.
+     *
+     * @param key The current value of the node to update.
+     * @param new_value The new value of the node.
+     * @return The new version of the tree.
+     */
+    Tree with_value(const T& key, const T& new_value) const {
+        auto path = find_path(key);
+        if (path.empty()) {
+            throw std::invalid_argument("Node not found");
+        }
+
+        auto node_copy = copy_node(*path.back());
+        node_copy->get_value() = new_value;
+        return Tree(copy_path(path, node_copy));
     }
 
 
@@ -104,6 +660,16 @@ public:
     class PreOrderIterator {
     private:
         std::stack<std::shared_ptr<Node<T>>> stack;  ///< Stack to hold nodes for traversal.
+        [[no_unique_address]] GrowthCounter growth;  ///< Counts the growths of the container (TREE_STATS only).
+
+        /**
+         * @brief Pushes a node onto the stack.
+         */
+        void push(const std::shared_ptr<Node<T>>& node) {
+            stack.push(node);
+            TREE_STAT(refcount_operations, 1);
+            growth(stack.size());
+        }
 
     public:
         /**
@@ -115,7 +681,7 @@ public:
             if (k_ary != 2) {
                 throw std::invalid_argument("PreOrderIterator can only be used with a binary tree (k_ary = 2).");
             }
-            if (root) stack.push(root);
+            if (root) push(root);
         }
 
         /**
@@ -134,9 +700,10 @@ public:
          */
         PreOrderIterator& operator++() {
             auto node = stack.top();
+            TREE_STAT(refcount_operations, 1);
             stack.pop();
             for (int i = node->get_children().size() - 1; i >= 0; --i) {
-                if (node->getChildAt(i)) stack.push(node->getChildAt(i));
+                if (node->getChildAt(i)) push(node->getChildAt(i));
             }
             return *this;
         }
@@ -192,6 +759,7 @@ public:
     class PostOrderIterator {
     private:
         std::stack<std::shared_ptr<Node<T>>> node_stack;  ///< Stack to hold nodes for traversal.
+        [[no_unique_address]] GrowthCounter growth;  ///< Counts the growths of the container (TREE_STATS only).
 
         /**
          * @brief Pushes all leftmost nodes onto the stack.
@@ -203,6 +771,8 @@ public:
         void push_leftmost_nodes(std::shared_ptr<Node<T>> node) {
             while (node) {
                 node_stack.push(node);
+                TREE_STAT(refcount_operations, 1);
+                growth(node_stack.size());
                 if (!node->get_children().empty()) {
                     node = node->getChildAt(0);  // Go left
                 } else {
@@ -245,11 +815,13 @@ public:
             if (node_stack.empty()) return *this;
 
             auto current = node_stack.top();
+            TREE_STAT(refcount_operations, 1);
             node_stack.pop();
 
             // Check if the stack is not empty and the top of the stack is the parent of the current node
             if (!node_stack.empty()) {
                 auto parent = node_stack.top();
+                TREE_STAT(refcount_operations, 1);
 
                 // If the current node is the left child, move to the right child
                 if (parent->get_children().size() > 1 &&
@@ -310,6 +882,16 @@ public:
     class InOrderIterator {
     private:
         std::stack<std::shared_ptr<Node<T>>> stack;  ///< Stack to hold nodes for traversal.
+        [[no_unique_address]] GrowthCounter growth;  ///< Counts the growths of the container (TREE_STATS only).
+
+        /**
+         * @brief Pushes a node onto the stack.
+         */
+        void push(const std::shared_ptr<Node<T>>& node) {
+            stack.push(node);
+            TREE_STAT(refcount_operations, 1);
+            growth(stack.size());
+        }
         std::shared_ptr<Node<T>> current;  ///< The current node being processed.
 
     public:
@@ -322,7 +904,7 @@ public:
             if (k_ary != 2) {
                 throw std::invalid_argument("InOrderIterator can only be used with a binary tree (k_ary = 2).");
             }            while (current) {
-                stack.push(current);
+                push(current);
                 current = current->get_children().size() > 0 ? current->getChildAt(0) : nullptr;
             }
         }
@@ -343,11 +925,12 @@ public:
          */
         InOrderIterator& operator++() {
             auto node = stack.top();
+            TREE_STAT(refcount_operations, 1);
             stack.pop();
             if (node->get_children().size() > 1) {
                 node = node->getChildAt(1);
                 while (node) {
-                    stack.push(node);
+                    push(node);
                     node = node->get_children().size() > 0 ? node->getChildAt(0) : nullptr;
                 }
             }
@@ -404,6 +987,16 @@ public:
     class BFSIterator {
     private:
         std::queue<std::shared_ptr<Node<T>>> queue;  ///< Queue to hold nodes for traversal.
+        [[no_unique_address]] GrowthCounter growth;  ///< Counts the growths of the container (TREE_STATS only).
+
+        /**
+         * @brief Pushes a node into the queue.
+         */
+        void push(const std::shared_ptr<Node<T>>& node) {
+            queue.push(node);
+            TREE_STAT(refcount_operations, 1);
+            growth(queue.size());
+        }
 
     public:
         /**
@@ -412,7 +1005,7 @@ public:
          * @param root The root node to start the traversal from.
          */
         explicit BFSIterator(std::shared_ptr<Node<T>> root) {
-            if (root) queue.push(root);
+            if (root) push(root);
         }
 
         /**
@@ -431,9 +1024,10 @@ public:
          */
         BFSIterator& operator++() {
             auto node = queue.front();
+            TREE_STAT(refcount_operations, 1);
             queue.pop();
             for (auto& child : node->get_children()) {
-                if (child) queue.push(child);
+                if (child) push(child);
             }
             return *this;
         }
@@ -487,6 +1081,16 @@ public:
     class DFSIterator {
     private:
         std::stack<std::shared_ptr<Node<T>>> stack;  ///< Stack to hold nodes for traversal.
+        [[no_unique_address]] GrowthCounter growth;  ///< Counts the growths of the container (TREE_STATS only).
+
+        /**
+         * @brief Pushes a node onto the stack.
+         */
+        void push(const std::shared_ptr<Node<T>>& node) {
+            stack.push(node);
+            TREE_STAT(refcount_operations, 1);
+            growth(stack.size());
+        }
 
     public:
         /**
@@ -495,7 +1099,7 @@ public:
          * @param root The root node to start the traversal from.
          */
         explicit DFSIterator(std::shared_ptr<Node<T>> root) {
-            if (root) stack.push(root);
+            if (root) push(root);
         }
 
         /**
@@ -514,9 +1118,10 @@ public:
          */
         DFSIterator& operator++() {
             auto node = stack.top();
+            TREE_STAT(refcount_operations, 1);
             stack.pop();
             for (int i = node->get_children().size() - 1; i >= 0; --i) {
-                if (node->getChildAt(i)) stack.push(node->getChildAt(i));
+                if (node->getChildAt(i)) push(node->getChildAt(i));
             }
             return *this;
         }
@@ -566,6 +1171,16 @@ public:
     class HeapIterator {
     private:
         std::queue<std::shared_ptr<Node<T>>> queue;  ///< Queue to hold nodes for traversal.
+        [[no_unique_address]] GrowthCounter growth;  ///< Counts the growths of the container (TREE_STATS only).
+
+        /**
+         * @brief Pushes a node into the queue.
+         */
+        void push(const std::shared_ptr<Node<T>>& node) {
+            queue.push(node);
+            TREE_STAT(refcount_operations, 1);
+            growth(queue.size());
+        }
 
     public:
         /**
@@ -574,7 +1189,7 @@ public:
          * @param root The root node to start the traversal from.
          */
         explicit HeapIterator(std::shared_ptr<Node<T>> root) {
-            if (root) queue.push(root);
+            if (root) push(root);
         }
 
         /**
@@ -593,9 +1208,10 @@ public:
          */
         HeapIterator& operator++() {
             auto node = queue.front();
+            TREE_STAT(refcount_operations, 1);
             queue.pop();
             for (auto& child : node->get_children()) {
-                if (child) queue.push(child);
+                if (child) push(child);
             }
             return *this;
         }
@@ -644,30 +1260,29 @@ public:
 
 /**---------------------------------------Helper Functions-------------------------------------------**/
     /**
-     * @brief Finds a node with the specified value in the tree.
+     * @brief Writes the tree as an adjacency list: one line per node in BFS order, "value: child child ".
      *
-     * @param node The current node to search.
-     * @param key The value to search for.
-     * @return A shared pointer to the found node, or nullptr if not found.
+     * The values are written with their operator<<, so the stream flags apply; the lines end with '\n' and
+     * the stream is not flushed. TreeWriter writes the same layout (and others) faster, through one large buffer.
+     *
+     * @param os The stream to write to.
+     * @param tree The tree to write.
+     * @return The stream.
      */
     friend std::ostream& operator<<(std::ostream& os, const Tree<T, k>& tree) {
         if (!tree.root) return os << "Tree is empty.";
 
-        std::queue<std::shared_ptr<Node<T>>> q;
-        q.push(tree.root);
-
-        while (!q.empty()) {
-            auto node = q.front();
-            q.pop();
-
+        std::vector<const Node<T>*> order{tree.root.get()};  // BFS order; also used as the queue
+        for (size_t i = 0; i < order.size(); ++i) {
+            const Node<T>* node = order[i];
             os << node->get_value() << ": ";
             for (const auto& child : node->get_children()) {
                 if (child) {
-                    os << child->get_value() << " ";
-                    q.push(child);
+                    os << child->get_value() << ' ';
+                    order.push_back(child.get());
                 }
             }
-            os << std::endl;
+            os << '\n';
         }
 
         return os;
@@ -676,40 +1291,330 @@ public:
     /**
      * @brief Internal heapify function to convert a subtree into a min-heap.
      *
+     * Iterative, so it works on trees of any depth: the nodes are collected level by level and sifted down
+     * from the last level up, so the children of a node are heaps when the node itself is sifted down.
+     *
      * @param root The root of the subtree to heapify.
      */
     void heapify(std::shared_ptr<Node<T>> root) {
         if (!root) return;
 
-        // Use size_t, which is the type returned by std::vector<T>::size()
-        for (size_t i = 0; i < root->get_children().size(); ++i) {
-            heapify(root->getChildAt(i));
+        std::vector<Node<T>*> order{root.get()};  // BFS order; also used as the queue
+        for (size_t i = 0; i < order.size(); ++i) {
+            for (const auto& child : order[i]->get_children()) {
+                if (child) order.push_back(child.get());
+            }
+        }
+        for (size_t i = order.size(); i-- > 0;) {
+            sift_down(order[i]);
+        }
+    }
+
+    /**
+     * @brief Moves the value of a node up towards the root while it is smaller than the value of its parent.
+     *
+     * Use it to restore the min-heap after the value of a node in a heap was decreased.
+     *
+     * @param node The node whose value was decreased.
+     */
+    void sift_up(std::shared_ptr<Node<T>> node) {
+        for (auto up = node->parent(); up && node->get_value() < up->get_value(); node = up, up = node->parent()) {
+            std::swap(node->get_value(), up->get_value());
+            node->invalidateHash();  // up is the parent, so its hash is cleared too
+            notify_update(node);
+            notify_update(up);
+        }
+    }
+
+    /**
+     * @brief Creates a new node with k empty children slots, allocated from NodePool like the nodes of the tree.
+     *
+     * Code that builds a tree from its nodes (the readers and the log replay) uses it, then wraps the root in
+     * Tree(root).
+     *
+     * @param args The arguments of the constructor of the value.
+     * @return The new node.
+     */
+    template<typename... Args>
+    static std::shared_ptr<Node<T>> make_node(Args&&... args) {
+        TREE_STAT(node_allocations, 1);
+        TREE_STAT(bytes_allocated, node_bytes);
+        return std::allocate_shared<Node<T>>(NodeAllocator(), std::in_place, k, std::forward<Args>(args)...);
+    }
+
+private:
+    /**
+     * @brief The bytes counted by TREE_STATS for one node: the node, its children slots and the shared_ptr control block.
+     */
+    static constexpr size_t node_bytes = sizeof(Node<T>) + k * sizeof(std::shared_ptr<Node<T>>) + 2 * sizeof(void*);
+
+    /**
+     * @brief The arena bytes reserved for one node by clone: the node with its control block (counts, vtable and
+     * allocator), and its children slots.
+     */
+    static constexpr size_t clone_node_bytes = NodeArena::round_up(sizeof(Node<T>) + 4 * sizeof(void*)) +
+                                               NodeArena::round_up(k * sizeof(std::shared_ptr<Node<T>>));
+
+    /**
+     * @brief Allocates the nodes (with their control blocks) from the free list of NodePool.
+     */
+    using NodeAllocator = PoolAllocator<Node<T>, Node<T>>;
+
+    /**
+     * @brief Creates a copy of a node that shares the children of the original (used for path copying).
+     */
+    static std::shared_ptr<Node<T>> copy_node(const Node<T>& node) {
+        TREE_STAT(node_allocations, 1);
+        TREE_STAT(bytes_allocated, node_bytes);
+        TREE_STAT(refcount_operations, node.getNumOfChildren());
+        return std::allocate_shared<Node<T>>(NodeAllocator(), node);
+    }
+
+    /**
+     * @brief Throws std::invalid_argument unless the node is in this tree (its topmost ancestor is the root).
+     */
+    void check_in_tree(const std::shared_ptr<Node<T>>& node) const {
+        if (!node) {
+            throw std::invalid_argument("Node is null");
         }
+        auto top = node;
+        for (auto up = node->parent(); up; up = up->parent()) top = up;
+        if (top != root) {
+            throw std::invalid_argument("Node is not in this tree");
+        }
+    }
 
-        // Now, check for the smallest child and swap if necessary
-        size_t smallest = 0;
-        for (size_t i = 1; i < root->get_children().size(); ++i) {
-            if (root->getChildAt(i) && root->getChildAt(i)->get_value() < root->getChildAt(smallest)->get_value()) {
-                smallest = i;
+    /**
+     * @brief Unlinks every node of a removed subtree from its children, so each node is freed (and its memory
+     * goes back to the NodePool) as soon as no handle refers to it.
+     */
+    static void dismantle(std::shared_ptr<Node<T>> removed) {
+        std::vector<std::shared_ptr<Node<T>>> stack{std::move(removed)};
+        while (!stack.empty()) {
+            auto current = std::move(stack.back());
+            stack.pop_back();
+            for (const auto& child : current->get_children()) {
+                if (child) stack.push_back(child);
             }
+            current->clearChildren();
         }
+    }
 
-        if (root->getChildAt(smallest) && root->getChildAt(smallest)->get_value() < root->get_value()) {
-            std::swap(root->get_value(), root->getChildAt(smallest)->get_value());
-            heapify(root->getChildAt(smallest));  // Heapify the affected subtree
+    /**
+     * @brief Walks the matched pairs of nodes of this tree and another one, and reports the differences.
+     *
+     * The roots are matched, then the children in the same slots of matched nodes, in pre-order. Pairs that
+     * are the same node or have the same cached hash (both trees are hashed first when T is hashable) are
+     * skipped with their subtrees. A pair with different values is reported and its children are still
+     * matched; a node whose slot is empty in the other tree is reported with nullptr and not descended into.
+     *
+     * @param other The other tree.
+     * @param report Called with the node of this tree, the node of other and the slots from the root to them.
+     */
+    template<typename Report>
+    void visit_differences(const Tree& other, Report report) const {
+        if constexpr (HashableValue<T>) {
+            hash();
+            other.hash();
+        }
+        struct Pending {
+            Node<T>* x;  ///< The node of this tree, or nullptr.
+            Node<T>* y;  ///< The node of the other tree, or nullptr.
+            size_t depth;  ///< The number of slots from the root.
+            std::uint8_t slot;  ///< The slot of both nodes in their parents.
+        };
+        std::vector<std::uint8_t> path;
+        std::vector<Pending> stack{{root.get(), other.root.get(), 0, 0}};
+        while (!stack.empty()) {
+            auto [x, y, depth, slot] = stack.back();
+            stack.pop_back();
+            if (x == y) continue;
+            path.resize(depth);
+            if (depth > 0) path.back() = slot;
+            if (!x || !y) {
+                report(x, y, path);
+                continue;
+            }
+            if (x->getCachedHash() != 0 && x->getCachedHash() == y->getCachedHash()) continue;
+            if (!(x->get_value() == y->get_value())) report(x, y, path);
+
+            const auto& x_children = x->get_children();
+            const auto& y_children = y->get_children();
+            for (auto slots = x->getOccupancy() | y->getOccupancy(); slots;) {
+                size_t i = std::bit_width(slots) - 1;  // the last slot first, so the pairs come out in pre-order
+                slots ^= std::uint64_t{1} << i;
+                stack.push_back({x_children[i].get(), y_children[i].get(), depth + 1, static_cast<std::uint8_t>(i)});
+            }
         }
     }
 
-private:
+    /**
+     * @brief Follows a path of children slots from the root.
+     *
+     * @param path The slots.
+     * @param length The number of slots of the path to follow.
+     * @throws std::invalid_argument If the path leaves the tree.
+     */
+    std::shared_ptr<Node<T>> node_at(const std::vector<std::uint8_t>& path, size_t length) const {
+        Node<T>* node = root.get();
+        for (size_t i = 0; i < length && node; ++i) {
+            node = path[i] < k ? node->get_children()[path[i]].get() : nullptr;
+        }
+        if (!node) throw std::invalid_argument("The patch names a node that does not exist");
+        return node->shared_from_this();
+    }
+
+    /**
+     * @brief Builds the subtree of an Insert edit from its values and shapes in pre-order.
+     *
+     * @throws std::invalid_argument If the shapes do not describe one subtree with k slots per node.
+     */
+    static std::shared_ptr<Node<T>> build_subtree(const std::vector<T>& values, const std::vector<std::uint64_t>& shapes) {
+        if (values.empty() || values.size() != shapes.size()) {
+            throw std::invalid_argument("An insert edit needs one shape per value");
+        }
+        std::shared_ptr<Node<T>> subtree;
+        std::vector<std::pair<Node<T>*, std::uint64_t>> open;  // the nodes whose slots are still to be filled
+        for (size_t i = 0; i < values.size(); ++i) {
+            if (k < 64 && (shapes[i] >> k) != 0) throw std::invalid_argument("An insert edit uses more than k slots");
+            auto node = make_node(values[i]);
+            if (i == 0) {
+                subtree = node;
+            } else {
+                if (open.empty()) throw std::invalid_argument("An insert edit has more values than its shapes hold");
+                auto& [parent_node, slots] = open.back();
+                parent_node->addChildAt(node, std::countr_zero(slots));
+                slots &= slots - 1;
+                if (slots == 0) open.pop_back();
+            }
+            if (shapes[i] != 0) open.emplace_back(node.get(), shapes[i]);
+        }
+        if (!open.empty()) throw std::invalid_argument("An insert edit has fewer values than its shapes hold");
+        return subtree;
+    }
+
+    /**
+     * @brief Tells the observers that the value of a node changed.
+     */
+    void notify_update(const std::shared_ptr<Node<T>>& node) {
+        for (const auto& observer : observers) observer->on_update(node);
+    }
+
+    /**
+     * @brief Finds the first node in pre-order with the specified value.
+     *
+     * Iterative with an explicit stack of raw pointers (at most depth * (k - 1) + 1 entries), so deep trees
+     * do not overflow the call stack and the search makes no reference count updates.
+     * After enable_pruned_find, subtrees whose bounds exclude the key are skipped (reading the bounds of a
+     * visited node is a hash lookup).
+     *
+     * @param node The root of the subtree to search.
+     * @param key The value to search for.
+     * @return A shared pointer to the found node, or nullptr if not found.
+     */
     std::shared_ptr<Node<T>> find(const std::shared_ptr<Node<T>>& node, const T& key) const {
-        if (node == nullptr) return nullptr;
-        if (node->get_value() == key) return node;
-        for (const auto& child : node->get_children()) {
-            auto result = find(child, key);
-            if (result != nullptr) return result;
+        std::vector<Node<T>*> stack;
+        if (node) stack.push_back(node.get());
+
+        while (!stack.empty()) {
+            Node<T>* current = stack.back();
+            stack.pop_back();
+            if constexpr (requires(const T& a) { a < a; }) {  // only ordered values can have bounds
+                if (search_bounds) {
+                    const auto& [low, high] = search_bounds->of(*current);
+                    if (key < low || high < key) {
+                        TREE_STAT(find_pruned_subtrees, 1);
+                        continue;
+                    }
+                }
+            }
+            TREE_STAT(find_comparisons, 1);
+            if (current->get_value() == key) {
+                TREE_STAT(refcount_operations, 1);
+                return current->shared_from_this();
+            }
+            const auto& children = current->get_children();
+            for (size_t i = children.size(); i-- > 0;) {
+                if (children[i]) stack.push_back(children[i].get());
+            }
         }
         return nullptr;
     }
+
+    /**
+     * @brief Moves the value of a node down while one of its children is smaller (the children must be heaps).
+     */
+    void sift_down(Node<T>* node) {
+        while (true) {
+            Node<T>* smallest = nullptr;
+            for (const auto& child : node->get_children()) {
+                if (child && (!smallest || child->get_value() < smallest->get_value())) smallest = child.get();
+            }
+            if (!smallest || !(smallest->get_value() < node->get_value())) return;
+
+            std::swap(node->get_value(), smallest->get_value());
+            smallest->invalidateHash();
+            if (!observers.empty()) {
+                notify_update(smallest->shared_from_this());
+                notify_update(node->shared_from_this());
+            }
+            node = smallest;
+        }
+    }
+
+    /**
+     * @brief Finds the path from the root to the first node (in the same order as find) with the specified value.
+     *
+     * @param key The value to search for.
+     * @return The nodes from the root to the found node, or an empty vector if not found.
+     */
+    std::vector<std::shared_ptr<Node<T>>> find_path(const T& key) const {
+        std::vector<std::shared_ptr<Node<T>>> path;
+        std::stack<std::pair<std::shared_ptr<Node<T>>, size_t>> stack;  // node and its depth
+        if (root) stack.emplace(root, 0);
+
+        while (!stack.empty()) {
+            auto [node, depth] = stack.top();
+            stack.pop();
+            path.resize(depth);
+            path.push_back(node);
+            if (node->get_value() == key) return path;
+
+            const auto& children = node->get_children();
+            for (size_t i = children.size(); i-- > 0;) {
+                if (children[i]) stack.emplace(children[i], depth + 1);
+            }
+        }
+        return {};
+    }
+
+    /**
+     * @brief Copies the ancestors on a path so they lead to a replacement for the last node of the path.
+     *
+     * Each copy inherits the parent links of the children it shares once its children are final, so the new
+     * version can be navigated upward when the old one is gone (see Node::inheritChildren).
+     *
+     * @param path The nodes from the root to the replaced node, as returned by find_path.
+     * @param replacement The new node that takes the place of path.back().
+     * @return The root of the new version.
+     */
+    std::shared_ptr<Node<T>> copy_path(const std::vector<std::shared_ptr<Node<T>>>& path,
+                                       std::shared_ptr<Node<T>> replacement) const {
+        for (size_t depth = path.size() - 1; depth > 0; --depth) {
+            replacement->inheritChildren();
+            auto ancestor = copy_node(*path[depth - 1]);
+            const auto& children = ancestor->get_children();
+            for (size_t i = 0; i < children.size(); ++i) {
+                if (children[i] == path[depth]) {
+                    ancestor->addChildAt(replacement, i);
+                    break;
+                }
+            }
+            replacement = ancestor;
+        }
+        replacement->inheritChildren();
+        return replacement;
+    }
 };
 
 #endif // TREE_HPP
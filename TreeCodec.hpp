@@ -0,0 +1,260 @@
+//guyes134@gmail.com
+
+#ifndef TREECODEC_HPP
+#define TREECODEC_HPP
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "Tree.hpp"
+
+
+/**
+ * @brief A compact binary form of a whole tree: its shape in about 2 bits per node, then its values.
+ *
+ * The shape is the LOUDS of the tree (level-order unary degree sequence): for each node in BFS order, one
+ * 1 bit per child followed by a 0 bit, so n nodes take 2n - 1 bits. LOUDS only gives the number of children;
+ * the slots are implied to be the first ones, as add_sub_node, remove_subtree and detach leave them. The few
+ * nodes whose children have gaps (left by Tree::apply or Node::takeChildAt) are listed with their occupied
+ * slots after the header, so the form is exact for any tree.
+ *
+ * The values follow in the same BFS order. Integers are stored as the difference from the previous value,
+ * zigzag-mapped and varint-packed, so values that grow with the BFS position take one byte each; other types
+ * are stored as their bytes (so they are read back by a machine with the same value layout and byte order).
+ *
+ * @tparam T The type of the values stored in the nodes; it must be trivially copyable.
+ * @tparam k The maximum number of children each node can have.
+ */
+template<typename T, int k = 2>
+class TreeCodec {
+    static_assert(std::is_trivially_copyable_v<T>, "the codec writes the values as their bytes");
+
+public:
+    /**
+     * @brief Writes a tree in the compact form, with one write to the stream. O(n).
+     *
+     * @param os The stream to write to.
+     * @param tree The tree to write.
+     */
+    static void write(std::ostream& os, const Tree<T, k>& tree) {
+        std::vector<const Node<T>*> order;  // BFS order; also used as the queue
+        if (tree.getRoot()) order.push_back(tree.getRoot().get());
+        std::vector<std::uint64_t> words;
+        size_t bit = 0;
+        std::string gaps, values;
+        size_t gap_count = 0, last_gap = 0;
+        T previous{};
+        for (size_t i = 0; i < order.size(); ++i) {
+            const Node<T>* node = order[i];
+            std::uint64_t occupancy = node->getOccupancy();
+            int degree = std::popcount(occupancy);
+            if (occupancy != low_bits(degree)) {
+                put_varint(gaps, i - last_gap);
+                put_varint(gaps, occupancy);
+                last_gap = i;
+                ++gap_count;
+            }
+            words.resize((bit + degree + 1 + 63) / 64);
+            for (int left = degree; left > 0;) {  // the 1 bits, a word at a time; the 0 bit is already there
+                int take = std::min(left, 64 - static_cast<int>(bit % 64));
+                words[bit / 64] |= low_bits(take) << (bit % 64);
+                bit += take;
+                left -= take;
+            }
+            ++bit;
+            const auto& children = node->get_children();
+            for (auto slots = occupancy; slots; slots &= slots - 1) order.push_back(children[std::countr_zero(slots)].get());
+            put_value(values, node->get_value(), previous);
+        }
+
+        std::string out(magic, sizeof(magic));
+        put_varint(out, order.size());
+        put_varint(out, gap_count);
+        out += gaps;
+        out.append(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(std::uint64_t));
+        put_varint(out, values.size());
+        out += values;
+        os.write(out.data(), static_cast<std::streamsize>(out.size()));
+    }
+
+    /**
+     * @brief Reads a tree written by write(). O(n).
+     *
+     * @param is The stream to read from.
+     * @return The tree.
+     * @throws std::invalid_argument If the input is not a compact tree, ends early or does not fit k.
+     */
+    static Tree<T, k> read(std::istream& is) {
+        char header[sizeof(magic)];
+        if (!is.read(header, sizeof(header)) || std::memcmp(header, magic, sizeof(magic)) != 0) {
+            throw std::invalid_argument("The input is not a compact tree");
+        }
+        std::uint64_t count = get_varint(is);
+        std::uint64_t gap_count = get_varint(is);
+        if (count == 0) return Tree<T, k>();
+        if (gap_count > count) throw std::invalid_argument("Malformed compact tree");
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> gaps;  // BFS index and occupied slots
+        for (std::uint64_t g = 0, index = 0; g < gap_count; ++g) {
+            index += get_varint(is);
+            gaps.emplace_back(index, get_varint(is));
+        }
+        if (count > std::uint64_t{1} << 58) throw std::invalid_argument("Malformed compact tree");
+        std::string bits = read_bytes(is, (2 * count - 1 + 63) / 64 * sizeof(std::uint64_t));
+        std::string values = read_bytes(is, get_varint(is));
+
+        const char* in = values.data();
+        const char* end = in + values.size();
+        T previous{};
+        auto root = Tree<T, k>::make_node(get_value(in, end, previous));
+        std::vector<Node<T>*> order{root.get()};  // BFS order; also used as the queue
+        order.reserve(count);
+        size_t bit = 0, gap = 0, bit_count = 2 * count - 1;
+        for (size_t i = 0; i < order.size(); ++i) {
+            size_t degree = count_ones(bits, bit, bit_count);
+            bit += degree + 1;
+            std::uint64_t occupancy = low_bits(static_cast<int>(std::min<size_t>(degree, 64)));
+            if (gap < gaps.size() && gaps[gap].first == i) occupancy = gaps[gap++].second;
+            if (degree > static_cast<size_t>(k) || std::popcount(occupancy) != static_cast<int>(degree) ||
+                (k < 64 && (occupancy >> k) != 0) || order.size() + degree > count) {
+                throw std::invalid_argument("Malformed compact tree");
+            }
+            for (auto slots = occupancy; slots; slots &= slots - 1) {
+                auto child = Tree<T, k>::make_node(get_value(in, end, previous));
+                order[i]->addChildAt(child, std::countr_zero(slots));
+                order.push_back(child.get());
+            }
+        }
+        if (order.size() != count || gap != gaps.size() || in != end) throw std::invalid_argument("Malformed compact tree");
+        return Tree<T, k>(std::move(root));
+    }
+
+private:
+    static constexpr char magic[4] = {'T', 'L', 'D', '1'};  ///< Marks the start of a compact tree.
+
+    /**
+     * @brief Whether the values are stored as varint deltas (integers) or as their bytes.
+     */
+    static constexpr bool delta_values = std::is_integral_v<T> && !std::is_same_v<T, bool> && sizeof(T) <= 8;
+
+    /**
+     * @brief The lowest count bits set (count is 0 to 64).
+     */
+    static constexpr std::uint64_t low_bits(int count) {
+        return count >= 64 ? ~std::uint64_t{0} : (std::uint64_t{1} << count) - 1;
+    }
+
+    /**
+     * @brief Counts the 1 bits from a position up to the next 0 bit, a word at a time.
+     */
+    static size_t count_ones(const std::string& bits, size_t bit, size_t bit_count) {
+        size_t ones = 0;
+        while (true) {
+            if (bit >= bit_count) throw std::invalid_argument("Malformed compact tree");
+            std::uint64_t word;
+            std::memcpy(&word, bits.data() + bit / 64 * sizeof(word), sizeof(word));
+            int offset = static_cast<int>(bit % 64);
+            int run = std::countr_one(word >> offset);
+            ones += static_cast<size_t>(run);
+            if (run < 64 - offset) return ones;
+            bit += static_cast<size_t>(run);
+        }
+    }
+
+    /**
+     * @brief Appends a number in LEB128 (7 bits per byte, low bits first).
+     */
+    static void put_varint(std::string& out, std::uint64_t value) {
+        for (; value >= 0x80; value >>= 7) out.push_back(static_cast<char>(value | 0x80));
+        out.push_back(static_cast<char>(value));
+    }
+
+    /**
+     * @brief Appends a value: its zigzag difference from the previous one for integers, its bytes otherwise.
+     */
+    static void put_value(std::string& out, const T& value, T& previous) {
+        if constexpr (delta_values) {
+            using Unsigned = std::make_unsigned_t<T>;
+            auto delta = static_cast<std::int64_t>(static_cast<std::make_signed_t<T>>(
+                static_cast<Unsigned>(static_cast<Unsigned>(value) - static_cast<Unsigned>(previous))));
+            put_varint(out, (static_cast<std::uint64_t>(delta) << 1) ^ static_cast<std::uint64_t>(delta >> 63));
+            previous = value;
+        } else {
+            out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+        }
+    }
+
+    /**
+     * @brief Reads a value written by put_value.
+     */
+    static T get_value(const char*& in, const char* end, T& previous) {
+        if constexpr (delta_values) {
+            std::uint64_t zigzag = 0;
+            for (int shift = 0;; shift += 7) {
+                if (in == end || shift >= 64) throw std::invalid_argument("Malformed compact tree");
+                auto byte = static_cast<std::uint8_t>(*in++);
+                zigzag |= std::uint64_t{byte & 0x7fu} << shift;
+                if (!(byte & 0x80)) break;
+            }
+            auto delta = static_cast<std::uint64_t>(zigzag >> 1) ^ (~(zigzag & 1) + 1);
+            using Unsigned = std::make_unsigned_t<T>;
+            previous = static_cast<T>(static_cast<Unsigned>(static_cast<Unsigned>(previous) + static_cast<Unsigned>(delta)));
+            return previous;
+        } else {
+            if (static_cast<size_t>(end - in) < sizeof(T)) throw std::invalid_argument("Malformed compact tree");
+            alignas(T) char bytes[sizeof(T)];
+            std::memcpy(bytes, in, sizeof(T));
+            in += sizeof(T);
+            return std::bit_cast<T>(bytes);
+        }
+    }
+
+    /**
+     * @brief Reads one byte, throwing at the end of the input.
+     */
+    static std::uint8_t get_byte(std::istream& is) {
+        char byte;
+        if (!is.get(byte)) throw std::invalid_argument("Truncated compact tree");
+        return static_cast<std::uint8_t>(byte);
+    }
+
+    /**
+     * @brief Reads a number written by put_varint.
+     */
+    static std::uint64_t get_varint(std::istream& is) {
+        std::uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            std::uint8_t byte = get_byte(is);
+            value |= std::uint64_t{byte & 0x7fu} << shift;
+            if (!(byte & 0x80)) return value;
+        }
+        throw std::invalid_argument("Malformed number in compact tree");
+    }
+
+    /**
+     * @brief Reads a number of bytes, growing the buffer as they arrive (so a damaged length does not
+     * allocate more than the input holds).
+     */
+    static std::string read_bytes(std::istream& is, std::uint64_t size) {
+        std::string bytes;
+        constexpr std::uint64_t chunk = std::uint64_t{1} << 24;
+        while (bytes.size() < size) {
+            size_t start = bytes.size();
+            bytes.resize(start + static_cast<size_t>(std::min(chunk, size - start)));
+            if (!is.read(bytes.data() + start, static_cast<std::streamsize>(bytes.size() - start))) {
+                throw std::invalid_argument("Truncated compact tree");
+            }
+        }
+        return bytes;
+    }
+};
+
+#endif // TREECODEC_HPP
@@ -0,0 +1,607 @@
+//guyes134@gmail.com
+
+#ifndef TREELOG_HPP
+#define TREELOG_HPP
+
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Tree.hpp"
+#include "TreeObserver.hpp"
+
+
+/**
+ * @brief When a TreeLog writes and syncs its records.
+ */
+struct TreeLogOptions {
+    size_t group_bytes = size_t{1} << 20;  ///< The buffered records are written once they reach this size.
+    size_t sync_bytes = size_t{16} << 20;  ///< The log is synced once this much was written since the last sync.
+};
+
+
+/**
+ * @brief A write-ahead log of the mutations of a tree, from which recover() rebuilds the tree after a restart.
+ *
+ * attach() writes a snapshot of the tree and registers the log as an observer; from then on every mutation
+ * (add_root, add_sub_node, set_value, heapify, remove_subtree, detach, reattach, apply) appends a compact
+ * binary record: the node ids as varints and the values as their bytes, so adding a leaf costs about 8 bytes.
+ * The records are collected in a buffer that is written with one write() per group (group commit), and the
+ * file is synced with fdatasync only by commit() or once sync_bytes were written, so the cost of a sync is
+ * shared by every mutation of the batch. A mutation is durable once a commit() after it has returned.
+ *
+ * Each group is written as a frame with its length and a checksum. recover() reads the snapshot and the log
+ * with one read() each and replays the records in one pass, looking the nodes up by id in an array instead
+ * of searching for them; it stops at the first incomplete or damaged frame of the log, where a crash cut a
+ * write short. checkpoint() writes a new snapshot and starts an empty log, so the log does not grow forever.
+ *
+ * The nodes are named by ids: a snapshot numbers its nodes in pre-order and each node added later takes the
+ * next id. The ids are kept in a hash map, so the log costs a map insertion per added node.
+ *
+ * @tparam T The type of the values stored in the nodes; it is written as its bytes, so it must be trivially copyable.
+ * @tparam k The maximum number of children each node can have.
+ */
+template<typename T, int k = 2>
+class TreeLog : public TreeObserver<T> {
+    static_assert(std::is_trivially_copyable_v<T>, "the log writes the values as their bytes");
+
+private:
+    /**
+     * @brief The kinds of records.
+     */
+    enum class Record : std::uint8_t {
+        Subtree = 1,  ///< parent id + 1 (0 for the root), slot, then the occupied slots and the value of each node in pre-order.
+        Child = 2,    ///< parent id, slot, value: a new leaf.
+        Update = 3,   ///< node id, value.
+        Remove = 4,   ///< node id, the occupied slots of its parent afterwards (they tell whether the later children moved).
+        Clear = 5     ///< The tree became empty.
+    };
+
+    static constexpr char magic[8] = {'T', 'R', 'E', 'E', 'L', 'O', 'G', '1'};  ///< Starts the snapshot and the log.
+    static constexpr size_t header_bytes = sizeof(magic) + 8;  ///< The magic and the epoch.
+    static constexpr size_t frame_bytes = 16;  ///< The payload length and checksum before each frame.
+
+    std::string snapshot_path;  ///< The file of the last snapshot.
+    std::string log_path;  ///< The file of the records since the last snapshot.
+    TreeLogOptions options;  ///< When to write and sync.
+    int fd = -1;  ///< The open log file.
+    std::uint64_t epoch = 0;  ///< Written in the snapshot and its log, so a log from an older snapshot is ignored.
+    std::string group;  ///< The frame being collected: room for its header, then the records.
+    size_t unsynced = 0;  ///< The bytes written since the last sync.
+    std::unordered_map<const Node<T>*, std::uint64_t> ids;  ///< The id of each node of the tree.
+    std::uint64_t next_id = 0;  ///< The id of the next added node.
+    std::uint64_t written = 0;  ///< The bytes written to the snapshots and the log.
+    std::uint64_t sync_count = 0;  ///< The calls to fdatasync.
+
+    TreeLog(std::string snapshot_path, std::string log_path, TreeLogOptions options)
+        : snapshot_path(std::move(snapshot_path)), log_path(std::move(log_path)), options(options),
+          epoch(std::random_device()()), group(frame_bytes, '\0') {}
+
+public:
+    TreeLog(const TreeLog&) = delete;
+    TreeLog& operator=(const TreeLog&) = delete;
+
+    /**
+     * @brief Commits the buffered records and closes the log. Errors are ignored; call commit() to see them.
+     */
+    ~TreeLog() override {
+        try {
+            commit();
+        } catch (const std::exception&) {}
+        if (fd >= 0) ::close(fd);
+    }
+
+    /**
+     * @brief Starts logging a tree: writes its snapshot, starts an empty log and registers the log as an observer.
+     *
+     * @param tree The tree to log.
+     * @param snapshot_path The file of the snapshots (replaced atomically by each checkpoint).
+     * @param log_path The file of the records.
+     * @param options When to write and sync.
+     * @return The log; keep it to call commit() and checkpoint().
+     * @throws std::system_error If a file cannot be written.
+     */
+    static std::shared_ptr<TreeLog> attach(Tree<T, k>& tree, std::string snapshot_path, std::string log_path,
+                                           TreeLogOptions options = TreeLogOptions()) {
+        std::shared_ptr<TreeLog> log(new TreeLog(std::move(snapshot_path), std::move(log_path), options));
+        log->checkpoint(tree);
+        tree.add_observer(log);
+        return log;
+    }
+
+    /**
+     * @brief Writes the buffered records and syncs the log, so every mutation so far survives a crash.
+     *
+     * @throws std::system_error If the log cannot be written.
+     */
+    void commit() {
+        write_group();
+        if (unsynced > 0) sync(fd, "Cannot sync the tree log");
+        unsynced = 0;
+    }
+
+    /**
+     * @brief Gets the number of bytes written to the snapshots and the log so far.
+     */
+    std::uint64_t bytes_written() const {
+        return written;
+    }
+
+    /**
+     * @brief Gets the number of times a file was synced so far (each one waits for the disk).
+     */
+    std::uint64_t syncs() const {
+        return sync_count;
+    }
+
+    /**
+     * @brief Replaces the snapshot with the current tree and starts an empty log. O(n).
+     *
+     * The new snapshot is written to a temporary file, synced and renamed over the old one. Until the new log is
+     * started, the old log is still on disk, but its epoch no longer matches the snapshot, so recover() ignores it.
+     *
+     * @param tree The logged tree.
+     * @throws std::system_error If a file cannot be written.
+     */
+    void checkpoint(const Tree<T, k>& tree) {
+        ++epoch;
+        group.resize(frame_bytes);  // the records so far are in the snapshot
+        int log_fd = std::exchange(fd, -1);  // a full group must not be flushed into the old log
+        on_reset(tree.getRoot());
+        fd = log_fd;
+        std::string snapshot = header();
+        snapshot += seal_group();
+
+        std::string temporary = snapshot_path + ".tmp";
+        int snapshot_fd = open_file(temporary, O_WRONLY | O_CREAT | O_TRUNC);
+        try {
+            write_all(snapshot_fd, snapshot.data(), snapshot.size(), "Cannot write the tree snapshot");
+            sync(snapshot_fd, "Cannot sync the tree snapshot");
+        } catch (...) {
+            ::close(snapshot_fd);
+            throw;
+        }
+        ::close(snapshot_fd);
+        if (std::rename(temporary.c_str(), snapshot_path.c_str()) != 0) {
+            throw std::system_error(errno, std::generic_category(), "Cannot replace the tree snapshot");
+        }
+        sync_directory(snapshot_path);
+
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        fd = open_file(log_path, O_WRONLY | O_CREAT | O_TRUNC);
+        std::string log_header = header();
+        write_all(fd, log_header.data(), log_header.size(), "Cannot write the tree log");
+        sync(fd, "Cannot sync the tree log");
+        unsynced = 0;
+    }
+
+    /**
+     * @brief Rebuilds a tree from a snapshot and the log written after it.
+     *
+     * @param snapshot_path The snapshot file.
+     * @param log_path The log file. A missing log, or a log of another snapshot, replays nothing.
+     * @return The tree as of the last complete frame of the log.
+     * @throws std::system_error If the snapshot cannot be read.
+     * @throws std::invalid_argument If the snapshot is damaged or a record does not fit the tree.
+     */
+    static Tree<T, k> recover(const std::string& snapshot_path, const std::string& log_path) {
+        return replay(read_file(snapshot_path, true), read_file(log_path, false));
+    }
+
+    /**
+     * @brief Rebuilds a tree from the contents of a snapshot and of the log written after it, as recover() does
+     * with the contents of the files.
+     *
+     * @param snapshot The snapshot.
+     * @param log The log; an empty log, or a log of another snapshot, replays nothing.
+     * @return The tree as of the last complete frame of the log.
+     * @throws std::invalid_argument If the snapshot is damaged or a record does not fit the tree.
+     */
+    static Tree<T, k> replay(const std::string& snapshot, const std::string& log) {
+        Replay replay;
+        std::uint64_t snapshot_epoch = check_header(snapshot, "The tree snapshot is damaged");
+        if (replay.frames(snapshot) != snapshot.size()) {
+            throw std::invalid_argument("The tree snapshot is damaged");
+        }
+        if (log.size() >= header_bytes && std::memcmp(log.data(), magic, sizeof(magic)) == 0 &&
+            check_header(log, "The tree log is damaged") == snapshot_epoch) {
+            replay.frames(log);  // a torn last frame is dropped
+        }
+        return Tree<T, k>(std::move(replay.root));
+    }
+
+    void on_reset(const std::shared_ptr<Node<T>>& root) override {
+        ids.clear();
+        next_id = 0;
+        if (!root) {
+            put_byte(Record::Clear);
+        } else {
+            put_subtree(0, 0, *root);
+        }
+        if (group.size() >= options.group_bytes) write_group();
+    }
+
+    void on_attach(const std::shared_ptr<Node<T>>& node) override {
+        auto parent_node = node->parent();
+        std::uint64_t parent_id = ids.at(parent_node.get());
+        if (node->getNumOfChildren() == 0) {
+            put_byte(Record::Child);
+            put_varint(parent_id);
+            put_varint(node->getIndexInParent());
+            put_value(node->get_value());
+            ids.emplace(node.get(), next_id++);
+        } else {
+            put_subtree(parent_id + 1, node->getIndexInParent(), *node);
+        }
+        if (group.size() >= options.group_bytes) write_group();
+    }
+
+    void on_detach(const std::shared_ptr<Node<T>>& node, const std::shared_ptr<Node<T>>& parent) override {
+        put_byte(Record::Remove);
+        put_varint(ids.at(node.get()));
+        put_varint(parent->getOccupancy());
+        std::vector<const Node<T>*> stack{node.get()};
+        while (!stack.empty()) {
+            const Node<T>* current = stack.back();
+            stack.pop_back();
+            ids.erase(current);
+            for (const auto& child : current->get_children()) {
+                if (child) stack.push_back(child.get());
+            }
+        }
+        if (group.size() >= options.group_bytes) write_group();
+    }
+
+    void on_update(const std::shared_ptr<Node<T>>& node) override {
+        put_byte(Record::Update);
+        put_varint(ids.at(node.get()));
+        put_value(node->get_value());
+        if (group.size() >= options.group_bytes) write_group();
+    }
+
+private:
+    /**
+     * @brief Rebuilds the tree from the records of a snapshot and a log.
+     */
+    struct Replay {
+        std::shared_ptr<Node<T>> root;  ///< The rebuilt tree.
+        std::vector<Node<T>*> nodes;  ///< The nodes by id, owned by the tree (no reference counting per lookup).
+        std::vector<std::shared_ptr<Node<T>>> removed;  ///< The removed subtrees, kept so their ids stay valid.
+
+        /**
+         * @brief Replays the frames after the header of a file, up to the first incomplete or damaged one.
+         *
+         * @return The end of the last replayed frame.
+         */
+        size_t frames(const std::string& file) {
+            size_t position = header_bytes;
+            while (file.size() - position >= frame_bytes) {
+                std::uint64_t length = read_word(file.data() + position);
+                const char* payload = file.data() + position + frame_bytes;
+                if (length > file.size() - position - frame_bytes) break;
+#ifndef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION  // a fuzzer cannot forge the checksums, so it would never reach the records
+                if (read_word(file.data() + position + 8) != checksum(payload, length)) break;
+#endif
+                records(payload, payload + length);
+                position += frame_bytes + length;
+            }
+            return position;
+        }
+
+        /**
+         * @brief Replays the records of one frame.
+         */
+        void records(const char* in, const char* end) {
+            while (in < end) {
+                auto kind = static_cast<Record>(get_byte(in, end));
+                if (kind == Record::Child) {
+                    Node<T>* parent_node = node(get_varint(in, end));
+                    size_t slot = get_varint(in, end);
+                    auto child = Tree<T, k>::make_node(get_value(in, end));
+                    attach_child(parent_node, child, slot);
+                    nodes.push_back(child.get());
+                } else if (kind == Record::Update) {
+                    Node<T>* updated = node(get_varint(in, end));
+                    updated->get_value() = get_value(in, end);
+                    updated->invalidateHash();
+                } else if (kind == Record::Subtree) {
+                    subtree(in, end);
+                } else if (kind == Record::Remove) {
+                    remove(in, end);
+                } else if (kind == Record::Clear) {
+                    root = nullptr;
+                    nodes.clear();
+                } else {
+                    throw std::invalid_argument("Unknown record in the tree log");
+                }
+            }
+        }
+
+        /**
+         * @brief Gets a node by id.
+         */
+        Node<T>* node(std::uint64_t id) const {
+            if (id >= nodes.size()) throw std::invalid_argument("The tree log names an unknown node");
+            return nodes[id];
+        }
+
+        /**
+         * @brief Puts a node in an empty slot of a parent.
+         */
+        static void attach_child(Node<T>* parent_node, const std::shared_ptr<Node<T>>& child, size_t slot) {
+            if (slot >= static_cast<size_t>(k) || (parent_node->getOccupancy() >> slot & 1)) {
+                throw std::invalid_argument("The tree log adds a node to a slot that is not free");
+            }
+            parent_node->addChildAt(child, slot);
+        }
+
+        /**
+         * @brief Replays a Subtree record: builds the nodes in pre-order from their shapes and gives them the next ids.
+         * The record ends when every occupied slot is filled.
+         */
+        void subtree(const char*& in, const char* end) {
+            std::uint64_t parent_plus_one = get_varint(in, end);
+            size_t slot = get_varint(in, end);
+            if (parent_plus_one == 0) {
+                root = nullptr;
+                nodes.clear();
+            }
+            Node<T>* parent_node = parent_plus_one == 0 ? nullptr : node(parent_plus_one - 1);
+
+            std::shared_ptr<Node<T>> top;
+            std::vector<std::pair<Node<T>*, std::uint64_t>> open;  // the nodes whose slots are still to be filled
+            for (bool first = true; first || !open.empty(); first = false) {
+                std::uint64_t shape = get_varint(in, end);
+                if (k < 64 && (shape >> k) != 0) throw std::invalid_argument("The tree log uses more than k slots");
+                auto created = Tree<T, k>::make_node(get_value(in, end));
+                if (first) {
+                    top = created;
+                } else {
+                    auto& [up, slots] = open.back();
+                    up->addChildAt(created, std::countr_zero(slots));
+                    slots &= slots - 1;
+                    if (slots == 0) open.pop_back();
+                }
+                if (shape != 0) open.emplace_back(created.get(), shape);
+                nodes.push_back(created.get());
+            }
+
+            if (parent_node) {
+                attach_child(parent_node, top, slot);
+            } else {
+                root = std::move(top);
+            }
+        }
+
+        /**
+         * @brief Replays a Remove record. The recorded slots of the parent tell whether the later children moved
+         * left (remove_subtree, detach) or stayed (apply).
+         */
+        void remove(const char*& in, const char* end) {
+            Node<T>* gone = node(get_varint(in, end));
+            std::uint64_t occupancy = get_varint(in, end);
+            auto parent_node = gone->parent();
+            if (!parent_node) throw std::invalid_argument("The tree log removes a node that is not in the tree");
+            size_t slot = gone->getIndexInParent();
+            if (occupancy == (parent_node->getOccupancy() & ~(std::uint64_t{1} << slot))) {
+                removed.push_back(parent_node->takeChildAt(slot));
+            } else {
+                removed.push_back(parent_node->removeChildAt(slot));
+            }
+            if (parent_node->getOccupancy() != occupancy) {
+                throw std::invalid_argument("The tree log does not match the children of a node");
+            }
+        }
+    };
+
+    /**
+     * @brief Appends a Subtree record with the nodes in pre-order, and gives them the next ids.
+     */
+    void put_subtree(std::uint64_t parent_plus_one, size_t slot, const Node<T>& top) {
+        put_byte(Record::Subtree);
+        put_varint(parent_plus_one);
+        put_varint(slot);
+        std::vector<const Node<T>*> stack{&top};
+        while (!stack.empty()) {
+            const Node<T>* node = stack.back();
+            stack.pop_back();
+            put_varint(node->getOccupancy());
+            put_value(node->get_value());
+            ids.emplace(node, next_id++);
+            const auto& children = node->get_children();
+            for (size_t i = children.size(); i-- > 0;) {
+                if (children[i]) stack.push_back(children[i].get());
+            }
+        }
+    }
+
+    void put_byte(Record record) {
+        group.push_back(static_cast<char>(record));
+    }
+
+    /**
+     * @brief Appends a number in LEB128 (7 bits per byte, low bits first).
+     */
+    void put_varint(std::uint64_t value) {
+        for (; value >= 0x80; value >>= 7) group.push_back(static_cast<char>(value | 0x80));
+        group.push_back(static_cast<char>(value));
+    }
+
+    void put_value(const T& value) {
+        group.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    static std::uint8_t get_byte(const char*& in, const char* end) {
+        if (in == end) throw std::invalid_argument("A record of the tree log ends early");
+        return static_cast<std::uint8_t>(*in++);
+    }
+
+    static std::uint64_t get_varint(const char*& in, const char* end) {
+        std::uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            std::uint8_t byte = get_byte(in, end);
+            value |= std::uint64_t{byte & 0x7fu} << shift;
+            if (!(byte & 0x80)) return value;
+        }
+        throw std::invalid_argument("A number of the tree log is too long");
+    }
+
+    static T get_value(const char*& in, const char* end) {
+        if (static_cast<size_t>(end - in) < sizeof(T)) throw std::invalid_argument("A record of the tree log ends early");
+        alignas(T) char bytes[sizeof(T)];
+        std::memcpy(bytes, in, sizeof(T));
+        in += sizeof(T);
+        return std::bit_cast<T>(bytes);
+    }
+
+    static std::uint64_t read_word(const char* in) {
+        std::uint64_t word;
+        std::memcpy(&word, in, sizeof(word));
+        return word;
+    }
+
+    /**
+     * @brief A checksum of a frame, 8 bytes at a time (one multiply per word, so it runs at several GB/s).
+     */
+    static std::uint64_t checksum(const char* data, size_t size) {
+        std::uint64_t hash = 0x9e3779b97f4a7c15 ^ size;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            hash = (hash ^ read_word(data + i)) * 0xff51afd7ed558ccd;
+            hash ^= hash >> 32;
+        }
+        for (; i < size; ++i) hash = (hash ^ static_cast<std::uint8_t>(data[i])) * 0x100000001b3;
+        return hash;
+    }
+
+    /**
+     * @brief The header of the snapshot and the log: the magic and the epoch.
+     */
+    std::string header() const {
+        std::string result(magic, sizeof(magic));
+        result.append(reinterpret_cast<const char*>(&epoch), sizeof(epoch));
+        return result;
+    }
+
+    /**
+     * @brief Checks the magic of a file and returns its epoch.
+     */
+    static std::uint64_t check_header(const std::string& file, const char* message) {
+        if (file.size() < header_bytes || std::memcmp(file.data(), magic, sizeof(magic)) != 0) {
+            throw std::invalid_argument(message);
+        }
+        return read_word(file.data() + sizeof(magic));
+    }
+
+    /**
+     * @brief Fills in the header of the collected frame and returns it; the group starts over.
+     */
+    std::string seal_group() {
+        std::uint64_t length = group.size() - frame_bytes;
+        std::uint64_t sum = checksum(group.data() + frame_bytes, length);
+        std::memcpy(group.data(), &length, sizeof(length));
+        std::memcpy(group.data() + 8, &sum, sizeof(sum));
+        std::string frame(frame_bytes, '\0');
+        std::swap(frame, group);
+        return frame;
+    }
+
+    /**
+     * @brief Writes the collected records as one frame, and syncs if sync_bytes were written since the last sync.
+     */
+    void write_group() {
+        if (group.size() == frame_bytes || fd < 0) return;
+        std::string frame = seal_group();
+        write_all(fd, frame.data(), frame.size(), "Cannot write the tree log");
+        unsynced += frame.size();
+        if (unsynced >= options.sync_bytes) {
+            sync(fd, "Cannot sync the tree log");
+            unsynced = 0;
+        }
+        frame.clear();
+        std::swap(frame, group);  // keep the capacity of the buffer
+        group.resize(frame_bytes);
+    }
+
+    static int open_file(const std::string& path, int flags) {
+        int result = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+        if (result < 0) throw std::system_error(errno, std::generic_category(), "Cannot open " + path);
+        return result;
+    }
+
+    void write_all(int file, const char* data, size_t size, const char* message) {
+        written += size;
+        while (size > 0) {
+            ssize_t written = ::write(file, data, size);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                throw std::system_error(errno, std::generic_category(), message);
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+    }
+
+    void sync(int file, const char* message) {
+        ++sync_count;
+        if (::fdatasync(file) != 0) throw std::system_error(errno, std::generic_category(), message);
+    }
+
+    /**
+     * @brief Syncs the directory of a file, so a rename into it survives a crash.
+     */
+    static void sync_directory(const std::string& path) {
+        std::string directory = std::filesystem::path(path).parent_path().string();
+        int directory_fd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (directory_fd < 0) return;  // the rename is still done; only its durability is not forced
+        ::fsync(directory_fd);
+        ::close(directory_fd);
+    }
+
+    /**
+     * @brief Reads a whole file with one read() (more only if the kernel returns less).
+     *
+     * @param required Whether a missing file is an error; otherwise it reads as empty.
+     */
+    static std::string read_file(const std::string& path, bool required) {
+        int file = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file < 0) {
+            if (!required && errno == ENOENT) return {};
+            throw std::system_error(errno, std::generic_category(), "Cannot open " + path);
+        }
+        struct stat status;
+        std::string content;
+        if (::fstat(file, &status) == 0) content.resize(static_cast<size_t>(status.st_size));
+        size_t size = 0;
+        while (true) {
+            if (size == content.size()) content.resize(content.size() + 65536);
+            ssize_t count = ::read(file, content.data() + size, content.size() - size);
+            if (count < 0 && errno == EINTR) continue;
+            if (count <= 0) {
+                int error = errno;
+                ::close(file);
+                if (count < 0) throw std::system_error(error, std::generic_category(), "Cannot read " + path);
+                break;
+            }
+            size += static_cast<size_t>(count);
+        }
+        content.resize(size);
+        return content;
+    }
+};
+
+#endif // TREELOG_HPP
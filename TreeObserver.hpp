@@ -0,0 +1,55 @@
+//guyes134@gmail.com
+
+#ifndef TREEOBSERVER_HPP
+#define TREEOBSERVER_HPP
+
+#include <memory>
+#include "Node.hpp"
+
+
+/**
+ * @brief An interface for objects that keep per-node data about a tree and must hear about its mutations.
+ *
+ * A Tree calls the observers registered with Tree::add_observer after each of its mutations.
+ * Changing a value directly through Node::get_value() is not seen by the observers; use Tree::set_value.
+ *
+ * @tparam T The type of the values stored in the nodes.
+ */
+template<typename T>
+class TreeObserver {
+public:
+    virtual ~TreeObserver() = default;
+
+    /**
+     * @brief Called when the whole tree was replaced (for example by Tree::add_root).
+     *
+     * @param root The new root, or nullptr for an empty tree.
+     */
+    virtual void on_reset(const std::shared_ptr<Node<T>>& root) = 0;
+
+    /**
+     * @brief Called after a node was attached under a parent. The parent is node->parent().
+     *
+     * @param node The attached node (it may already have children of its own).
+     */
+    virtual void on_attach(const std::shared_ptr<Node<T>>& node) = 0;
+
+    /**
+     * @brief Called after a subtree was unlinked from its parent (by Tree::remove_subtree or Tree::detach).
+     *
+     * The subtree is still whole when this is called, but it is no longer reachable from the tree.
+     *
+     * @param node The root of the unlinked subtree.
+     * @param parent The node it was unlinked from.
+     */
+    virtual void on_detach(const std::shared_ptr<Node<T>>& node, const std::shared_ptr<Node<T>>& parent) = 0;
+
+    /**
+     * @brief Called after the value of a node was changed.
+     *
+     * @param node The node whose value changed.
+     */
+    virtual void on_update(const std::shared_ptr<Node<T>>& node) = 0;
+};
+
+#endif // TREEOBSERVER_HPP
@@ -0,0 +1,152 @@
+//guyes134@gmail.com
+
+#ifndef TREEPATCH_HPP
+#define TREEPATCH_HPP
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+
+/**
+ * @brief An edit script that turns one tree into another (made by diff(from, to), applied by Tree::apply).
+ *
+ * The edits name their nodes by the path of children slots from the root, in the pre-order of the diff, so
+ * each path is valid when its edit is applied. A patch made from two versions that differ in a few nodes
+ * holds only those nodes (and the subtrees that were inserted), and write() encodes it in a few bytes per
+ * edit, so a small change to a large tree is shipped as a small patch instead of the whole tree.
+ *
+ * @tparam T The type of the values stored in the nodes.
+ */
+template<typename T>
+struct TreePatch {
+    /**
+     * @brief What an edit does to the node at its path.
+     */
+    enum class EditKind : std::uint8_t {
+        Change = 0,  ///< Replaces the value of the node.
+        Insert = 1,  ///< Puts a subtree in the empty slot at the path (or at the root of an empty tree).
+        Remove = 2   ///< Removes the node and its subtree, leaving its slot empty.
+    };
+
+    /**
+     * @brief One edit of the script.
+     */
+    struct Edit {
+        EditKind kind;  ///< What the edit does.
+        std::vector<std::uint8_t> path;  ///< The children slots from the root to the node (empty for the root).
+        std::vector<T> values;  ///< Change: the new value. Insert: the values of the subtree in pre-order.
+        std::vector<std::uint64_t> shapes;  ///< Insert: the occupied slots of each node of the subtree, in pre-order.
+    };
+
+    std::uint64_t base_hash = 0;  ///< The hash of the tree the patch applies to, or 0 if it is not checked.
+    std::vector<Edit> edits;  ///< The edits, in the order they are applied.
+
+    /**
+     * @brief Checks whether the patch changes nothing.
+     */
+    bool empty() const {
+        return edits.empty();
+    }
+
+    /**
+     * @brief Writes the patch in a compact binary form: varint counts, one byte per path slot, and the values
+     * as their bytes (so it is read back by a machine with the same value layout and byte order).
+     *
+     * @param os The stream to write to.
+     */
+    void write(std::ostream& os) const requires std::is_trivially_copyable_v<T> {
+        std::string out(magic, sizeof(magic));
+        for (int i = 0; i < 8; ++i) out.push_back(static_cast<char>(base_hash >> (8 * i)));
+        put_varint(out, edits.size());
+        for (const auto& edit : edits) {
+            out.push_back(static_cast<char>(edit.kind));
+            put_varint(out, edit.path.size());
+            out.append(edit.path.begin(), edit.path.end());
+            if (edit.kind == EditKind::Insert) put_varint(out, edit.values.size());
+            for (size_t i = 0; i < edit.values.size(); ++i) {
+                if (edit.kind == EditKind::Insert) put_varint(out, edit.shapes[i]);
+                out.append(reinterpret_cast<const char*>(&edit.values[i]), sizeof(T));
+            }
+        }
+        os.write(out.data(), static_cast<std::streamsize>(out.size()));
+    }
+
+    /**
+     * @brief Reads a patch written by write().
+     *
+     * @param is The stream to read from.
+     * @return The patch.
+     * @throws std::invalid_argument If the input is not a patch or ends early.
+     */
+    static TreePatch read(std::istream& is) requires std::is_trivially_copyable_v<T> {
+        char header[sizeof(magic)];
+        if (!is.read(header, sizeof(header)) || std::memcmp(header, magic, sizeof(magic)) != 0) {
+            throw std::invalid_argument("The input is not a tree patch");
+        }
+        TreePatch patch;
+        for (int i = 0; i < 8; ++i) patch.base_hash |= std::uint64_t{get_byte(is)} << (8 * i);
+        size_t count = get_varint(is);
+        for (size_t e = 0; e < count; ++e) {
+            Edit edit;
+            std::uint8_t kind = get_byte(is);
+            if (kind > static_cast<std::uint8_t>(EditKind::Remove)) {
+                throw std::invalid_argument("Unknown tree patch edit");
+            }
+            edit.kind = static_cast<EditKind>(kind);
+            for (size_t i = 0, length = get_varint(is); i < length; ++i) edit.path.push_back(get_byte(is));
+            size_t values = edit.kind == EditKind::Insert ? get_varint(is) : edit.kind == EditKind::Change ? 1 : 0;
+            for (size_t i = 0; i < values; ++i) {
+                if (edit.kind == EditKind::Insert) edit.shapes.push_back(get_varint(is));
+                std::array<char, sizeof(T)> bytes;
+                if (!is.read(bytes.data(), sizeof(T))) throw std::invalid_argument("Truncated tree patch");
+                edit.values.push_back(std::bit_cast<T>(bytes));
+            }
+            patch.edits.push_back(std::move(edit));
+        }
+        return patch;
+    }
+
+private:
+    static constexpr char magic[4] = {'T', 'P', 'C', '1'};  ///< Marks the start of an encoded patch.
+
+    /**
+     * @brief Appends a number in LEB128 (7 bits per byte, low bits first).
+     */
+    static void put_varint(std::string& out, std::uint64_t value) {
+        for (; value >= 0x80; value >>= 7) out.push_back(static_cast<char>(value | 0x80));
+        out.push_back(static_cast<char>(value));
+    }
+
+    /**
+     * @brief Reads one byte, throwing at the end of the input.
+     */
+    static std::uint8_t get_byte(std::istream& is) {
+        char byte;
+        if (!is.get(byte)) throw std::invalid_argument("Truncated tree patch");
+        return static_cast<std::uint8_t>(byte);
+    }
+
+    /**
+     * @brief Reads a number written by put_varint.
+     */
+    static std::uint64_t get_varint(std::istream& is) {
+        std::uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            std::uint8_t byte = get_byte(is);
+            value |= std::uint64_t{byte & 0x7fu} << shift;
+            if (!(byte & 0x80)) return value;
+        }
+        throw std::invalid_argument("Malformed number in tree patch");
+    }
+};
+
+#endif // TREEPATCH_HPP
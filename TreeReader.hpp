@@ -0,0 +1,313 @@
+//guyes134@gmail.com
+
+#ifndef TREEREADER_HPP
+#define TREEREADER_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <concepts>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Tree.hpp"
+#include "TreeWriter.hpp"
+
+
+/**
+ * @brief Reads a tree back from the text that operator<< and TreeWriter write, in O(n).
+ *
+ * Each line is matched to its node by position, never by searching for its value, so duplicate values are
+ * read back as they were written:
+ * - Adjacency: the lines are in BFS order, so line i is the i-th node queued; its value must equal the value
+ *   queued for it, and its children are queued after the nodes already queued.
+ * - Indented: the depth of a line (its leading spaces / 2) names its parent, the last line one level up.
+ * - ParentArray: the parent of a line is the line with that index, so it must come earlier.
+ * The text does not record empty child slots, so the children of each node fill its first slots.
+ *
+ * Numbers are parsed with std::from_chars, and other values with a from_chars(first, last, value) found by
+ * argument-dependent lookup (as for Complex); the rest fall back to their operator>>, and then a value ends
+ * at the next space. The input is parsed in chunks of whole lines as it arrives, from a stream in 1 MiB
+ * reads or from a file through a sliding memory map.
+ *
+ * @tparam T The type of the values stored in the nodes.
+ * @tparam k The maximum number of children each node can have.
+ */
+template<typename T, int k = 2>
+class TreeReader {
+public:
+    /**
+     * @brief Reads a tree from a stream. O(n).
+     *
+     * @param is The stream to read until its end.
+     * @param layout The layout of the text.
+     * @return The tree; empty for an empty input or "Tree is empty.".
+     * @throws std::invalid_argument If the text is not a tree in the layout, or a node has more than k children.
+     */
+    static Tree<T, k> read(std::istream& is, TreeLayout layout = TreeLayout::Adjacency) {
+        Builder builder(layout);
+        std::string buffer;  // the unparsed end of the last line, then the next chunk
+        constexpr size_t chunk = size_t{1} << 20;
+        while (is) {
+            size_t kept = buffer.size();
+            buffer.resize(kept + chunk);
+            is.read(buffer.data() + kept, static_cast<std::streamsize>(chunk));
+            buffer.resize(kept + static_cast<size_t>(is.gcount()));
+            const char* parsed = builder.parse(buffer.data(), buffer.data() + buffer.size());
+            buffer.erase(0, static_cast<size_t>(parsed - buffer.data()));
+        }
+        return builder.finish(buffer.data(), buffer.data() + buffer.size());
+    }
+
+    /**
+     * @brief Reads a tree from a file, mapping a window of it into memory at a time. O(n).
+     *
+     * @param path The file to read.
+     * @param layout The layout of the text.
+     * @param window_bytes The bytes mapped at a time; a window grows when a single line does not fit.
+     * @return The tree; empty for an empty file or "Tree is empty.".
+     * @throws std::invalid_argument If the text is not a tree in the layout, or a node has more than k children.
+     * @throws std::system_error If the file cannot be opened or mapped.
+     */
+    static Tree<T, k> read_file(const std::string& path, TreeLayout layout = TreeLayout::Adjacency,
+                                size_t window_bytes = size_t{64} << 20) {
+        File file(path);
+        struct stat status;
+        if (::fstat(file.fd, &status) != 0) throw std::system_error(errno, std::generic_category(), "Cannot read " + path);
+        const size_t size = static_cast<size_t>(status.st_size);
+        const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+
+        Builder builder(layout);
+        size_t offset = 0;  // the first byte not parsed yet
+        while (offset < size) {
+            size_t start = offset / page * page;  // mappings start at a page boundary
+            size_t length = std::min(size - start, std::max(window_bytes, offset - start + page));
+            Mapping mapping(file.fd, start, length, path);
+            const char* first = mapping.data + (offset - start);
+            const char* last = mapping.data + length;
+            if (start + length == size) return builder.finish(builder.parse(first, last), last);
+            const char* parsed = builder.parse(first, last);
+            if (parsed == first) window_bytes = 2 * length;  // one line is longer than the window
+            offset += static_cast<size_t>(parsed - first);
+        }
+        return builder.finish(nullptr, nullptr);
+    }
+
+private:
+    /**
+     * @brief Builds the tree line by line, keeping the nodes the later lines refer to by position.
+     */
+    class Builder {
+    public:
+        explicit Builder(TreeLayout layout) : layout(layout) {}
+
+        /**
+         * @brief Parses the complete lines of a range.
+         *
+         * @return The end of the last complete line (first if there is none).
+         */
+        const char* parse(const char* first, const char* last) {
+            std::string_view text(first, static_cast<size_t>(last - first));
+            size_t end = text.rfind('\n');
+            if (end == std::string_view::npos) return first;
+            const char* stop = first + end + 1;
+            while (first != stop) first = line(first, stop);
+            return stop;
+        }
+
+        /**
+         * @brief Parses the last line, which has no line break, and checks that the tree is complete.
+         */
+        Tree<T, k> finish(const char* first, const char* last) {
+            if (first != last) {
+                std::string rest(first, last);
+                rest.push_back('\n');
+                parse(rest.data(), rest.data() + rest.size());
+            }
+            if (layout == TreeLayout::Adjacency && next != nodes.size()) {
+                fail("a node has no line");
+            }
+            return Tree<T, k>(std::move(root));
+        }
+
+    private:
+        TreeLayout layout;
+        std::shared_ptr<Node<T>> root;
+        std::vector<Node<T>*> nodes;  ///< Adjacency: the BFS queue. Indented: the path to the last node. ParentArray: every node.
+        size_t next = 0;              ///< Adjacency: the position in the queue of the node of the next line.
+        size_t line_number = 0;       ///< The number of lines parsed, for the error messages.
+        bool empty = false;           ///< Whether the text was "Tree is empty.".
+
+        [[noreturn]] void fail(const std::string& reason) const {
+            throw std::invalid_argument("Malformed tree text at line " + std::to_string(line_number) + ": " + reason);
+        }
+
+        /**
+         * @brief Parses one line; p points at its start and stop is past a line break at or after its end.
+         *
+         * @return The start of the next line.
+         */
+        const char* line(const char* p, const char* stop) {
+            ++line_number;
+            const char* end = static_cast<const char*>(std::memchr(p, '\n', static_cast<size_t>(stop - p)));
+            if (p == end || (p + 1 == end && *p == '\r')) return end + 1;  // blank lines are skipped
+            if (empty) fail("text after an empty tree");
+            if (!root && std::string_view(p, static_cast<size_t>(end - p)).starts_with("Tree is empty.")) {
+                empty = true;
+                return end + 1;
+            }
+            switch (layout) {
+                case TreeLayout::Adjacency: p = adjacency_line(p, end); break;
+                case TreeLayout::Indented: p = indented_line(p, end); break;
+                case TreeLayout::ParentArray: p = parent_array_line(p, end); break;
+            }
+            p = skip_spaces(p, end);
+            if (p != end) fail("unexpected characters");
+            return end + 1;
+        }
+
+        const char* adjacency_line(const char* p, const char* end) {
+            T head{};
+            p = value(p, end, head, true);
+            if (!root) add_root(std::move(head));
+            else if (next == nodes.size()) fail("more lines than nodes");
+            else if (!(nodes[next]->get_value() == head)) fail("the line is not for the next node in BFS order");
+            if (p == end || *p != ':') fail("expected ':'");
+            Node<T>* parent = nodes[next++];
+            for (p = skip_spaces(p + 1, end); p != end; p = skip_spaces(p, end)) {
+                T child{};
+                p = value(p, end, child, false);
+                nodes.push_back(add_child(parent, std::move(child)));
+            }
+            return p;
+        }
+
+        const char* indented_line(const char* p, const char* end) {
+            const char* start = p;
+            while (p != end && *p == ' ') ++p;
+            size_t spaces = static_cast<size_t>(p - start);
+            if (spaces % 2 != 0) fail("odd indentation");
+            size_t depth = spaces / 2;
+            T v{};
+            p = value(p, end, v, false);
+            if (depth == 0) {
+                if (root) fail("a second root");
+                add_root(std::move(v));
+                return p;
+            }
+            if (depth > nodes.size()) fail("indented more than one level below the previous line");
+            nodes.resize(depth);
+            nodes.push_back(add_child(nodes[depth - 1], std::move(v)));
+            return p;
+        }
+
+        const char* parent_array_line(const char* p, const char* end) {
+            long long parent = 0;
+            auto [after, ec] = std::from_chars(p, end, parent);
+            if (ec != std::errc()) fail("expected a parent index");
+            T v{};
+            p = value(skip_spaces(after, end), end, v, false);
+            if (!root) {
+                if (parent != -1) fail("the first line is not the root (-1)");
+                add_root(std::move(v));
+            } else {
+                if (parent < 0 || static_cast<unsigned long long>(parent) >= nodes.size()) fail("the parent is not an earlier line");
+                nodes.push_back(add_child(nodes[static_cast<size_t>(parent)], std::move(v)));
+            }
+            return p;
+        }
+
+        void add_root(T v) {
+            root = Tree<T, k>::make_node(std::move(v));
+            nodes.push_back(root.get());
+        }
+
+        Node<T>* add_child(Node<T>* parent, T v) {
+            size_t slot = parent->getNumOfChildren();
+            if (slot >= static_cast<size_t>(k)) fail("a node has more than k children");
+            auto child = Tree<T, k>::make_node(std::move(v));
+            parent->addChildAt(child, slot);
+            return child.get();
+        }
+
+        static const char* skip_spaces(const char* p, const char* end) {
+            while (p != end && (*p == ' ' || *p == '\r')) ++p;
+            return p;
+        }
+
+        /**
+         * @brief Parses a value, with the first of from_chars, an ADL from_chars or operator>> that applies.
+         *
+         * @param head Whether the value is the head of an adjacency line, so a ':' after it ends it.
+         * @return The end of the value.
+         */
+        const char* value(const char* p, const char* end, T& out, bool head) const {
+            if constexpr (std::is_arithmetic_v<T> && !std::is_same_v<T, bool> && !(std::is_integral_v<T> && sizeof(T) == 1)) {
+                auto [after, ec] = std::from_chars(p, end, out);
+                if (ec != std::errc()) fail("expected a number");
+                return after;
+            } else if constexpr (requires(const char* q, T& x) { { from_chars(q, q, x) } -> std::same_as<std::from_chars_result>; }) {
+                auto [after, ec] = from_chars(p, end, out);
+                if (ec != std::errc()) fail("expected a value");
+                return after;
+            } else {
+                const char* token_end = p;
+                while (token_end != end && *token_end != ' ' && *token_end != '\r') ++token_end;
+                if (head && token_end != p && token_end[-1] == ':') --token_end;
+                std::istringstream token(std::string(p, token_end));
+                if (!(token >> out)) fail("expected a value");
+                return token_end;
+            }
+        }
+    };
+
+    /**
+     * @brief An open file, closed when it goes out of scope.
+     */
+    struct File {
+        int fd;
+
+        explicit File(const std::string& path) : fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC)) {
+            if (fd < 0) throw std::system_error(errno, std::generic_category(), "Cannot open " + path);
+        }
+
+        ~File() { ::close(fd); }
+
+        File(const File&) = delete;
+        File& operator=(const File&) = delete;
+    };
+
+    /**
+     * @brief A read-only window of a file mapped into memory, unmapped when it goes out of scope.
+     */
+    struct Mapping {
+        const char* data;
+        size_t length;
+
+        Mapping(int fd, size_t offset, size_t length, const std::string& path) : length(length) {
+            void* address = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(offset));
+            if (address == MAP_FAILED) throw std::system_error(errno, std::generic_category(), "Cannot map " + path);
+            ::madvise(address, length, MADV_SEQUENTIAL);
+            data = static_cast<const char*>(address);
+        }
+
+        ~Mapping() { ::munmap(const_cast<char*>(data), length); }
+
+        Mapping(const Mapping&) = delete;
+        Mapping& operator=(const Mapping&) = delete;
+    };
+};
+
+#endif // TREEREADER_HPP
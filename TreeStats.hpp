@@ -0,0 +1,65 @@
+//guyes134@gmail.com
+
+#ifndef TREESTATS_HPP
+#define TREESTATS_HPP
+
+#include <bit>
+#include <cstddef>
+
+
+// * Opt-in instrumentation of the tree operations. Compile with -DTREE_STATS to turn it on;
+// * without it every counting macro expands to nothing and the code is the same as before.
+// * The counters are per thread: reset them with Tree::reset_stats(), run an operation, and read Tree::stats().
+
+
+/**
+ * @brief The counters collected when the tree is compiled with TREE_STATS.
+ */
+struct TreeStats {
+    size_t node_allocations = 0;  ///< Nodes created (make_shared of a Node).
+    size_t bytes_allocated = 0;  ///< Bytes requested for those nodes: the node, its children slots and the control block.
+    size_t refcount_operations = 0;  ///< shared_ptr copies made by the tree code (each one is an atomic increment and decrement).
+    size_t find_comparisons = 0;  ///< Values compared with the key by find.
+    size_t find_pruned_subtrees = 0;  ///< Subtrees that find skipped because the key is outside their bounds.
+    size_t pool_reuses = 0;  ///< Nodes whose memory came from the free list of NodePool instead of the allocator.
+    size_t container_growths = 0;  ///< Times an iterator stack or queue reached a new power-of-two size.
+};
+
+#ifdef TREE_STATS
+
+/**
+ * @brief The counters of the current thread.
+ */
+inline thread_local TreeStats tree_stats;
+
+#define TREE_STAT(counter, amount) (tree_stats.counter += (amount))
+
+#else
+
+#define TREE_STAT(counter, amount) ((void)0)
+
+#endif
+
+
+/**
+ * @brief Counts the growths of an iterator container. It is an empty object when TREE_STATS is off.
+ */
+struct GrowthCounter {
+#ifdef TREE_STATS
+    size_t peak = 0;  ///< The largest size the container has had.
+
+    /**
+     * @brief Records the size of the container after a push.
+     */
+    void operator()(size_t size) {
+        if (size > peak) {
+            if (std::has_single_bit(size)) ++tree_stats.container_growths;
+            peak = size;
+        }
+    }
+#else
+    void operator()(size_t) {}
+#endif
+};
+
+#endif // TREESTATS_HPP
@@ -0,0 +1,199 @@
+//guyes134@gmail.com
+
+#ifndef TREEWRITER_HPP
+#define TREEWRITER_HPP
+
+#include <algorithm>
+#include <charconv>
+#include <concepts>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "Tree.hpp"
+
+
+/**
+ * @brief The text layouts TreeWriter can write.
+ */
+enum class TreeLayout {
+    Adjacency,    ///< One line per node in BFS order, "value: child child " (the layout of operator<<).
+    Indented,     ///< One line per node in pre-order, indented by two spaces per level.
+    ParentArray   ///< One line per node in BFS order, "parent value", where parent is the BFS index of the parent (-1 for the root).
+};
+
+/**
+ * @brief Writes a tree as text through one large buffer, so the stream sees a few bulk writes instead of
+ * several small ones per node.
+ *
+ * Numbers are formatted with std::to_chars, and other values with a to_chars(first, last, value) found by
+ * argument-dependent lookup (as for Complex); the rest fall back to their operator<<. Floating point values
+ * are written with the shortest digits that read back exactly, not with the precision of the stream.
+ *
+ * @tparam T The type of the values stored in the nodes.
+ * @tparam k The maximum number of children each node can have.
+ */
+template<typename T, int k = 2>
+class TreeWriter {
+public:
+    /**
+     * @brief Writes a tree in a layout. An empty tree writes nothing. O(n).
+     *
+     * @param os The stream to write to; it is not flushed.
+     * @param tree The tree to write.
+     * @param layout The layout to write.
+     */
+    static void write(std::ostream& os, const Tree<T, k>& tree, TreeLayout layout = TreeLayout::Adjacency) {
+        Buffer out(os);
+        if (const Node<T>* root = tree.getRoot().get()) {
+            switch (layout) {
+                case TreeLayout::Adjacency: write_adjacency(out, root); break;
+                case TreeLayout::Indented: write_indented(out, root); break;
+                case TreeLayout::ParentArray: write_parent_array(out, root); break;
+            }
+        }
+        out.flush();
+    }
+
+private:
+    /**
+     * @brief A fixed block of characters that is written to the stream when it fills up.
+     */
+    class Buffer {
+    public:
+        explicit Buffer(std::ostream& os) : os(os), data(new char[capacity]) {}
+
+        /**
+         * @brief Writes the buffered characters to the stream.
+         */
+        void flush() {
+            os.write(data.get(), static_cast<std::streamsize>(used));
+            used = 0;
+        }
+
+        void put(char c) {
+            if (used == capacity) flush();
+            data[used++] = c;
+        }
+
+        void put(std::string_view text) {
+            if (text.size() > capacity - used) flush();
+            if (text.size() > capacity) {
+                os.write(text.data(), static_cast<std::streamsize>(text.size()));
+                return;
+            }
+            std::memcpy(data.get() + used, text.data(), text.size());
+            used += text.size();
+        }
+
+        /**
+         * @brief Writes a number of spaces.
+         */
+        void spaces(size_t count) {
+            while (count > 0) {
+                if (used == capacity) flush();
+                size_t take = std::min(count, capacity - used);
+                std::memset(data.get() + used, ' ', take);
+                used += take;
+                count -= take;
+            }
+        }
+
+        /**
+         * @brief Formats a value in place, with the first of to_chars, an ADL to_chars or operator<< that applies.
+         */
+        template<typename V>
+        void value(const V& v) {
+            if constexpr (std::is_arithmetic_v<V> && !std::is_same_v<V, bool> && !(std::is_integral_v<V> && sizeof(V) == 1)) {
+                if (capacity - used < number_room) flush();
+                used = static_cast<size_t>(std::to_chars(data.get() + used, data.get() + capacity, v).ptr - data.get());
+            } else if constexpr (requires(char* p, const V& x) { { to_chars(p, p, x) } -> std::same_as<std::to_chars_result>; }) {
+                for (int attempt = 0; attempt < 2; ++attempt) {  // a second try after a flush, with the whole buffer free
+                    auto result = to_chars(data.get() + used, data.get() + capacity, v);
+                    if (result.ec == std::errc()) {
+                        used = static_cast<size_t>(result.ptr - data.get());
+                        return;
+                    }
+                    if (used == 0) break;
+                    flush();
+                }
+                stream(v);
+            } else {
+                stream(v);
+            }
+        }
+
+    private:
+        static constexpr size_t capacity = size_t{1} << 20;  ///< 1 MiB, written with one call.
+        static constexpr size_t number_room = 128;           ///< More than the longest number to_chars writes.
+
+        std::ostream& os;               ///< The stream the buffer is written to.
+        std::unique_ptr<char[]> data;   ///< The buffered characters.
+        size_t used = 0;                ///< The number of buffered characters.
+
+        template<typename V>
+        void stream(const V& v) {
+            std::ostringstream text;
+            text << v;
+            put(text.view());
+        }
+    };
+
+    static void write_adjacency(Buffer& out, const Node<T>* root) {
+        std::vector<const Node<T>*> order{root};  // BFS order; also used as the queue
+        for (size_t i = 0; i < order.size(); ++i) {
+            const Node<T>* node = order[i];
+            out.value(node->get_value());
+            out.put(": ");
+            for (const auto& child : node->get_children()) {
+                if (child) {
+                    out.value(child->get_value());
+                    out.put(' ');
+                    order.push_back(child.get());
+                }
+            }
+            out.put('\n');
+        }
+    }
+
+    static void write_indented(Buffer& out, const Node<T>* root) {
+        std::vector<std::pair<const Node<T>*, size_t>> stack{{root, 0}};  // nodes still to write, with their depths
+        while (!stack.empty()) {
+            auto [node, depth] = stack.back();
+            stack.pop_back();
+            out.spaces(2 * depth);
+            out.value(node->get_value());
+            out.put('\n');
+            const auto& children = node->get_children();
+            for (auto child = children.rbegin(); child != children.rend(); ++child) {
+                if (*child) stack.emplace_back(child->get(), depth + 1);
+            }
+        }
+    }
+
+    static void write_parent_array(Buffer& out, const Node<T>* root) {
+        out.put("-1 ");
+        out.value(root->get_value());
+        out.put('\n');
+        // The children of node i are written as they are queued, so the lines come out in BFS order
+        std::vector<const Node<T>*> order{root};
+        for (size_t i = 0; i < order.size(); ++i) {
+            for (const auto& child : order[i]->get_children()) {
+                if (child) {
+                    out.value(i);
+                    out.put(' ');
+                    out.value(child->get_value());
+                    out.put('\n');
+                    order.push_back(child.get());
+                }
+            }
+        }
+    }
+};
+
+#endif // TREEWRITER_HPP
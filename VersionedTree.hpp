@@ -0,0 +1,184 @@
+//guyes134@gmail.com
+
+#ifndef VERSIONEDTREE_HPP
+#define VERSIONEDTREE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "Tree.hpp"
+
+
+/**
+ * @brief A k-ary tree that many reader threads can scan while one writer thread keeps adding nodes.
+ *
+ * The published versions are never changed in place. A write copies only the nodes on the path from the root
+ * to the node it changes (every other subtree is shared with the previous version) and then publishes the new
+ * root with a single atomic store. A reader pins the current version with pin(), and the Snapshot it gets back
+ * is an epoch guard: the version it holds stays alive and unchanged until the last Snapshot on it is destroyed,
+ * and then it is reclaimed by the shared_ptr reference counts. Readers never wait for the writer mutex.
+ * The parent links of the shared nodes pass to a newer version when the one they lead to is reclaimed, so
+ * readers go down the tree (the iterators, find) and do not call parent(), depth(), path_to_root() or
+ * next_sibling() on its nodes.
+ *
+ * @tparam T The type of the values stored in the nodes.
+ * @tparam k The maximum number of children each node can have.
+ */
+template<typename T, int k = 2>
+class VersionedTree {
+private:
+    /**
+     * @brief One published version of the tree.
+     */
+    struct Version {
+        Tree<T, k> tree;  ///< The tree of this version. Its values and children never change after publication.
+        std::uint64_t epoch;  ///< The number of writes that were published before this version.
+    };
+
+    std::atomic<std::shared_ptr<const Version>> current;  ///< The latest published version.
+    std::mutex writer_mutex;  ///< Serializes the writers. Readers never take it.
+    std::vector<std::weak_ptr<const Version>> retired;  ///< Older versions that may still be pinned by readers.
+
+public:
+    /**
+     * @brief A pinned, read-only version of the tree.
+     *
+     * The snapshot keeps its version alive, so it can be iterated with any of the const Tree iterators
+     * while the writer publishes newer versions.
+     */
+    class Snapshot {
+    private:
+        std::shared_ptr<const Version> version;  ///< The pinned version.
+
+    public:
+        /**
+         * @brief Pins the given version.
+         *
+         * @param version The version to pin.
+         */
+        explicit Snapshot(std::shared_ptr<const Version> version) : version(std::move(version)) {}
+
+        /**
+         * @brief Gets the pinned tree.
+         *
+         * @return A const reference to the tree of this version.
+         */
+        const Tree<T, k>& operator*() const {
+            return version->tree;
+        }
+
+        /**
+         * @brief Provides a pointer-like interface to the pinned tree.
+         *
+         * @return A pointer to the tree of this version.
+         */
+        const Tree<T, k>* operator->() const {
+            return &version->tree;
+        }
+
+        /**
+         * @brief Gets the epoch of the pinned version.
+         *
+         * @return The number of writes that were published before this version.
+         */
+        std::uint64_t epoch() const {
+            return version->epoch;
+        }
+    };
+
+    /**
+     * @brief Constructs an empty versioned tree (epoch 0).
+     */
+    VersionedTree() : current(std::make_shared<const Version>(Version{Tree<T, k>(), 0})) {}
+
+    /**
+     * @brief Pins the latest published version.
+     *
+     * @return A Snapshot that holds the version until it is destroyed.
+     */
+    Snapshot pin() const {
+        return Snapshot(current.load(std::memory_order_acquire));
+    }
+
+    /**
+     * @brief Gets the epoch of the latest published version.
+     *
+     * @return The number of writes published so far.
+     */
+    std::uint64_t epoch() const {
+        return current.load(std::memory_order_acquire)->epoch;
+    }
+
+    /**
+     * @brief Counts the versions that are still in memory, the latest one included.
+     *
+     * @return The number of versions that have not been reclaimed yet.
+     */
+    size_t live_versions() {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        purge_retired();
+        return retired.size() + 1;
+    }
+
+    /**
+     * @brief Publishes a new version whose root is a new node with the given value.
+     *
+     * @param key The value of the root node.
+     */
+    void add_root(const T& key) {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        publish(current.load(std::memory_order_relaxed)->tree.with_root(key));
+    }
+
+    /**
+     * @brief Publishes a new version with a child node added to a specified parent node.
+     *
+     * Only the nodes on the path from the root to the parent are copied; the rest are shared with the previous version.
+     *
+     * @param parent_key The value of the parent node.
+     * @param child_key The value of the child node to add.
+     */
+    void add_sub_node(const T& parent_key, const T& child_key) {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        publish(current.load(std::memory_order_relaxed)->tree.with_sub_node(parent_key, child_key));
+    }
+
+    /**
+     * @brief Publishes a new version with the value of a node replaced.
+     *
+     * @param key The current value of the node to update.
+     * @param new_value The new value of the node.
+     */
+    void update_value(const T& key, const T& new_value) {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+        publish(current.load(std::memory_order_relaxed)->tree.with_value(key, new_value));
+    }
+
+private:
+    /**
+     * @brief Publishes a new version with the given root. The writer mutex must be held.
+     *
+     * @param tree The tree of the new version.
+     */
+    void publish(Tree<T, k> tree) {
+        auto previous = current.load(std::memory_order_relaxed);
+        auto next = std::make_shared<const Version>(Version{std::move(tree), previous->epoch + 1});
+        retired.push_back(previous);
+        current.store(std::move(next), std::memory_order_release);
+        purge_retired();
+    }
+
+    /**
+     * @brief Forgets the retired versions that no reader holds anymore. The writer mutex must be held.
+     */
+    void purge_retired() {
+        std::erase_if(retired, [](const std::weak_ptr<const Version>& version) {
+            return version.expired();
+        });
+    }
+};
+
+#endif // VERSIONEDTREE_HPP